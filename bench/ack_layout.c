@@ -0,0 +1,191 @@
+/*
+ * Simulated per-ACK memory access pattern of the datapath, before and after
+ * moving the per-ACK working set next to the socket.
+ *
+ * Each simulated flow has a socket (with the congestion control area inside
+ * it), a slot in a shared connection table (libccp's ccp_active_connections,
+ * holding the primitives) and separately allocated program state (registers).
+ * ACKs arrive for random flows, so with enough flows nothing stays cached.
+ *
+ *   before: in_ack_event follows ca->conn to write ECN primitives, the rest of
+ *           ACK processing runs, then cong_control fills the primitives and
+ *           the program reads its registers.
+ *   after:  in_ack_event only touches the socket (ECN is staged in ca) and
+ *           prefetches the primitives, so that miss overlaps with the rest
+ *           of ACK processing. Prefetching the program state as well needs
+ *           a dependent load of the connection slot and measured slower.
+ *
+ * Numbers are printed per round; compare the best round of each layout.
+ * Cache miss columns need perf_event_open access (perf_event_paranoid <= 2).
+ *
+ * usage: ./ack_layout [flows] [acks]
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define SOCK_BYTES 2048    // roughly a tcp_sock
+#define CA_OFFSET 1400     // where inet_csk_ca lives in it
+#define STATE_BYTES 640    // libccp program state: registers
+#define ACK_WORK_LINES 24  // other cache lines touched while processing an ACK
+#define ROUNDS 3
+
+struct prims {
+    uint64_t v[16];
+};
+
+// mirrors libccp's struct ccp_connection
+struct conn {
+    uint16_t index;
+    uint64_t last_create_msg_sent;
+    struct prims prims;
+    void *state;
+    void *impl;
+    void *datapath;
+};
+
+struct ca {
+    struct conn *conn;
+    uint32_t last_snd_una, last_bytes_acked, last_sacked_out;
+    uint32_t ecn_bytes, ecn_packets;
+};
+
+struct flow {
+    char *sock;
+    char *work; // stands in for the retransmit queue and friends
+};
+
+static inline struct ca *sock_ca(char *sock) {
+    return (struct ca *) (sock + CA_OFFSET);
+}
+
+static uint64_t sink;
+
+static inline void ack_work(struct flow *f) {
+    for (int i = 0; i < ACK_WORK_LINES; i++) {
+        sink += f->work[i * 64]++;
+    }
+}
+
+static inline void fold_and_invoke(struct ca *ca, char *sock) {
+    struct prims *p = &ca->conn->prims;
+    uint64_t *regs = ca->conn->state;
+    uint32_t snd_una = *(uint32_t *) sock;
+
+    p->v[0] = snd_una - ca->last_bytes_acked;
+    ca->last_bytes_acked = snd_una;
+    for (int i = 1; i < 16; i++) {
+        p->v[i] += i;
+    }
+    for (int i = 0; i < STATE_BYTES / 8; i += 8) {
+        regs[i] += p->v[i % 16];
+    }
+}
+
+static void ack_before(struct flow *f) {
+    struct ca *ca = sock_ca(f->sock);
+    // in_ack_event
+    ca->conn->prims.v[2] = ++ca->last_snd_una;
+    ca->conn->prims.v[3] = ca->last_snd_una / 1448;
+    // rest of tcp_ack
+    ack_work(f);
+    // cong_control
+    fold_and_invoke(ca, f->sock);
+}
+
+static void ack_after(struct flow *f) {
+    struct ca *ca = sock_ca(f->sock);
+    // in_ack_event
+    __builtin_prefetch(&ca->conn->prims, 1);
+    ca->ecn_bytes = ++ca->last_snd_una;
+    ca->ecn_packets = ca->last_snd_una / 1448;
+    // rest of tcp_ack
+    ack_work(f);
+    // cong_control
+    ca->conn->prims.v[2] = ca->ecn_bytes;
+    ca->conn->prims.v[3] = ca->ecn_packets;
+    fold_and_invoke(ca, f->sock);
+}
+
+static int perf_open(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(const char *name, void (*ack)(struct flow *), struct flow *flows, uint32_t *order, long acks) {
+    int misses = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    int l1 = perf_open(PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    uint64_t llc_count = 0, l1_count = 0;
+    double start, elapsed;
+
+    if (misses >= 0) { ioctl(misses, PERF_EVENT_IOC_RESET, 0); ioctl(misses, PERF_EVENT_IOC_ENABLE, 0); }
+    if (l1 >= 0) { ioctl(l1, PERF_EVENT_IOC_RESET, 0); ioctl(l1, PERF_EVENT_IOC_ENABLE, 0); }
+    start = now_ns();
+    for (long i = 0; i < acks; i++) {
+        ack(&flows[order[i]]);
+    }
+    elapsed = now_ns() - start;
+    if (misses >= 0) { ioctl(misses, PERF_EVENT_IOC_DISABLE, 0); read(misses, &llc_count, sizeof(llc_count)); close(misses); }
+    if (l1 >= 0) { ioctl(l1, PERF_EVENT_IOC_DISABLE, 0); read(l1, &l1_count, sizeof(l1_count)); close(l1); }
+
+    printf("%-8s %10.1f", name, elapsed / acks);
+    if (misses >= 0) printf(" %14.2f", (double) llc_count / acks); else printf(" %14s", "n/a");
+    if (l1 >= 0) printf(" %14.2f\n", (double) l1_count / acks); else printf(" %14s\n", "n/a");
+}
+
+int main(int argc, char **argv) {
+    long nflows = argc > 1 ? atol(argv[1]) : 100000;
+    long acks = argc > 2 ? atol(argv[2]) : 5000000;
+    struct conn *table = calloc(nflows, sizeof(struct conn));
+    struct flow *flows = calloc(nflows, sizeof(struct flow));
+    uint32_t *order = malloc(acks * sizeof(uint32_t));
+
+    srand(1);
+    for (long i = 0; i < nflows; i++) {
+        flows[i].sock = aligned_alloc(64, SOCK_BYTES);
+        flows[i].work = aligned_alloc(64, ACK_WORK_LINES * 64);
+        memset(flows[i].sock, 0, SOCK_BYTES);
+        memset(flows[i].work, 0, ACK_WORK_LINES * 64);
+        table[i].index = i + 1;
+        table[i].state = aligned_alloc(64, STATE_BYTES);
+        memset(table[i].state, 0, STATE_BYTES);
+        table[i].impl = flows[i].sock;
+        sock_ca(flows[i].sock)->conn = &table[i];
+    }
+    for (long i = 0; i < acks; i++) {
+        order[i] = rand() % nflows;
+    }
+
+    printf("%ld flows, %ld ACKs\n", nflows, acks);
+    printf("%-8s %10s %14s %14s\n", "layout", "ns/ACK", "LLC miss/ACK", "L1D miss/ACK");
+    // warm up page tables and allocator state
+    run("warmup", ack_before, flows, order, acks / 10);
+    // alternate so that drift on a busy host hits both equally
+    for (int round = 0; round < ROUNDS; round++) {
+        run("before", ack_before, flows, order, acks);
+        run("after", ack_after, flows, order, acks);
+    }
+    fprintf(stderr, "(%lu)\n", (unsigned long) sink);
+    return 0;
+}
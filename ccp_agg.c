@@ -0,0 +1,211 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/jhash.h>
+#include <net/netns/hash.h>
+#include <net/tcp.h>
+
+#include "ccp_agg.h"
+#include "ccp_ipc.h"
+#include "ccp_setup.h"
+#include "ccp_stats.h"
+
+#define CCP_AGG_OFF       0
+#define CCP_AGG_DST       1
+#define CCP_AGG_DST_PORT  2
+
+static unsigned int aggregate = CCP_AGG_OFF;
+module_param(aggregate, uint, 0644);
+MODULE_PARM_DESC(aggregate, "Aggregate new flows by destination: 0 = off, 1 = address, 2 = address and port");
+
+void ccp_agg_net_init(struct ccp_net *cn) {
+    hash_init(cn->aggs);
+}
+
+bool ccp_agg_enabled(void) {
+    unsigned int mode = READ_ONCE(aggregate);
+    return mode == CCP_AGG_DST || mode == CCP_AGG_DST_PORT;
+}
+
+static struct ccp_agg *ccp_agg_lookup(
+    struct ccp_net *cn,
+    u32 key,
+    const struct net *net,
+    u32 dst_ip,
+    u16 dst_port,
+    const struct tcp_congestion_ops *ops
+) {
+    struct ccp_agg *agg;
+
+    hash_for_each_possible(cn->aggs, agg, node, key) {
+        if (net_eq(agg->net, net) && agg->dst_ip == dst_ip && agg->dst_port == dst_port && agg->ops == ops) {
+            return agg;
+        }
+    }
+
+    return NULL;
+}
+
+int ccp_agg_join(struct sock *sk) {
+    struct ccp *ca = inet_csk_ca(sk);
+    struct ccp_datapath *dp = ccp_sk_datapath(sk);
+    struct ccp_net *cn = dp->impl;
+    const struct tcp_congestion_ops *ops = inet_csk(sk)->icsk_ca_ops;
+    const struct net *net = sock_net(sk);
+    struct ccp_datapath_info info;
+    struct ccp_agg *agg, *fresh;
+    struct ccp_meta *meta;
+    struct ccp_connection *created = NULL;
+    char prog[CCP_DEFAULT_PROG_MAX_LEN];
+    int prog_len = 0, node;
+    u16 dst_port;
+    u32 key;
+
+    ccp_flow_info(sk, &info);
+    dst_port = READ_ONCE(aggregate) == CCP_AGG_DST_PORT ? info.dst_port : 0;
+    // flows that asked for different algorithms are never mixed, and with
+    // the character device every namespace shares init_net's table, where
+    // tenants may well use the same addresses
+    key = jhash_3words(info.dst_ip, dst_port, (u32) (unsigned long) ops, net_hash_mix(net));
+
+    // from the setup caches: joins run in atomic context, and allocating
+    // under the lock is worse
+    node = ccp_sk_node(sk);
+    meta = ccp_setup_meta_get(node);
+    fresh = ccp_setup_agg_get(node);
+    if (!meta || !fresh) {
+        ccp_setup_meta_put(meta);
+        ccp_setup_agg_put(fresh);
+        return -ENOMEM;
+    }
+
+    ccp_ipc_table_lock(cn);
+    agg = ccp_agg_lookup(cn, key, net, info.dst_ip, dst_port, ops);
+    if (agg == NULL) {
+        // the agent sees the aggregate as one flow, described by its first member
+        fresh->conn = ccp_connection_start(dp, (void *) sk, &info);
+        if (fresh->conn == NULL) {
+            ccp_ipc_table_unlock(cn);
+            ccp_setup_meta_put(meta);
+            ccp_setup_agg_put(fresh);
+            return -ENOSPC;
+        }
+        agg = fresh;
+        fresh = NULL;
+        agg->net = net;
+        agg->dst_ip = info.dst_ip;
+        agg->dst_port = dst_port;
+        agg->ops = ops;
+        spin_lock_init(&agg->lock);
+        INIT_HLIST_HEAD(&agg->members);
+        atomic_set(&agg->gen, 0);
+        hash_add(cn->aggs, &agg->node, key);
+        pr_info("[ccp] new aggregate %d\n", agg->conn->index);
+        ccp_stats_flow_start(dp, agg->conn->index);
+        prog_len = ccp_ipc_flow_start(dp, agg->conn, info.congAlg, prog);
+        created = agg->conn;
+    }
+
+    meta->sk = sk;
+    hlist_add_head(&meta->agg_node, &agg->members);
+    ca->meta = meta;
+    WRITE_ONCE(agg->num_members, agg->num_members + 1);
+    atomic_inc(&agg->gen);
+
+    ca->agg = agg;
+    ca->conn = agg->conn;
+    // apply the aggregate's share on the first ACK
+    ca->agg_gen = atomic_read(&agg->gen) - 1;
+    ccp_ipc_table_unlock(cn);
+
+    if (prog_len > 0) {
+        ccp_ipc_flow_default_prog(dp, created, prog, prog_len);
+    }
+
+    // unused if sk joined an existing aggregate
+    ccp_setup_agg_put(fresh);
+    return 0;
+}
+
+void ccp_agg_leave(struct sock *sk) {
+    struct ccp *ca = inet_csk_ca(sk);
+    struct ccp_agg *agg = ca->agg;
+    struct ccp_datapath *dp = ccp_sk_datapath(sk);
+    struct ccp_net *cn = dp->impl;
+    struct ccp_meta *next;
+
+    ccp_ipc_table_lock(cn);
+    hlist_del(&ca->meta->agg_node);
+    WRITE_ONCE(agg->num_members, agg->num_members - 1);
+    atomic_inc(&agg->gen);
+
+    if (agg->num_members == 0) {
+        hash_del(&agg->node);
+        pr_info("[ccp] freeing aggregate %d\n", agg->conn->index);
+        ccp_connection_free(dp, agg->conn->index);
+    } else {
+        // keep the connection's impl pointing at a live socket
+        spin_lock(&agg->lock);
+        if (agg->conn->impl == (void *) sk) {
+            next = hlist_entry(agg->members.first, struct ccp_meta, agg_node);
+            WRITE_ONCE(agg->conn->impl, next->sk);
+        }
+        spin_unlock(&agg->lock);
+        agg = NULL;
+    }
+    ccp_ipc_table_unlock(cn);
+
+    ca->agg = NULL;
+    ca->conn = NULL;
+    ccp_setup_meta_put(ca->meta);
+    ca->meta = NULL;
+    ccp_setup_agg_put(agg);
+}
+
+void ccp_agg_apply(struct sock *sk) {
+    struct ccp *ca = inet_csk_ca(sk);
+    struct ccp_agg *agg = ca->agg;
+    struct tcp_sock *tp = tcp_sk(sk);
+    u32 gen = atomic_read(&agg->gen);
+    u32 members, cwnd, rate;
+
+    if (gen == ca->agg_gen) {
+        return;
+    }
+
+    ca->agg_gen = gen;
+    members = max_t(u32, READ_ONCE(agg->num_members), 1);
+    cwnd = READ_ONCE(agg->cwnd);
+    rate = READ_ONCE(agg->rate);
+
+    if (cwnd != 0) {
+        tp->snd_cwnd = max_t(u32, cwnd / members / tp->mss_cache, 2);
+    }
+
+    if (rate != 0) {
+        ccp_set_pacing_rate(sk, rate / members);
+    }
+}
+
+bool ccp_agg_set_cwnd(struct sock *sk, u32 cwnd) {
+    struct ccp *ca = inet_csk_ca(sk);
+
+    if (ca->agg == NULL) {
+        return false;
+    }
+
+    WRITE_ONCE(ca->agg->cwnd, cwnd);
+    atomic_inc(&ca->agg->gen);
+    return true;
+}
+
+bool ccp_agg_set_rate(struct sock *sk, u32 rate) {
+    struct ccp *ca = inet_csk_ca(sk);
+
+    if (ca->agg == NULL) {
+        return false;
+    }
+
+    WRITE_ONCE(ca->agg->rate, rate);
+    atomic_inc(&ca->agg->gen);
+    return true;
+}
@@ -0,0 +1,91 @@
+/*
+ * CCP Flow Aggregation
+ *
+ * In aggregation mode, flows sharing a key (network namespace, destination
+ * address, or address and port, and the algorithm they asked for) join one
+ * aggregate which has a single libccp connection: one control loop and one
+ * report stream for all of them. Every member's ACKs
+ * run the aggregate's program, so its folds see the combined measurements.
+ * The cwnd and rate the agent sets apply to the whole aggregate and are
+ * divided evenly between the members, each picking up its share on its
+ * next ACK.
+ */
+#ifndef CCP_AGG_H
+#define CCP_AGG_H
+
+#include "libccp/ccp.h"
+#include "tcp_ccp.h"
+
+struct ccp_agg {
+    struct hlist_node node; // in ccp_net.aggs
+    const struct net *net; // members' namespace
+    u32 dst_ip;
+    u16 dst_port; // 0 when aggregating by address only
+    const struct tcp_congestion_ops *ops; // members' algorithm, see ccp_sk_alg
+    struct ccp_connection *conn;
+    spinlock_t lock; // serializes members running the program
+    struct hlist_head members;
+    u32 num_members;
+    atomic_t gen; // bumped whenever a member's share changes
+    u32 cwnd; // bytes, for the whole aggregate (0 = not set yet)
+    u32 rate; // bytes per second, for the whole aggregate (0 = not set yet)
+};
+
+/* Set up and tear down a namespace's aggregate table.
+ */
+void ccp_agg_net_init(struct ccp_net *cn);
+
+/* Whether new flows should join aggregates.
+ */
+bool ccp_agg_enabled(void);
+
+/* Make sk a member of the aggregate for its key, creating it if need be.
+ * On success sk's ccp.conn is the aggregate's connection.
+ */
+int ccp_agg_join(struct sock *sk);
+
+/* Remove sk from its aggregate, freeing it with its last member.
+ */
+void ccp_agg_leave(struct sock *sk);
+
+/* Apply the aggregate's current cwnd/rate share to sk if it changed.
+ * Called with sk locked; a member only ever changes its own socket.
+ */
+void ccp_agg_apply(struct sock *sk);
+
+/* Actuation from the aggregate's program or the agent (libccp's
+ * set_cwnd/set_rate_abs), with sk the connection's current impl, whose
+ * lock may not be held. Only publishes the new value; every member,
+ * sk included, applies its share on its next ACK. Return false if sk is
+ * not a member.
+ */
+bool ccp_agg_set_cwnd(struct sock *sk, u32 cwnd);
+bool ccp_agg_set_rate(struct sock *sk, u32 rate);
+
+/* Bracket running the aggregate's program (or touching its primitives)
+ * from sk. No-ops for flows that are not aggregated.
+ */
+static inline void ccp_agg_begin(struct sock *sk) {
+    struct ccp *ca = inet_csk_ca(sk);
+    if (ca->agg != NULL) {
+        spin_lock_bh(&ca->agg->lock);
+        // libccp's callbacks act on the connection's impl
+        WRITE_ONCE(ca->conn->impl, sk);
+    }
+}
+
+/* The cwnd the aggregate's program sees: the aggregate's, not the member's.
+ */
+static inline u32 ccp_agg_snd_cwnd(struct ccp *ca, u32 member_cwnd) {
+    u32 cwnd = READ_ONCE(ca->agg->cwnd);
+    return cwnd != 0 ? cwnd : member_cwnd * READ_ONCE(ca->agg->num_members);
+}
+
+static inline void ccp_agg_end(struct sock *sk) {
+    struct ccp *ca = inet_csk_ca(sk);
+    if (ca->agg != NULL) {
+        spin_unlock_bh(&ca->agg->lock);
+    }
+}
+
+#endif
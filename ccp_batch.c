@@ -0,0 +1,192 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/hrtimer.h>
+#include <linux/percpu.h>
+#include <linux/prefetch.h>
+#include <net/tcp.h>
+
+#include "tcp_ccp.h"
+#include "ccp_batch.h"
+#include "ccp_ipc.h"
+
+static unsigned int batch_usecs = 0;
+module_param(batch_usecs, uint, 0644);
+MODULE_PARM_DESC(batch_usecs, "Run queued flows' programs from a per-CPU timer with this period, in microseconds (0 = run them on every ACK)");
+
+/* A CPU's queued flows and their latest rate samples, one array per field
+ * so the tick walks each of them sequentially. Only touched on its own CPU,
+ * with BHs disabled.
+ */
+struct ccp_batch_cpu {
+    struct hrtimer timer;
+    u32 n;
+    struct sock *sk[CCP_BATCH_FLOWS]; // holds a reference while queued
+    long interval_us[CCP_BATCH_FLOWS];
+    long rtt_us[CCP_BATCH_FLOWS];
+    s32 delivered[CCP_BATCH_FLOWS];
+    u32 rcv_interval_us[CCP_BATCH_FLOWS];
+    u32 snd_interval_us[CCP_BATCH_FLOWS];
+};
+
+static struct ccp_batch_cpu __percpu *batches = NULL;
+
+bool ccp_batch_enabled(void) {
+    return READ_ONCE(batch_usecs) != 0 && batches != NULL;
+}
+
+static inline void ccp_batch_copy(struct ccp_batch_cpu *b, u32 to, u32 from) {
+    b->sk[to] = b->sk[from];
+    b->interval_us[to] = b->interval_us[from];
+    b->rtt_us[to] = b->rtt_us[from];
+    b->delivered[to] = b->delivered[from];
+    b->rcv_interval_us[to] = b->rcv_interval_us[from];
+    b->snd_interval_us[to] = b->snd_interval_us[from];
+}
+
+bool ccp_batch_enqueue(struct sock *sk, const struct rate_sample *rs) {
+    struct ccp *ca = inet_csk_ca(sk);
+    struct ccp_batch_cpu *b;
+    unsigned int usecs = READ_ONCE(batch_usecs);
+    int cpu;
+    u32 i;
+
+    if (usecs == 0) {
+        return false;
+    }
+
+    // cong_control also runs from the socket backlog, in process context
+    local_bh_disable();
+    b = this_cpu_ptr(batches);
+    cpu = smp_processor_id();
+
+    if (ca->batch_cpu == cpu) {
+        i = ca->batch_slot;
+        // keep the last usable sample rather than one that would skip the fold
+        if (rs->delivered <= 0 || rs->interval_us <= 0) {
+            local_bh_enable();
+            return true;
+        }
+    } else if (ca->batch_cpu >= 0 || b->n == CCP_BATCH_FLOWS) {
+        // the flow's ACKs moved to this CPU, or the batch is full: run it
+        // now, and let the other CPU's tick drop its stale entry
+        ca->batch_cpu = -1;
+        local_bh_enable();
+        return false;
+    } else {
+        i = b->n++;
+        sock_hold(sk);
+        b->sk[i] = sk;
+        ca->batch_cpu = cpu;
+        ca->batch_slot = i;
+        if (!hrtimer_is_queued(&b->timer)) {
+            hrtimer_start(&b->timer, ns_to_ktime((u64) usecs * NSEC_PER_USEC), HRTIMER_MODE_REL_PINNED_SOFT);
+        }
+    }
+
+    b->interval_us[i] = rs->interval_us;
+    b->rtt_us[i] = rs->rtt_us;
+    b->delivered[i] = rs->delivered;
+    b->rcv_interval_us[i] = rs->rcv_interval_us;
+    b->snd_interval_us[i] = rs->snd_interval_us;
+    local_bh_enable();
+    return true;
+}
+
+/* One tick: fold and run every flow queued on this CPU. A flow whose
+ * socket is owned by a user context stays queued for the next tick, like
+ * TSQ's deferred work; its ACKs keep accumulating meanwhile.
+ */
+static enum hrtimer_restart ccp_batch_tick(struct hrtimer *timer) {
+    struct ccp_batch_cpu *b = container_of(timer, struct ccp_batch_cpu, timer);
+    int cpu = smp_processor_id();
+    u32 n = b->n, kept = 0, i;
+
+    ccp_ipc_batch_begin();
+    for (i = 0; i < n; i++) {
+        struct sock *sk = b->sk[i];
+        struct ccp *ca = inet_csk_ca(sk);
+        struct rate_sample rs;
+
+        if (i + 1 < n) {
+            prefetchw(inet_csk_ca(b->sk[i + 1]));
+        }
+
+        bh_lock_sock(sk);
+        if (!ccp_sk_is_ccp(sk) || ca->batch_cpu != cpu || ca->batch_slot != i) {
+            // released, or ran (or was requeued) elsewhere since
+            bh_unlock_sock(sk);
+            sock_put(sk);
+            continue;
+        }
+
+        if (sock_owned_by_user(sk)) {
+            ccp_batch_copy(b, kept, i);
+            ca->batch_slot = kept++;
+            bh_unlock_sock(sk);
+            continue;
+        }
+
+        ca->batch_cpu = -1;
+        if (ca->conn != NULL) {
+            memset(&rs, 0, sizeof(rs));
+            rs.interval_us = b->interval_us[i];
+            rs.rtt_us = b->rtt_us[i];
+            rs.delivered = b->delivered[i];
+            rs.rcv_interval_us = b->rcv_interval_us[i];
+            rs.snd_interval_us = b->snd_interval_us[i];
+            ccp_fold_and_invoke(sk, &rs);
+        }
+        bh_unlock_sock(sk);
+        sock_put(sk);
+    }
+    b->n = kept;
+    ccp_ipc_batch_flush();
+
+    if (kept > 0) {
+        hrtimer_forward_now(timer, ns_to_ktime((u64) max(READ_ONCE(batch_usecs), 1U) * NSEC_PER_USEC));
+        return HRTIMER_RESTART;
+    }
+
+    return HRTIMER_NORESTART;
+}
+
+int ccp_batch_init(void) {
+    int cpu;
+
+    batches = alloc_percpu(struct ccp_batch_cpu);
+    if (batches == NULL) {
+        pr_info("[ccp] could not allocate batch buffers, batch mode unavailable\n");
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu) {
+        struct ccp_batch_cpu *b = per_cpu_ptr(batches, cpu);
+        hrtimer_init(&b->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED_SOFT);
+        b->timer.function = ccp_batch_tick;
+        b->n = 0;
+    }
+
+    return 0;
+}
+
+// Only called once no socket uses the module any more.
+void ccp_batch_exit(void) {
+    int cpu;
+    u32 i;
+
+    if (batches == NULL) {
+        return;
+    }
+
+    for_each_possible_cpu(cpu) {
+        struct ccp_batch_cpu *b = per_cpu_ptr(batches, cpu);
+        hrtimer_cancel(&b->timer);
+        for (i = 0; i < b->n; i++) {
+            sock_put(b->sk[i]);
+        }
+        b->n = 0;
+    }
+
+    free_percpu(batches);
+    batches = NULL;
+}
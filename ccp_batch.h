@@ -0,0 +1,36 @@
+/*
+ * CCP Batch Mode
+ *
+ * With batch_usecs set, an ACK no longer runs its flow's program. It only
+ * records the ACK's rate sample in its CPU's batch (its counters keep
+ * accumulating in struct ccp), and a per-CPU timer then folds and runs
+ * every flow queued on that CPU in one pass, every batch_usecs. The
+ * reports produced during a pass go to the agent together, concatenated
+ * in as few transport messages as they fit in (see ccp_ipc_batch_begin).
+ *
+ * This trades up to batch_usecs of control latency for fewer, larger
+ * sends and a warm instruction cache, which pays off with many low-rate
+ * flows. Losses, ECN and timeouts do not wait for the timer.
+ */
+#ifndef CCP_BATCH_H
+#define CCP_BATCH_H
+
+#include <net/tcp.h>
+
+// flows each CPU can have queued per tick; further flows run on their ACK
+#define CCP_BATCH_FLOWS 256
+
+int ccp_batch_init(void);
+void ccp_batch_exit(void);
+
+/* Whether ACKs should be queued rather than run.
+ */
+bool ccp_batch_enabled(void);
+
+/* Queue sk (or update its queued rate sample) for this CPU's next tick.
+ * Returns false if the flow could not be queued and should run now.
+ * Called with sk locked, from cong_control.
+ */
+bool ccp_batch_enqueue(struct sock *sk, const struct rate_sample *rs);
+
+#endif
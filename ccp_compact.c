@@ -0,0 +1,156 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+
+#include "ccp_compact.h"
+#include "ccp_ipc.h"
+
+static bool compact_reports = true;
+module_param(compact_reports, bool, 0444);
+MODULE_PARM_DESC(compact_reports, "Let the agent ask for delta-encoded reports");
+
+void ccp_compact_net_init(struct ccp_net *cn) {
+    cn->report_format = CCP_REPORT_FULL;
+    cn->report_epoch = 0;
+    cn->report_bases = NULL;
+    if (!compact_reports) {
+        return;
+    }
+
+    cn->report_bases = kvcalloc(cn->dp->max_connections, sizeof(struct ccp_report_base), GFP_KERNEL);
+    if (!cn->report_bases) {
+        pr_info("[ccp] could not allocate report bases, compact reports disabled\n");
+    }
+}
+
+void ccp_compact_net_exit(struct ccp_net *cn) {
+    kvfree(cn->report_bases);
+    cn->report_bases = NULL;
+}
+
+u32 ccp_compact_set_format(struct ccp_net *cn, u32 format) {
+    if (format != CCP_REPORT_FULL && (format != CCP_REPORT_COMPACT || cn->report_bases == NULL)) {
+        return READ_ONCE(cn->report_format);
+    }
+
+    // every flow starts over with a key frame
+    WRITE_ONCE(cn->report_epoch, cn->report_epoch + 1);
+    WRITE_ONCE(cn->report_format, format);
+    return format;
+}
+
+static inline struct ccp_report_base *ccp_report_base(struct ccp_datapath *dp, u32 sid) {
+    struct ccp_net *cn = dp->impl;
+
+    if (cn->report_bases == NULL || sid == 0 || sid > dp->max_connections) {
+        return NULL;
+    }
+    return &cn->report_bases[sid - 1];
+}
+
+void ccp_compact_key(struct ccp_datapath *dp, u32 sid) {
+    struct ccp_report_base *base = ccp_report_base(dp, sid);
+
+    if (base != NULL) {
+        WRITE_ONCE(base->key, true);
+    }
+}
+
+void ccp_compact_ack(struct ccp_datapath *dp, u32 sid, u8 seq) {
+    struct ccp_report_base *base = ccp_report_base(dp, sid);
+
+    if (base != NULL) {
+        WRITE_ONCE(base->ack, CCP_COMPACT_ACK_PENDING | seq);
+    }
+}
+
+// Make the acknowledged report the base, if it is still remembered and newer
+static void ccp_compact_take_ack(struct ccp_report_base *base, u8 seq) {
+    struct ccp_report_snap *snap = &base->sent[seq % CCP_COMPACT_INFLIGHT];
+
+    if (!snap->valid || snap->seq != seq) {
+        return;
+    }
+    if (base->acked.valid && (s8) (seq - base->acked.seq) <= 0) {
+        return;
+    }
+    base->acked = *snap;
+}
+
+static void ccp_compact_reset(struct ccp_report_base *base) {
+    int i;
+
+    base->acked.valid = false;
+    for (i = 0; i < CCP_COMPACT_INFLIGHT; i++) {
+        base->sent[i].valid = false;
+    }
+}
+
+/* Runs where the flow's reports are produced (under its socket lock, or
+ * its aggregate's lock), so the base has a single writer; the agent's
+ * acks and key frame requests are taken from base->ack and base->key.
+ */
+int ccp_compact_encode(struct ccp_datapath *dp, const char *msg, int msg_size, char *out) {
+    const struct CcpMsgHeader *hdr = (const struct CcpMsgHeader *) msg;
+    const struct ccp_measure_body *body = (const struct ccp_measure_body *) (msg + sizeof(struct CcpMsgHeader));
+    struct ccp_net *cn = dp->impl;
+    struct ccp_report_base *base = ccp_report_base(dp, hdr->SocketId);
+    struct CcpMsgHeader *out_hdr = (struct CcpMsgHeader *) out;
+    struct ccp_compact_report *rep = (struct ccp_compact_report *) (out + sizeof(struct CcpMsgHeader));
+    struct ccp_report_snap *snap;
+    u32 epoch = READ_ONCE(cn->report_epoch);
+    u32 ack, i, n;
+    bool key;
+    char *p;
+
+    if (base == NULL ||
+        msg_size < sizeof(struct CcpMsgHeader) + sizeof(struct ccp_measure_body) ||
+        body->num_fields > CCP_COMPACT_MAX_FIELDS ||
+        sizeof(struct CcpMsgHeader) + sizeof(struct ccp_measure_body) + body->num_fields * sizeof(u64) != msg_size) {
+        return 0;
+    }
+
+    ack = xchg(&base->ack, 0);
+    if (ack & CCP_COMPACT_ACK_PENDING) {
+        ccp_compact_take_ack(base, (u8) ack);
+    }
+    // a requested key frame also drops any ack of a report before it
+    if (READ_ONCE(base->key) || base->epoch != epoch) {
+        WRITE_ONCE(base->key, false);
+        base->epoch = epoch;
+        ccp_compact_reset(base);
+    }
+    if (base->acked.valid && base->acked.program_uid != body->program_uid) {
+        base->acked.valid = false;
+    }
+    key = !base->acked.valid;
+
+    n = body->num_fields;
+    rep->flags = key ? CCP_COMPACT_KEY : 0;
+    rep->seq = base->seq;
+    rep->base_seq = key ? 0 : base->acked.seq;
+    rep->num_fields = n;
+
+    p = (char *) &rep->changed[DIV_ROUND_UP(n, 8)];
+    if (key) {
+        p = ccp_put_varint(p, body->program_uid);
+    }
+
+    // copied out first: the packed body's fields may be unaligned
+    snap = &base->sent[base->seq % CCP_COMPACT_INFLIGHT];
+    memcpy(snap->fields, body->fields, n * sizeof(u64));
+    // a field the acked report did not have counts from 0
+    for (i = n; i < CCP_COMPACT_MAX_FIELDS; i++) {
+        snap->fields[i] = 0;
+    }
+    p = ccp_put_deltas(p, rep->changed, snap->fields, key ? NULL : base->acked.fields, n);
+    snap->program_uid = body->program_uid;
+    snap->seq = base->seq++;
+    snap->valid = true;
+
+    out_hdr->Type = CCP_EXT_MEASURE_COMPACT;
+    out_hdr->Len = p - out;
+    out_hdr->SocketId = hdr->SocketId;
+    return out_hdr->Len;
+}
@@ -0,0 +1,107 @@
+/*
+ * CCP Compact Reports
+ *
+ * Once the agent asks for them (CCP_EXT_SET_REPORT_FORMAT), routine
+ * measurement reports go out as CCP_EXT_MEASURE_COMPACT messages instead of
+ * MEASURE: only the fields that differ from the last report the agent
+ * acknowledged (CCP_EXT_REPORT_ACK), each as the zigzag varint of its
+ * difference (ccp_varint.h), flagged in a bitmap. Body:
+ *
+ *   struct ccp_compact_report
+ *   u8 changed[(num_fields + 7) / 8]  bit i (LSB first) set if field i changed
+ *   varint program_uid                key frames only
+ *   varint delta per changed field    zigzag(field - acked field)
+ *
+ * A delta frame names the acknowledged report it is relative to in
+ * base_seq, so reports lost in a failed (possibly batched) send, or
+ * overtaken by an urgent one, never leave the agent decoding against
+ * values it does not have. A key frame is relative to all-zero fields;
+ * every report is one until the agent acknowledges a report of the flow's
+ * current program and format, and the next routine report after any
+ * report that went out on the urgent lane or failed to send is one too.
+ * The agent can also ask for one with CCP_EXT_REPORT_KEYFRAME. Urgent
+ * reports, and reports with more than CCP_COMPACT_MAX_FIELDS fields, are
+ * always sent as MEASURE.
+ */
+#ifndef CCP_COMPACT_H
+#define CCP_COMPACT_H
+
+#include "libccp/ccp.h"
+#include "libccp/serialize.h"
+#include "tcp_ccp.h"
+#include "ccp_varint.h"
+
+#define CCP_REPORT_FULL    0 // MEASURE
+#define CCP_REPORT_COMPACT 1 // CCP_EXT_MEASURE_COMPACT
+
+#define CCP_COMPACT_MAX_FIELDS 16
+
+#define CCP_COMPACT_KEY (1 << 0) // ccp_compact_report.flags
+
+struct ccp_compact_report {
+    u8 flags;
+    u8 seq;
+    u8 base_seq; // seq of the acknowledged report a delta frame is relative to
+    u8 num_fields;
+    u8 changed[];
+} __attribute__((packed));
+
+// header, body, bitmap, and a varint each for program_uid and the fields
+#define CCP_COMPACT_MAX_LEN (sizeof(struct CcpMsgHeader) + sizeof(struct ccp_compact_report) + \
+    DIV_ROUND_UP(CCP_COMPACT_MAX_FIELDS, 8) + CCP_VARINT_MAX_LEN * (CCP_COMPACT_MAX_FIELDS + 1))
+
+// Sent reports remembered until the agent acknowledges one
+#define CCP_COMPACT_INFLIGHT 4
+
+#define CCP_COMPACT_ACK_PENDING (1 << 8) // ccp_report_base.ack, above the seq
+
+struct ccp_report_snap {
+    u64 fields[CCP_COMPACT_MAX_FIELDS];
+    u32 program_uid;
+    u8 seq;
+    bool valid;
+};
+
+/* What a flow's reports are encoded against, indexed by connection index - 1.
+ * Acks only land in ack and key requests in key; the encoder takes them
+ * from there, so everything else has a single writer.
+ */
+struct ccp_report_base {
+    struct ccp_report_snap acked; // invalid until the agent acks a report
+    struct ccp_report_snap sent[CCP_COMPACT_INFLIGHT]; // by seq % CCP_COMPACT_INFLIGHT
+    u32 epoch; // ccp_net.report_epoch this base belongs to
+    u32 ack; // CCP_COMPACT_ACK_PENDING | seq of the latest ack, not yet taken
+    u8 seq;
+    bool key; // the next report must be a key frame
+};
+
+/* Per-namespace setup: a base for each of the datapath's connections.
+ * Without them (compact_reports=0, or no memory) the agent only gets
+ * MEASURE.
+ */
+void ccp_compact_net_init(struct ccp_net *cn);
+void ccp_compact_net_exit(struct ccp_net *cn);
+
+static inline bool ccp_compact_enabled(struct ccp_net *cn) {
+    return READ_ONCE(cn->report_format) == CCP_REPORT_COMPACT;
+}
+
+/* Switch the namespace's report format. Returns the format now in effect.
+ */
+u32 ccp_compact_set_format(struct ccp_net *cn, u32 format);
+
+/* A connection index was (re)used, one of sid's reports went out of band,
+ * or the agent lost track of sid: its next report is a key frame.
+ */
+void ccp_compact_key(struct ccp_datapath *dp, u32 sid);
+
+/* The agent decoded sid's report seq: later reports may be relative to it.
+ */
+void ccp_compact_ack(struct ccp_datapath *dp, u32 sid, u8 seq);
+
+/* Encode the MEASURE message msg into out (CCP_COMPACT_MAX_LEN bytes).
+ * Returns its length, or 0 if msg should go out as it is.
+ */
+int ccp_compact_encode(struct ccp_datapath *dp, const char *msg, int msg_size, char *out);
+
+#endif
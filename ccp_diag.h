@@ -0,0 +1,37 @@
+/*
+ * CCP Socket Diagnostics
+ *
+ * What tcp_ccp_get_info reports about a flow in inet_diag (sock_diag)
+ * dumps, so tools can see which flows the agent controls and with which
+ * program without asking the agent. The record is carried in its own
+ * attribute, INET_DIAG_CCPINFO, and is bounded by union tcp_cc_info.
+ * The full primitives of every flow are available to the agent through
+ * CCP_EXT_RESYNC.
+ */
+#ifndef CCP_DIAG_H
+#define CCP_DIAG_H
+
+#include <linux/types.h>
+
+/* Attribute type of struct tcp_ccp_info. Chosen well above the kernel's
+ * INET_DIAG_* range so that new kernel attributes never collide with it.
+ */
+#define INET_DIAG_CCPINFO 0x3c00
+
+// tcp_ccp_info.flags
+#define CCP_INFO_REGISTERED (1 << 0) // the agent controls the flow
+#define CCP_INFO_LAZY       (1 << 1) // running Reno until it is registered
+#define CCP_INFO_AGGREGATED (1 << 2) // sid is its aggregate's connection
+#define CCP_INFO_FALLBACK   (1 << 3) // the agent went quiet, libccp fell back
+#define CCP_INFO_TRACED     (1 << 4) // inputs are being recorded
+
+struct tcp_ccp_info {
+    __u32 sid; // connection index, 0 if not registered
+    __u32 program_uid; // 0 if no program is installed
+    __u32 reports; // reports produced by the flow's program
+    __u16 reports_thinned; // program runs deferred under backpressure
+    __u16 flags;
+    __u32 rtt_sample_us; // of the flow's last fold
+};
+
+#endif
@@ -0,0 +1,131 @@
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/fault-inject.h>
+#include <linux/jiffies.h>
+#include <linux/random.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#include "ccp_fault.h"
+#include "ccp_stats.h"
+
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+
+static DECLARE_FAULT_ATTR(fail_send);
+static DECLARE_FAULT_ATTR(fail_recv);
+static DECLARE_FAULT_ATTR(corrupt_recv);
+static DECLARE_FAULT_ATTR(fail_conn);
+
+static atomic64_t sends_failed = ATOMIC64_INIT(0);
+static atomic64_t recvs_dropped = ATOMIC64_INIT(0);
+static atomic64_t recvs_corrupted = ATOMIC64_INIT(0);
+static atomic64_t recvs_stalled = ATOMIC64_INIT(0);
+static atomic64_t conns_failed = ATOMIC64_INIT(0);
+
+static unsigned long stall_until = 0; // jiffies
+
+bool ccp_fault_send(void) {
+    if (!should_fail(&fail_send, 1)) {
+        return false;
+    }
+    atomic64_inc(&sends_failed);
+    return true;
+}
+
+bool ccp_fault_conn(void) {
+    if (!should_fail(&fail_conn, 1)) {
+        return false;
+    }
+    atomic64_inc(&conns_failed);
+    return true;
+}
+
+bool ccp_fault_recv_drop(void) {
+    unsigned long until = READ_ONCE(stall_until);
+
+    if (until != 0 && time_before(jiffies, until)) {
+        atomic64_inc(&recvs_stalled);
+        return true;
+    }
+    if (should_fail(&fail_recv, 1)) {
+        atomic64_inc(&recvs_dropped);
+        return true;
+    }
+    return false;
+}
+
+char *ccp_fault_recv_corrupt(const char *buf, int len) {
+    char *copy;
+
+    if (len <= 0 || !should_fail(&corrupt_recv, len)) {
+        return NULL;
+    }
+
+    // the agent's buffer may be an skb's data, so corrupt a copy
+    copy = kmemdup(buf, len, GFP_ATOMIC);
+    if (copy == NULL) {
+        return NULL;
+    }
+    copy[get_random_u32_below(len)] ^= 1 + get_random_u32_below(255);
+    atomic64_inc(&recvs_corrupted);
+    return copy;
+}
+
+static int ccp_fault_stall_set(void *data, u64 val) {
+    WRITE_ONCE(stall_until, val ? jiffies + msecs_to_jiffies(val) : 0);
+    return 0;
+}
+
+static int ccp_fault_stall_get(void *data, u64 *val) {
+    unsigned long until = READ_ONCE(stall_until);
+    *val = until != 0 && time_before(jiffies, until) ? jiffies_to_msecs(until - jiffies) : 0;
+    return 0;
+}
+
+DEFINE_DEBUGFS_ATTRIBUTE(ccp_fault_stall_fops, ccp_fault_stall_get, ccp_fault_stall_set, "%llu\n");
+
+static int ccp_fault_injected_show(struct seq_file *m, void *v) {
+    seq_printf(m, "sends_failed %lld\n", atomic64_read(&sends_failed));
+    seq_printf(m, "recvs_dropped %lld\n", atomic64_read(&recvs_dropped));
+    seq_printf(m, "recvs_corrupted %lld\n", atomic64_read(&recvs_corrupted));
+    seq_printf(m, "recvs_stalled %lld\n", atomic64_read(&recvs_stalled));
+    seq_printf(m, "conns_failed %lld\n", atomic64_read(&conns_failed));
+    return 0;
+}
+
+static int ccp_fault_injected_open(struct inode *inode, struct file *file) {
+    return single_open(file, ccp_fault_injected_show, NULL);
+}
+
+static const struct file_operations ccp_fault_injected_fops = {
+    .owner = THIS_MODULE,
+    .open = ccp_fault_injected_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// Removed with the rest of ccp/ by ccp_stats_exit.
+void ccp_fault_init(void) {
+    struct dentry *parent = ccp_stats_debugfs();
+    struct dentry *dir;
+
+    if (parent == NULL) {
+        return;
+    }
+
+    dir = debugfs_create_dir("fault", parent);
+    if (IS_ERR(dir)) {
+        pr_info("[ccp] could not create fault injection directory\n");
+        return;
+    }
+
+    fault_create_debugfs_attr("fail_send", dir, &fail_send);
+    fault_create_debugfs_attr("fail_recv", dir, &fail_recv);
+    fault_create_debugfs_attr("corrupt_recv", dir, &corrupt_recv);
+    fault_create_debugfs_attr("fail_conn", dir, &fail_conn);
+    debugfs_create_file_unsafe("stall_recv_ms", 0600, dir, NULL, &ccp_fault_stall_fops);
+    debugfs_create_file("injected", 0444, dir, NULL, &ccp_fault_injected_fops);
+}
+
+#endif
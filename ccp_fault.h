@@ -0,0 +1,50 @@
+/*
+ * CCP Fault Injection
+ *
+ * With CONFIG_FAULT_INJECTION_DEBUG_FS, debugfs ccp/fault/ holds one
+ * standard fault attribute directory (probability, interval, times, ...;
+ * see Documentation/fault-injection) per injection point:
+ *
+ *   fail_send     a send to the agent fails, as if nlmsg_new failed or the
+ *                 ring was full
+ *   fail_recv     an agent message is lost
+ *   corrupt_recv  an agent message has one random byte changed
+ *   fail_conn     a new connection finds the table full
+ *
+ * and stall_recv_ms, which (when written) makes the datapath ignore the
+ * agent for that long, as if it had stalled. Each point counts what it
+ * injected in ccp/fault/injected. tools/ccp_stress.sh drives them.
+ * Without fault injection support, none of this is built in.
+ */
+#ifndef CCP_FAULT_H
+#define CCP_FAULT_H
+
+#include <linux/types.h>
+
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+
+void ccp_fault_init(void);
+
+bool ccp_fault_send(void);
+bool ccp_fault_conn(void);
+
+/* Whether an agent message should be dropped (lost, or the agent stalled).
+ */
+bool ccp_fault_recv_drop(void);
+
+/* A corrupted copy of buf to process instead, or NULL (most of the time).
+ * The caller frees it.
+ */
+char *ccp_fault_recv_corrupt(const char *buf, int len);
+
+#else
+
+static inline void ccp_fault_init(void) {}
+static inline bool ccp_fault_send(void) { return false; }
+static inline bool ccp_fault_conn(void) { return false; }
+static inline bool ccp_fault_recv_drop(void) { return false; }
+static inline char *ccp_fault_recv_corrupt(const char *buf, int len) { return NULL; }
+
+#endif
+
+#endif
@@ -0,0 +1,166 @@
+/*
+ * CCP Primitive Folding
+ *
+ * How one ACK's measurements become the primitives a datapath program sees.
+ * This is kept free of kernel socket types so the exact same code runs in
+ * the module (load_primitives) and in userspace replays of recorded traces
+ * (tools/ccp_replay).
+ */
+#ifndef CCP_FOLD_H
+#define CCP_FOLD_H
+
+#include "libccp/ccp.h"
+
+#ifndef __KERNEL__
+#include <stdint.h>
+#define do_div(n, base) ({ uint32_t __rem = (n) % (base); (n) /= (base); __rem; })
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+#endif
+
+#define MTU 1500
+#define S_TO_US 1000000
+
+/* Everything load_primitives reads from the rate sample and the socket.
+ * acked_sacked, losses and the ECN counts are accumulated since the
+ * previous fold.
+ */
+struct ccp_fold_input {
+    // rate sample
+    int64_t interval_us;
+    int64_t rtt_us;
+    int32_t delivered;
+    uint32_t rcv_interval_us;
+    uint32_t snd_interval_us;
+    uint32_t acked_sacked;
+    uint32_t losses;
+    // socket
+    uint64_t bytes_acked;
+    uint32_t sacked_out;
+    uint32_t packets_in_flight;
+    uint32_t snd_cwnd;
+    uint32_t mss_cache;
+    uint32_t snd_una;
+    uint32_t write_seq;
+    uint32_t ecn_bytes;
+    uint32_t ecn_packets;
+} __attribute__((packed));
+
+/* Primitives that cost something to compute, in groups a program's mask
+ * (see ccp_ipc_update_prim_masks) can leave out. The rest (bytes_acked,
+ * ECN, losses, rtt_sample_us, snd_cwnd) are always computed, since the
+ * datapath itself reads them. Left-out primitives keep stale values.
+ */
+#define CCP_PRIM_RATES      (1 << 0) // rate_incoming, rate_outgoing
+#define CCP_PRIM_MISORDERED (1 << 1) // packets/bytes_misordered, packets_acked
+#define CCP_PRIM_IN_FLIGHT  (1 << 2) // packets/bytes_in_flight
+#define CCP_PRIM_PENDING    (1 << 3) // bytes_pending
+#define CCP_PRIM_ALL        0xf
+
+/* What a flow remembers between folds.
+ */
+struct ccp_fold_state {
+    uint32_t last_bytes_acked;
+    uint32_t last_sacked_out;
+};
+
+/* Non-zero (a bitmask of what is missing) if the rate sample cannot be used.
+ */
+static inline int ccp_fold_rate_valid(const struct ccp_fold_input *in) {
+    int ret = 0;
+    if (in->delivered <= 0)
+        ret |= 1;
+    if (in->interval_us <= 0)
+        ret |= 1 << 1;
+    if (in->rtt_us <= 0)
+        ret |= 1 << 2;
+    return ret;
+}
+
+/* Fold a valid sample into mmt, advancing st, computing only the
+ * primitive groups in mask (CCP_PRIM_*). Always inlined, so with a constant
+ * mask the compiler drops the rest and callers can select specialized
+ * loaders.
+ * Returns -1 if the socket reports no congestion window, in which case
+ * snd_cwnd and bytes_pending are left as they were.
+ */
+static __always_inline int ccp_fold_primitives_mask(
+    const struct ccp_fold_input *in,
+    struct ccp_fold_state *st,
+    struct ccp_primitives *mmt,
+    unsigned int mask
+) {
+    uint64_t rin = 0; // send bandwidth in bytes per second
+    uint64_t rout = 0; // recv bandwidth in bytes per second
+    uint64_t ack_us = in->rcv_interval_us;
+    uint64_t snd_us = in->snd_interval_us;
+
+    if ((mask & CCP_PRIM_RATES) && ack_us != 0 && snd_us != 0) {
+        rin = rout = (uint64_t)in->delivered * MTU * S_TO_US;
+        do_div(rin, snd_us);
+        do_div(rout, ack_us);
+    }
+
+    mmt->ecn_bytes = in->ecn_bytes;
+    mmt->ecn_packets = in->ecn_packets;
+
+    mmt->bytes_acked = (uint32_t) in->bytes_acked - st->last_bytes_acked;
+    st->last_bytes_acked = in->bytes_acked;
+
+    if (mask & CCP_PRIM_MISORDERED) {
+        if (in->sacked_out < st->last_sacked_out) {
+            mmt->packets_misordered = 0;
+        } else {
+            mmt->packets_misordered = in->sacked_out - st->last_sacked_out;
+        }
+        mmt->packets_acked = in->acked_sacked - mmt->packets_misordered;
+        mmt->bytes_misordered = mmt->packets_misordered * in->mss_cache;
+    }
+
+    // kept either way, so a later program sees correct deltas
+    st->last_sacked_out = in->sacked_out;
+
+    mmt->lost_pkts_sample = in->losses;
+    mmt->rtt_sample_us = in->rtt_us;
+    if ( rin != 0 ) {
+        mmt->rate_outgoing = rin;
+    }
+
+    if ( rout != 0 ) {
+        mmt->rate_incoming = rout;
+    }
+
+    if (mask & CCP_PRIM_IN_FLIGHT) {
+        mmt->bytes_in_flight = in->packets_in_flight * in->mss_cache;
+        mmt->packets_in_flight = in->packets_in_flight;
+    }
+    if (in->snd_cwnd <= 0) {
+        return -1;
+    }
+
+    mmt->snd_cwnd = in->snd_cwnd * in->mss_cache;
+
+    if (mask & CCP_PRIM_PENDING) {
+        if (unlikely(in->snd_una > in->write_seq)) {
+            mmt->bytes_pending = ((uint32_t) ~0U) - (in->snd_una - in->write_seq);
+        } else {
+            mmt->bytes_pending = (in->write_seq - in->snd_una);
+        }
+    }
+
+    return 0;
+}
+
+/* Fold a valid sample into mmt, advancing st, computing every primitive.
+ */
+static inline int ccp_fold_primitives(
+    const struct ccp_fold_input *in,
+    struct ccp_fold_state *st,
+    struct ccp_primitives *mmt
+) {
+    return ccp_fold_primitives_mask(in, st, mmt, CCP_PRIM_ALL);
+}
+
+#endif
@@ -0,0 +1,974 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/jiffies.h>
+#include <linux/delay.h>
+#include <linux/mm.h>
+#include <linux/version.h>
+#include <net/tcp.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 10, 0)
+#error "the transport static calls need kernel 5.10 or later (and the module 6.10, see Makefile)"
+#endif
+#include <linux/static_call.h>
+
+#include "ccp_ipc.h"
+#include "ccp_compact.h"
+#include "ccp_fault.h"
+#include "ccp_stats.h"
+#include "ccp_trace.h"
+#include "libccp/serialize.h"
+#include "libccp/ccp_priv.h"
+#include "libccp/machine.h"
+
+#include "ccp_nl.h"
+#include "ccpkp/ccpkp.h"
+
+static bool report_backpressure = true;
+module_param(report_backpressure, bool, 0644);
+MODULE_PARM_DESC(report_backpressure, "Run flows' programs less often when the agent cannot keep up");
+
+static bool urgent_lane = true;
+module_param(urgent_lane, bool, 0644);
+MODULE_PARM_DESC(urgent_lane, "Send reports of timeouts, losses and ECN ahead of routine reports");
+
+#define CCP_BP_WINDOW_MS 10
+// raise the level if more than 1/8 of sends fail or the ring is this full
+#define CCP_BP_FAIL_SHIFT 3
+#define CCP_BP_HIGH_OCCUPANCY 75
+// lower it once a window goes by without failures and with the ring this empty
+#define CCP_BP_LOW_OCCUPANCY 25
+
+// largest resync batch: one ring slot for ccpkp, a few pages for netlink
+#define CCP_RESYNC_MSG_LEN (ccp_ipc_is_chardev() ? MAX_MSG_LEN : 8192)
+#define CCP_RESYNC_MIN_MSG_LEN MAX_MSG_LEN
+// largest batched send: one ring slot for ccpkp, a page for netlink
+#define CCP_SEND_BATCH_LEN (ccp_ipc_is_chardev() ? MAX_MSG_LEN : 4096)
+#define CCP_SEND_BATCH_MAX_LEN 4096
+// how long a resync waits for the agent to drain a full transport
+#define CCP_RESYNC_SEND_RETRIES 100
+// flows a bulk switch matches, and switches, per table lock hold
+#define CCP_BULK_CHUNK 256
+#define CCP_BULK_APPLY_CHUNK 64
+
+// Messages sent during a batch tick, see ccp_ipc_batch_begin()
+struct ccp_send_batch {
+    struct ccp_datapath *dp; // all messages in buf are for this datapath
+    int len;
+    char buf[CCP_SEND_BATCH_MAX_LEN];
+};
+
+static struct ccp_send_batch __percpu *send_batches = NULL;
+static DEFINE_PER_CPU(int, send_batching); // open batches, see ccp_ipc_batch_begin()
+
+// Where a compact report is encoded, used with BHs disabled
+struct ccp_compact_buf {
+    char buf[CCP_COMPACT_MAX_LEN];
+};
+
+static DEFINE_PER_CPU(struct ccp_compact_buf, compact_bufs);
+
+static void ccp_resync_work(struct work_struct *work);
+static void ccp_bulk_change_prog_work(struct work_struct *work);
+
+int ccp_ipc_init(void) {
+    send_batches = alloc_percpu(struct ccp_send_batch);
+    if (send_batches == NULL) {
+        pr_info("[ccp] could not allocate send batches, batched sends disabled\n");
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void ccp_ipc_exit(void) {
+    free_percpu(send_batches);
+    send_batches = NULL;
+}
+
+void ccp_ipc_net_init(struct ccp_net *cn) {
+    atomic_set(&cn->bp.level, 0);
+    atomic_set(&cn->bp.sends, 0);
+    atomic_set(&cn->bp.failures, 0);
+    cn->bp.window_end = jiffies + msecs_to_jiffies(CCP_BP_WINDOW_MS);
+    INIT_WORK(&cn->resync_work, ccp_resync_work);
+    INIT_WORK(&cn->bulk_work, ccp_bulk_change_prog_work);
+    cn->bulk_req = NULL;
+    memset(cn->default_progs, 0, sizeof(cn->default_progs));
+    ccp_compact_net_init(cn);
+
+    // until a program is installed at an index, its flows get everything
+    cn->prim_masks = kmalloc(cn->dp->max_programs + 1, GFP_KERNEL);
+    if (cn->prim_masks) {
+        memset(cn->prim_masks, CCP_PRIM_ALL, cn->dp->max_programs + 1);
+    } else {
+        pr_info("[ccp] could not allocate primitive masks, computing every primitive\n");
+    }
+
+    if (ccp_trace_net_init(cn) < 0) {
+        pr_info("[ccp] could not allocate program copies, traces will miss programs installed before them\n");
+    }
+}
+
+void ccp_ipc_net_exit(struct ccp_net *cn) {
+    cancel_work_sync(&cn->resync_work);
+    cancel_work_sync(&cn->bulk_work);
+    kfree(xchg(&cn->bulk_req, NULL));
+
+    memset(cn->default_progs, 0, sizeof(cn->default_progs));
+    ccp_compact_net_exit(cn);
+    kfree(cn->prim_masks);
+    cn->prim_masks = NULL;
+    ccp_trace_net_exit(cn);
+}
+
+// Direct call into the transport chosen at load time
+DEFINE_STATIC_CALL(ccp_transport_send, nl_sendmsg);
+DEFINE_STATIC_CALL(ccp_transport_send_urgent, nl_sendmsg_urgent);
+
+void ccp_ipc_set_transport(int ipc) {
+    if (ipc == IPC_CHARDEV) {
+        static_call_update(ccp_transport_send, &ccpkp_sendmsg);
+        static_call_update(ccp_transport_send_urgent, &ccpkp_sendmsg_urgent);
+    } else {
+        static_call_update(ccp_transport_send, &nl_sendmsg);
+        static_call_update(ccp_transport_send_urgent, &nl_sendmsg_urgent);
+    }
+}
+
+static inline int ccp_transport_send(struct ccp_datapath *dp, char *msg, int msg_size) {
+    if (unlikely(ccp_fault_send())) {
+        return -ENOBUFS;
+    }
+    return static_call(ccp_transport_send)(dp, msg, msg_size);
+}
+
+// How full the transport's queue towards the agent is, in percent
+static int ccp_transport_occupancy(void) {
+    if (ccp_ipc_is_chardev()) {
+        return ccpkp_occupancy();
+    }
+    // netlink only tells us about overruns, through send failures
+    return 0;
+}
+
+int ccp_ipc_bp_level(struct ccp_datapath *dp) {
+    struct ccp_net *cn = dp->impl;
+
+    if (!READ_ONCE(report_backpressure)) {
+        return 0;
+    }
+    return atomic_read(&cn->bp.level);
+}
+
+// Tell the agent about a new level, ahead of the reports it affects
+static void ccp_bp_announce(struct ccp_net *cn, int level) {
+    struct {
+        struct CcpMsgHeader hdr;
+        struct ccp_ext_backpressure bp;
+    } __attribute__((packed)) msg;
+
+    msg.hdr.Type = CCP_EXT_BACKPRESSURE;
+    msg.hdr.Len = sizeof(msg);
+    msg.hdr.SocketId = 0;
+    msg.bp.level = level;
+    static_call(ccp_transport_send_urgent)(cn->dp, (char *) &msg, sizeof(msg));
+}
+
+/* Account for one send, and once per window re-evaluate the level:
+ * raise it when sends fail or the ring is filling up, lower it again once
+ * the agent has caught up.
+ */
+static void ccp_bp_account(struct ccp_net *cn, int ok) {
+    struct ccp_backpressure *bp = &cn->bp;
+    unsigned long end = READ_ONCE(bp->window_end);
+    int sends, failures, occupancy, level, new_level;
+
+    atomic_inc(&bp->sends);
+    // -ESRCH means nobody is listening, which is not the agent falling behind
+    if (ok < 0 && ok != -ESRCH) {
+        atomic_inc(&bp->failures);
+    }
+
+    if (time_before(jiffies, end) ||
+        cmpxchg(&bp->window_end, end, jiffies + msecs_to_jiffies(CCP_BP_WINDOW_MS)) != end) {
+        return;
+    }
+
+    sends = atomic_xchg(&bp->sends, 0);
+    failures = atomic_xchg(&bp->failures, 0);
+    occupancy = ccp_transport_occupancy();
+    level = new_level = atomic_read(&bp->level);
+
+    if ((failures << CCP_BP_FAIL_SHIFT) > sends || occupancy >= CCP_BP_HIGH_OCCUPANCY) {
+        new_level = min(level + 1, CCP_BP_MAX_LEVEL);
+    } else if (failures == 0 && occupancy < CCP_BP_LOW_OCCUPANCY) {
+        new_level = max(level - 1, 0);
+    }
+
+    if (new_level != level) {
+        atomic_set(&bp->level, new_level);
+        pr_info_ratelimited("[ccp] report backpressure level %d -> %d (%d/%d sends failed, %d%% full)\n",
+            level, new_level, failures, sends, occupancy);
+        if (READ_ONCE(report_backpressure)) {
+            ccp_bp_announce(cn, new_level);
+        }
+    }
+}
+
+static inline bool ccp_report_is_urgent(struct ccp_connection *conn) {
+    return conn->prims.was_timeout || conn->prims.lost_pkts_sample || conn->prims.ecn_packets;
+}
+
+void ccp_ipc_batch_begin(void) {
+    if (send_batches == NULL) {
+        return;
+    }
+    // nested batches go out with the outermost one
+    if (this_cpu_inc_return(send_batching) == 1) {
+        this_cpu_ptr(send_batches)->len = 0;
+    }
+}
+
+static void ccp_ipc_batch_send(struct ccp_send_batch *sb) {
+    if (sb->len > 0) {
+        ccp_bp_account(sb->dp->impl, ccp_transport_send(sb->dp, sb->buf, sb->len));
+        sb->len = 0;
+    }
+}
+
+void ccp_ipc_batch_flush(void) {
+    if (this_cpu_read(send_batching) == 0 || this_cpu_dec_return(send_batching) > 0) {
+        return;
+    }
+    ccp_ipc_batch_send(this_cpu_ptr(send_batches));
+}
+
+// Append msg to this CPU's batch if one is open. Returns false if it was not.
+static bool ccp_ipc_batch_append(struct ccp_datapath *dp, char *msg, int msg_size) {
+    struct ccp_send_batch *sb;
+
+    if (this_cpu_read(send_batching) == 0 || msg_size > CCP_SEND_BATCH_LEN) {
+        return false;
+    }
+
+    sb = this_cpu_ptr(send_batches);
+    if (sb->len > 0 && (sb->dp != dp || sb->len + msg_size > CCP_SEND_BATCH_LEN)) {
+        ccp_ipc_batch_send(sb);
+    }
+    sb->dp = dp;
+    memcpy(sb->buf + sb->len, msg, msg_size);
+    sb->len += msg_size;
+    return true;
+}
+
+// Hand msg to the transport: urgent lane, this CPU's batch, or a plain send
+static int ccp_ipc_deliver(struct ccp_datapath *dp, char *msg, int msg_size, bool urgent) {
+    int ok;
+
+    if (urgent) {
+        // never batched, and kept out of the routine lane's backpressure
+        return ccp_fault_send() ? -ENOBUFS : static_call(ccp_transport_send_urgent)(dp, msg, msg_size);
+    }
+    if (ccp_ipc_batch_append(dp, msg, msg_size)) {
+        return 0;
+    }
+    ok = ccp_transport_send(dp, msg, msg_size);
+    ccp_bp_account(dp->impl, ok);
+    return ok;
+}
+
+int ccp_ipc_send(struct ccp_datapath *dp, char *msg, int msg_size) {
+    struct ccp_net *cn = dp->impl;
+    struct CcpMsgHeader *hdr = (struct CcpMsgHeader *) msg;
+    bool report = msg_size >= sizeof(struct CcpMsgHeader) && hdr->Type == MEASURE;
+    struct ccp_connection *conn = NULL;
+    bool urgent = false;
+    u32 sid = report ? hdr->SocketId : 0;
+    char *compact;
+    int ok;
+
+    if (report) {
+        conn = ccp_connection_lookup(dp, sid);
+    }
+    if (conn != NULL) {
+        struct ccp *ca = inet_csk_ca((struct sock *) ccp_get_impl(conn));
+        ca->report_seq++;
+        // a report of a congestion event goes on the urgent lane
+        urgent = READ_ONCE(urgent_lane) && ccp_report_is_urgent(conn);
+    }
+
+    if (report && !urgent && ccp_compact_enabled(cn)) {
+        local_bh_disable();
+        compact = this_cpu_ptr(&compact_bufs)->buf;
+        ok = ccp_compact_encode(dp, msg, msg_size, compact);
+        if (ok > 0) {
+            ok = ccp_ipc_deliver(dp, compact, ok, urgent);
+            local_bh_enable();
+            if (ok < 0) {
+                // the agent never saw this delta
+                ccp_compact_key(dp, sid);
+            }
+            goto out;
+        }
+        local_bh_enable();
+    }
+
+    ok = ccp_ipc_deliver(dp, msg, msg_size, urgent);
+    if (urgent && ccp_compact_enabled(cn)) {
+        // it overtakes the batched routine ones: start the next one over
+        ccp_compact_key(dp, sid);
+    }
+out:
+    if (ok >= 0 && report) {
+        ccp_stats_report_sent(dp, sid);
+    }
+    return ok;
+}
+
+static int ccp_ext_set_decimation(struct ccp_datapath *dp, struct CcpMsgHeader *hdr, char *body, int len) {
+    struct ccp_ext_decimation *req = (struct ccp_ext_decimation *) body;
+    struct ccp_connection *conn;
+
+    if (len < sizeof(struct ccp_ext_decimation)) {
+        return -EINVAL;
+    }
+
+    conn = ccp_connection_lookup(dp, hdr->SocketId);
+    if (conn == NULL) {
+        return -ENOENT;
+    }
+
+    ccp_set_decimation(ccp_get_impl(conn), req->acks, req->usecs);
+    return 0;
+}
+
+static void ccp_resync_describe(struct ccp_datapath *dp, struct ccp_connection *conn, struct ccp_resync_flow *rf) {
+    struct ccp_priv_state *state = get_ccp_priv_state(conn);
+    struct DatapathProgram *prog = NULL;
+    struct ccp_datapath_info info;
+
+    ccp_flow_info(ccp_get_impl(conn), &info);
+    if (state != NULL && state->program_index != 0) {
+        prog = datapath_program_lookup(dp, state->program_index);
+    }
+
+    rf->sid = conn->index;
+    rf->program_uid = prog != NULL ? prog->program_uid : 0;
+    rf->cwnd = info.init_cwnd;
+    rf->mss = info.mss;
+    rf->src_ip = info.src_ip;
+    rf->src_port = info.src_port;
+    rf->dst_ip = info.dst_ip;
+    rf->dst_port = info.dst_port;
+    memcpy(rf->congAlg, info.congAlg, MAX_CONG_ALG_SIZE);
+    memcpy(&rf->prims, &conn->prims, sizeof(struct ccp_primitives));
+}
+
+// Send a resync message, waiting for the agent to make room if need be.
+static int ccp_resync_send(struct ccp_datapath *dp, char *msg, int msg_size) {
+    int ok, tries;
+
+    for (tries = 0; tries < CCP_RESYNC_SEND_RETRIES; tries++) {
+        ok = ccp_transport_send(dp, msg, msg_size);
+        if (ok >= 0 || ok == -ESRCH) {
+            return ok;
+        }
+        usleep_range(500, 1000);
+    }
+
+    return ok;
+}
+
+/* Walk the connection table in transport-message-sized chunks. The table
+ * lock is only held while a chunk is described, so connection setup and
+ * teardown are never blocked behind a send.
+ */
+static void ccp_resync_work(struct work_struct *work) {
+    struct ccp_net *cn = container_of(work, struct ccp_net, resync_work);
+    struct ccp_datapath *dp = cn->dp;
+    struct CcpMsgHeader *hdr;
+    struct ccp_resync_batch *batch;
+    struct ccp_resync_done *done;
+    u32 per_msg = (CCP_RESYNC_MSG_LEN - sizeof(struct CcpMsgHeader) - sizeof(struct ccp_resync_batch)) /
+        sizeof(struct ccp_resync_flow);
+    u32 i = 0, total = 0;
+    char *buf;
+    int ok = 0;
+
+    BUILD_BUG_ON(sizeof(struct CcpMsgHeader) + sizeof(struct ccp_resync_batch) +
+        sizeof(struct ccp_resync_flow) > CCP_RESYNC_MIN_MSG_LEN);
+
+    buf = kmalloc(CCP_RESYNC_MSG_LEN, GFP_KERNEL);
+    if (!buf) {
+        pr_info("[ccp] resync: could not allocate batch buffer\n");
+        return;
+    }
+
+    hdr = (struct CcpMsgHeader *) buf;
+    batch = (struct ccp_resync_batch *) (buf + sizeof(struct CcpMsgHeader));
+    while (i < dp->max_connections) {
+        batch->num_flows = 0;
+        spin_lock_bh(&cn->conn_lock);
+        for (; i < dp->max_connections && batch->num_flows < per_msg; i++) {
+            struct ccp_connection *conn = &dp->ccp_active_connections[i];
+            if (conn->index == 0) {
+                continue;
+            }
+            ccp_resync_describe(dp, conn, &batch->flows[batch->num_flows]);
+            batch->num_flows++;
+        }
+        spin_unlock_bh(&cn->conn_lock);
+
+        if (batch->num_flows == 0) {
+            break;
+        }
+
+        hdr->Type = CCP_EXT_RESYNC_BATCH;
+        hdr->Len = sizeof(struct CcpMsgHeader) + sizeof(struct ccp_resync_batch) +
+            batch->num_flows * sizeof(struct ccp_resync_flow);
+        hdr->SocketId = 0;
+        ok = ccp_resync_send(dp, buf, hdr->Len);
+        if (ok < 0) {
+            pr_info("[ccp] resync: send failed after %u flows: %d\n", total, ok);
+            goto out;
+        }
+        total += batch->num_flows;
+        cond_resched();
+    }
+
+    done = (struct ccp_resync_done *) (buf + sizeof(struct CcpMsgHeader));
+    hdr->Type = CCP_EXT_RESYNC_DONE;
+    hdr->Len = sizeof(struct CcpMsgHeader) + sizeof(struct ccp_resync_done);
+    hdr->SocketId = 0;
+    done->num_flows = total;
+    ok = ccp_resync_send(dp, buf, hdr->Len);
+    pr_info("[ccp] resync: sent %u flows (%d)\n", total, ok);
+
+out:
+    kfree(buf);
+}
+
+// Index of the installed program with this uid, or 0
+static u16 ccp_program_index(struct ccp_datapath *dp, u32 uid) {
+    u16 i;
+
+    for (i = 1; i <= dp->max_programs; i++) {
+        struct DatapathProgram *prog = datapath_program_lookup(dp, i);
+        if (prog != NULL && prog->program_uid == uid) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+static u8 ccp_reg_prim_mask(const struct Register *reg) {
+    if (reg->type != PRIMITIVE_REG) {
+        return 0;
+    }
+
+    switch (reg->index) {
+    case FLOW_RATE_INCOMING:
+    case FLOW_RATE_OUTGOING:
+        return CCP_PRIM_RATES;
+    case ACK_BYTES_MISORDERED:
+    case ACK_PACKETS_MISORDERED:
+    case ACK_PACKETS_ACKED:
+        return CCP_PRIM_MISORDERED;
+    case FLOW_BYTES_IN_FLIGHT:
+    case FLOW_PACKETS_IN_FLIGHT:
+        return CCP_PRIM_IN_FLIGHT;
+    case FLOW_BYTES_PENDING:
+        return CCP_PRIM_PENDING;
+    default:
+        return 0;
+    }
+}
+
+// Primitive groups any instruction of prog reads (results are never primitives)
+static u8 ccp_prog_prim_mask(const struct DatapathProgram *prog) {
+    u8 mask = 0;
+    u32 i;
+
+    for (i = 0; i < prog->num_instructions && i < MAX_INSTRUCTIONS; i++) {
+        mask |= ccp_reg_prim_mask(&prog->fol[i].rLeft);
+        mask |= ccp_reg_prim_mask(&prog->fol[i].rRight);
+    }
+
+    return mask;
+}
+
+/* Programs are installed rarely and there are few of them, so redo them
+ * all rather than work out which index changed. Flows read the masks
+ * locklessly: one on a reinstalled index may fold with the previous
+ * program's mask for an ACK or two.
+ */
+void ccp_ipc_update_prim_masks(struct ccp_datapath *dp) {
+    struct ccp_net *cn = dp->impl;
+    u16 i;
+
+    if (cn->prim_masks == NULL) {
+        return;
+    }
+
+    for (i = 1; i <= dp->max_programs; i++) {
+        struct DatapathProgram *prog = datapath_program_lookup(dp, i);
+        WRITE_ONCE(cn->prim_masks[i], prog != NULL ? ccp_prog_prim_mask(prog) : CCP_PRIM_ALL);
+    }
+}
+
+static bool ccp_bulk_matches(struct ccp_connection *conn, u16 from_index, const char *congAlg) {
+    struct ccp_datapath_info info;
+
+    if (from_index != 0) {
+        struct ccp_priv_state *state = get_ccp_priv_state(conn);
+        if (state == NULL || state->program_index != from_index) {
+            return false;
+        }
+    }
+
+    if (congAlg[0] != '\0') {
+        ccp_flow_info(ccp_get_impl(conn), &info);
+        if (strncmp(info.congAlg, congAlg, MAX_CONG_ALG_SIZE) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Feed the embedded CHANGE_PROG message to libccp once per matching flow,
+ * rewriting its SocketId each time. The matching flows are collected a
+ * chunk of the table at a time, then switched a few at a time; the table
+ * lock is never held for more than one chunk. A sid may have been freed
+ * and reused by an unrelated flow between the two passes, so each one is
+ * matched again under the lock right before its switch.
+ */
+static void ccp_bulk_change_prog_work(struct work_struct *work) {
+    struct ccp_net *cn = container_of(work, struct ccp_net, bulk_work);
+    struct ccp_datapath *dp = cn->dp;
+    char *req = READ_ONCE(cn->bulk_req);
+    struct ccp_ext_bulk_change_prog *bulk = (struct ccp_ext_bulk_change_prog *) (req + sizeof(struct CcpMsgHeader));
+    char *change = (char *) (bulk + 1);
+    int change_len = ((struct CcpMsgHeader *) req)->Len - (change - req);
+    struct CcpMsgHeader *change_hdr = (struct CcpMsgHeader *) change;
+    char congAlg[MAX_CONG_ALG_SIZE];
+    u32 i = 0, n = 0, j, switched = 0, failed = 0;
+    u16 from_index = 0;
+    u32 *sids;
+
+    memcpy(congAlg, bulk->congAlg, MAX_CONG_ALG_SIZE);
+    congAlg[MAX_CONG_ALG_SIZE - 1] = '\0';
+
+    if (bulk->from_uid != 0) {
+        from_index = ccp_program_index(dp, bulk->from_uid);
+        if (from_index == 0) {
+            pr_info("[ccp] bulk change prog: program %u not installed\n", bulk->from_uid);
+            goto out;
+        }
+    }
+
+    sids = kvmalloc_array(dp->max_connections, sizeof(u32), GFP_KERNEL);
+    if (!sids) {
+        pr_info("[ccp] bulk change prog: could not allocate flow list\n");
+        goto out;
+    }
+
+    while (i < dp->max_connections) {
+        u32 stop = min_t(u32, i + CCP_BULK_CHUNK, dp->max_connections);
+
+        spin_lock_bh(&cn->conn_lock);
+        for (; i < stop; i++) {
+            struct ccp_connection *conn = &dp->ccp_active_connections[i];
+            if (conn->index != 0 && ccp_bulk_matches(conn, from_index, congAlg)) {
+                sids[n++] = conn->index;
+            }
+        }
+        spin_unlock_bh(&cn->conn_lock);
+        cond_resched();
+    }
+
+    for (i = 0; i < n; i = j) {
+        ccp_ipc_table_lock(cn);
+        for (j = i; j < n && j < i + CCP_BULK_APPLY_CHUNK; j++) {
+            struct ccp_connection *conn = ccp_connection_lookup(dp, sids[j]);
+            if (conn == NULL || !ccp_bulk_matches(conn, from_index, congAlg)) {
+                continue;
+            }
+            change_hdr->SocketId = sids[j];
+            ccp_trace_agent_msg(dp, change, change_len);
+            if (ccp_read_msg(dp, change, change_len) < 0) {
+                failed++;
+            } else {
+                switched++;
+            }
+        }
+        ccp_ipc_table_unlock(cn);
+        cond_resched();
+    }
+    kvfree(sids);
+
+    pr_info("[ccp] bulk change prog: switched %u flows, %u failed\n", switched, failed);
+
+out:
+    kfree(xchg(&cn->bulk_req, NULL));
+}
+
+static int ccp_ext_bulk_change_prog(struct ccp_datapath *dp, struct CcpMsgHeader *hdr) {
+    struct ccp_net *cn = dp->impl;
+    struct CcpMsgHeader *change = (struct CcpMsgHeader *)
+        ((char *) hdr + sizeof(struct CcpMsgHeader) + sizeof(struct ccp_ext_bulk_change_prog));
+    int change_len = hdr->Len - sizeof(struct CcpMsgHeader) - sizeof(struct ccp_ext_bulk_change_prog);
+    char *req;
+
+    if (change_len < (int) sizeof(struct CcpMsgHeader) ||
+        change->Type != CHANGE_PROG ||
+        change->Len != change_len) {
+        return -EINVAL;
+    }
+
+    req = kmemdup(hdr, hdr->Len, GFP_ATOMIC);
+    if (!req) {
+        return -ENOMEM;
+    }
+
+    if (cmpxchg(&cn->bulk_req, NULL, req) != NULL) {
+        kfree(req);
+        return -EBUSY;
+    }
+
+    schedule_work(&cn->bulk_work);
+    return 0;
+}
+
+static struct ccp_default_prog *ccp_default_prog_lookup(struct ccp_net *cn, const char *congAlg) {
+    int i;
+
+    for (i = 0; i < CCP_MAX_DEFAULT_PROGS; i++) {
+        struct ccp_default_prog *dflt = &cn->default_progs[i];
+        if (dflt->congAlg[0] != '\0' && strncmp(dflt->congAlg, congAlg, MAX_CONG_ALG_SIZE) == 0) {
+            return dflt;
+        }
+    }
+
+    return NULL;
+}
+
+int ccp_ipc_flow_start(struct ccp_datapath *dp, struct ccp_connection *conn, const char *congAlg, char *prog) {
+    struct ccp_default_prog *dflt = ccp_default_prog_lookup(dp->impl, congAlg);
+
+    ccp_compact_key(dp, conn->index);
+    if (dflt == NULL) {
+        return 0;
+    }
+
+    memcpy(prog, dflt->msg, dflt->len);
+    return dflt->len;
+}
+
+void ccp_ipc_flow_default_prog(struct ccp_datapath *dp, struct ccp_connection *conn, char *prog, int len) {
+    struct ccp_priv_state *state;
+    struct DatapathProgram *installed = NULL;
+    struct {
+        struct CcpMsgHeader hdr;
+        struct ccp_ext_default_prog_applied applied;
+    } __attribute__((packed)) res;
+    int ok;
+
+    ((struct CcpMsgHeader *) prog)->SocketId = conn->index;
+    ccp_trace_agent_msg(dp, prog, len);
+    ok = ccp_read_msg(dp, prog, len);
+    if (ok < 0) {
+        pr_info("[ccp] default program on %d failed: %d\n", conn->index, ok);
+    } else {
+        state = get_ccp_priv_state(conn);
+        if (state != NULL && state->program_index != 0) {
+            installed = datapath_program_lookup(dp, state->program_index);
+        }
+    }
+
+    res.hdr.Type = CCP_EXT_DEFAULT_PROG_APPLIED;
+    res.hdr.Len = sizeof(res);
+    res.hdr.SocketId = conn->index;
+    res.applied.program_uid = installed != NULL ? installed->program_uid : 0;
+    ccp_ipc_send(dp, (char *) &res, sizeof(res));
+}
+
+static int ccp_ext_set_default_prog(struct ccp_datapath *dp, struct CcpMsgHeader *hdr, char *body, int len) {
+    struct ccp_net *cn = dp->impl;
+    struct ccp_ext_default_prog *req = (struct ccp_ext_default_prog *) body;
+    struct CcpMsgHeader *change = (struct CcpMsgHeader *) (req + 1);
+    int change_len = len - (int) sizeof(struct ccp_ext_default_prog);
+    struct ccp_default_prog *dflt;
+    char congAlg[MAX_CONG_ALG_SIZE];
+    int i;
+
+    if (change_len < 0) {
+        return -EINVAL;
+    }
+    memcpy(congAlg, req->congAlg, MAX_CONG_ALG_SIZE);
+    congAlg[MAX_CONG_ALG_SIZE - 1] = '\0';
+    if (congAlg[0] == '\0') {
+        return -EINVAL;
+    }
+
+    if (change_len > 0) {
+        if (change_len < (int) sizeof(struct CcpMsgHeader) ||
+            change->Type != CHANGE_PROG ||
+            change->Len != change_len) {
+            return -EINVAL;
+        }
+        if (change_len > CCP_DEFAULT_PROG_MAX_LEN) {
+            return -E2BIG;
+        }
+    }
+
+    spin_lock_bh(&cn->conn_lock);
+    dflt = ccp_default_prog_lookup(cn, congAlg);
+    for (i = 0; dflt == NULL && change_len > 0 && i < CCP_MAX_DEFAULT_PROGS; i++) {
+        if (cn->default_progs[i].congAlg[0] == '\0') {
+            dflt = &cn->default_progs[i];
+        }
+    }
+    if (dflt == NULL) {
+        spin_unlock_bh(&cn->conn_lock);
+        // clearing an entry that does not exist is fine
+        return change_len == 0 ? 0 : -ENOSPC;
+    }
+    if (change_len > 0) {
+        memcpy(dflt->congAlg, congAlg, MAX_CONG_ALG_SIZE);
+        memcpy(dflt->msg, change, change_len);
+        dflt->len = change_len;
+    } else {
+        dflt->congAlg[0] = '\0';
+        dflt->len = 0;
+    }
+    spin_unlock_bh(&cn->conn_lock);
+
+    pr_info("[ccp] default program for %s %s\n", congAlg, change_len > 0 ? "set" : "cleared");
+    return 0;
+}
+
+static int ccp_batch_apply(struct ccp_datapath *dp, struct ccp_batch_entry *e) {
+    struct ccp_connection *conn = ccp_connection_lookup(dp, e->sid);
+    struct ccp_priv_state *state;
+
+    if (conn == NULL) {
+        return -ENOENT;
+    }
+
+    switch (e->field) {
+    case CCP_BATCH_FIELD_CWND:
+        if (e->value > U32_MAX) {
+            return -ERANGE;
+        }
+        tcp_ccp_set_cwnd(conn, e->value);
+        return 0;
+    case CCP_BATCH_FIELD_RATE:
+        if (e->value > U32_MAX) {
+            return -ERANGE;
+        }
+        tcp_ccp_set_rate_abs(conn, e->value);
+        return 0;
+    case CCP_BATCH_FIELD_REG:
+        state = get_ccp_priv_state(conn);
+        if (state == NULL || e->reg >= MAX_CONTROL_REG) {
+            return -EINVAL;
+        }
+        state->registers.control_registers[e->reg] = e->value;
+        if (unlikely(((struct ccp *) inet_csk_ca((struct sock *) ccp_get_impl(conn)))->traced)) {
+            ccp_trace_control_reg(ccp_get_impl(conn), e->reg, e->value);
+        }
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+static int ccp_ext_batch_update(struct ccp_datapath *dp, struct CcpMsgHeader *hdr, char *body, int len) {
+    struct ccp_net *cn = dp->impl;
+    struct ccp_ext_batch_update *req = (struct ccp_ext_batch_update *) body;
+    struct ccp_ext_batch_result *res;
+    struct CcpMsgHeader *res_hdr;
+    u32 max_entries = ccp_ipc_is_chardev() ? CCP_BATCH_MAX_ENTRIES_CHARDEV : CCP_BATCH_MAX_ENTRIES;
+    int res_len, ok;
+    u32 i;
+
+    if (len < sizeof(struct ccp_ext_batch_update) ||
+        req->num_entries > max_entries ||
+        len < sizeof(struct ccp_ext_batch_update) + req->num_entries * sizeof(struct ccp_batch_entry)) {
+        return -EINVAL;
+    }
+
+    res_len = sizeof(struct CcpMsgHeader) + sizeof(struct ccp_ext_batch_result) +
+        DIV_ROUND_UP(req->num_entries, 64) * sizeof(u64);
+    res_hdr = kzalloc(res_len, GFP_ATOMIC);
+    if (!res_hdr) {
+        return -ENOMEM;
+    }
+    res = (struct ccp_ext_batch_result *) (res_hdr + 1);
+    res->batch_id = req->batch_id;
+    res->num_entries = req->num_entries;
+
+    spin_lock_bh(&cn->conn_lock);
+    for (i = 0; i < req->num_entries; i++) {
+        if (ccp_batch_apply(dp, &req->entries[i]) < 0) {
+            res->failed[i / 64] |= 1ULL << (i % 64);
+            res->num_failed++;
+        } else {
+            ccp_stats_agent_action(dp, req->entries[i].sid);
+        }
+    }
+    spin_unlock_bh(&cn->conn_lock);
+
+    res_hdr->Type = CCP_EXT_BATCH_UPDATE_RESULT;
+    res_hdr->Len = res_len;
+    res_hdr->SocketId = 0;
+    ok = ccp_ipc_send(dp, (char *) res_hdr, res_len);
+    kfree(res_hdr);
+    return ok < 0 ? ok : 0;
+}
+
+static int ccp_ext_set_report_format(struct ccp_datapath *dp, struct CcpMsgHeader *hdr, char *body, int len) {
+    struct ccp_ext_report_format *req = (struct ccp_ext_report_format *) body;
+    struct {
+        struct CcpMsgHeader hdr;
+        struct ccp_ext_report_format fmt;
+    } __attribute__((packed)) res;
+    u32 format;
+    int ok;
+
+    if (len < sizeof(struct ccp_ext_report_format)) {
+        return -EINVAL;
+    }
+
+    format = ccp_compact_set_format(dp->impl, req->format);
+    pr_info("[ccp] report format %u (asked for %u)\n", format, req->format);
+
+    res.hdr.Type = CCP_EXT_SET_REPORT_FORMAT;
+    res.hdr.Len = sizeof(res);
+    res.hdr.SocketId = 0;
+    res.fmt.format = format;
+    ok = ccp_ipc_send(dp, (char *) &res, sizeof(res));
+    return ok < 0 ? ok : 0;
+}
+
+static int ccp_ext_report_ack(struct ccp_datapath *dp, struct CcpMsgHeader *hdr, char *body, int len) {
+    struct ccp_ext_report_ack *req = (struct ccp_ext_report_ack *) body;
+
+    if (len < sizeof(struct ccp_ext_report_ack)) {
+        return -EINVAL;
+    }
+    if (ccp_connection_lookup(dp, hdr->SocketId) == NULL) {
+        return -ENOENT;
+    }
+
+    ccp_compact_ack(dp, hdr->SocketId, req->seq);
+    return 0;
+}
+
+static int ccp_ext_set_trace(struct ccp_datapath *dp, struct CcpMsgHeader *hdr, char *body, int len) {
+    struct ccp_ext_trace *req = (struct ccp_ext_trace *) body;
+    struct ccp_connection *conn;
+
+    if (len < sizeof(struct ccp_ext_trace)) {
+        return -EINVAL;
+    }
+
+    conn = ccp_connection_lookup(dp, hdr->SocketId);
+    if (conn == NULL) {
+        return -ENOENT;
+    }
+
+    ccp_trace_set(ccp_get_impl(conn), req->enable != 0);
+    return 0;
+}
+
+// Dispatch one message of exactly len (its header's Len) bytes.
+static int ccp_ipc_recv_one(struct ccp_datapath *dp, char *buf, int len) {
+    struct CcpMsgHeader *hdr = (struct CcpMsgHeader *) buf;
+    char *body = buf + sizeof(struct CcpMsgHeader);
+    int ok;
+
+    ccp_trace_agent_msg(dp, buf, len);
+
+    switch (hdr->Type) {
+    case CCP_EXT_SET_DECIMATION:
+        return ccp_ext_set_decimation(dp, hdr, body, hdr->Len - sizeof(struct CcpMsgHeader));
+    case CCP_EXT_RESYNC:
+        // may be called from the ACK path, so walk the table from a worker
+        schedule_work(&((struct ccp_net *) dp->impl)->resync_work);
+        return 0;
+    case CCP_EXT_BULK_CHANGE_PROG:
+        return ccp_ext_bulk_change_prog(dp, hdr);
+    case CCP_EXT_BATCH_UPDATE:
+        return ccp_ext_batch_update(dp, hdr, body, hdr->Len - sizeof(struct CcpMsgHeader));
+    case CCP_EXT_SET_TRACE:
+        return ccp_ext_set_trace(dp, hdr, body, hdr->Len - sizeof(struct CcpMsgHeader));
+    case CCP_EXT_SET_DEFAULT_PROG:
+        return ccp_ext_set_default_prog(dp, hdr, body, hdr->Len - sizeof(struct CcpMsgHeader));
+    case CCP_EXT_SET_REPORT_FORMAT:
+        return ccp_ext_set_report_format(dp, hdr, body, hdr->Len - sizeof(struct CcpMsgHeader));
+    case CCP_EXT_REPORT_KEYFRAME:
+        if (ccp_connection_lookup(dp, hdr->SocketId) == NULL) {
+            return -ENOENT;
+        }
+        ccp_compact_key(dp, hdr->SocketId);
+        return 0;
+    case CCP_EXT_REPORT_ACK:
+        return ccp_ext_report_ack(dp, hdr, body, hdr->Len - sizeof(struct CcpMsgHeader));
+    case UPDATE_FIELDS:
+    case CHANGE_PROG:
+        ccp_stats_agent_action(dp, hdr->SocketId);
+        return ccp_read_msg(dp, buf, len);
+    case INSTALL_EXPR:
+        ok = ccp_read_msg(dp, buf, len);
+        ccp_ipc_update_prim_masks(dp);
+        // the body starts with the program's uid
+        if (ok >= 0 && len >= sizeof(struct CcpMsgHeader) + sizeof(u32)) {
+            ccp_trace_install(dp, ccp_program_index(dp, *(u32 *) body), buf, len);
+        }
+        return ok;
+    default:
+        return ccp_read_msg(dp, buf, len);
+    }
+}
+
+static int ccp_ipc_recv_all(struct ccp_datapath *dp, char *buf, int len) {
+    struct CcpMsgHeader *hdr;
+    int ok, ret = 0;
+
+    while (len > 0) {
+        hdr = (struct CcpMsgHeader *) buf;
+        if (len < sizeof(struct CcpMsgHeader) || hdr->Len < sizeof(struct CcpMsgHeader) || hdr->Len > len) {
+            // cannot find the next message boundary
+            return -EINVAL;
+        }
+
+        ok = ccp_ipc_recv_one(dp, buf, hdr->Len);
+        if (ok < 0 && ret == 0) {
+            ret = ok;
+        }
+        buf += hdr->Len;
+        len -= hdr->Len;
+    }
+
+    return ret;
+}
+
+int ccp_ipc_recv(struct ccp_datapath *dp, char *buf, int len) {
+    char *corrupt;
+    int ok;
+
+    if (unlikely(ccp_fault_recv_drop())) {
+        return 0;
+    }
+
+    corrupt = ccp_fault_recv_corrupt(buf, len);
+    if (unlikely(corrupt != NULL)) {
+        ok = ccp_ipc_recv_all(dp, corrupt, len);
+        kfree(corrupt);
+        return ok;
+    }
+
+    return ccp_ipc_recv_all(dp, buf, len);
+}
@@ -0,0 +1,275 @@
+/*
+ * CCP Datapath IPC
+ *
+ * Everything the datapath sends to userspace CCP goes through ccp_ipc_send,
+ * which applies datapath-wide send policy before handing the message to the
+ * configured transport (netlink or ccpkp).
+ */
+#ifndef CCP_IPC_H
+#define CCP_IPC_H
+
+#include "libccp/ccp.h"
+#include "tcp_ccp.h"
+
+/* Module-wide setup: per-CPU send batches.
+ */
+int ccp_ipc_init(void);
+void ccp_ipc_exit(void);
+
+/* Batched sends, for the batch tick (softirq context, or BHs disabled).
+ * Between begin and flush, messages sent on this CPU are concatenated into
+ * as few transport messages as they fit in, each of which the agent reads
+ * like a run of separately sent messages. Batches nest: everything goes
+ * out with the outermost flush.
+ */
+void ccp_ipc_batch_begin(void);
+void ccp_ipc_batch_flush(void);
+
+/* The connection table lock, with the messages libccp sends meanwhile
+ * (connection create and free) held back until it is dropped, so the
+ * lock is never held across a transport send.
+ */
+static inline void ccp_ipc_table_lock(struct ccp_net *cn) {
+    local_bh_disable();
+    ccp_ipc_batch_begin();
+    spin_lock(&cn->conn_lock);
+}
+
+static inline void ccp_ipc_table_unlock(struct ccp_net *cn) {
+    spin_unlock(&cn->conn_lock);
+    ccp_ipc_batch_flush();
+    local_bh_enable();
+}
+
+/* Point sends at the transport selected by the ipc module parameter
+ * (IPC_NETLINK or IPC_CHARDEV). Called once, before anything is sent.
+ */
+void ccp_ipc_set_transport(int ipc);
+
+/* Set up the IPC state of a newly created namespace datapath.
+ */
+void ccp_ipc_net_init(struct ccp_net *cn);
+
+/* Stop IPC work of a namespace datapath that is going away.
+ */
+void ccp_ipc_net_exit(struct ccp_net *cn);
+
+/* Recompute the primitive groups (CCP_PRIM_*, see ccp_fold.h) each
+ * installed program reads, after the agent installed one.
+ */
+void ccp_ipc_update_prim_masks(struct ccp_datapath *dp);
+
+/* The namespace's report backpressure level (see struct
+ * ccp_backpressure), 0 when report_backpressure is off.
+ */
+int ccp_ipc_bp_level(struct ccp_datapath *dp);
+
+/* libccp send_msg callback.
+ */
+int ccp_ipc_send(struct ccp_datapath *dp, char *msg, int msg_size);
+
+/* Datapath extension messages (agent -> datapath).
+ * They use the regular CcpMsgHeader, with types at or above
+ * CCP_EXT_MSG_BASE so they can never collide with libccp's. They are
+ * handled by this module; everything else is passed on to libccp.
+ */
+#define CCP_EXT_MSG_BASE 0x100
+
+/* Per-flow ACK decimation, see ccp_set_decimation().
+ * Body: struct ccp_ext_decimation
+ */
+#define CCP_EXT_SET_DECIMATION (CCP_EXT_MSG_BASE + 0)
+
+struct ccp_ext_decimation {
+    u32 acks;
+    u32 usecs;
+} __attribute__((packed));
+
+/* Resync, for an agent that (re)started while flows were active.
+ * The agent sends CCP_EXT_RESYNC (no body, SocketId ignored). The datapath
+ * answers with CCP_EXT_RESYNC_BATCH messages, each describing as many live
+ * flows as fit in one transport message, followed by one
+ * CCP_EXT_RESYNC_DONE. Flows created or freed during the walk may or may not
+ * be included; their regular create and free messages still go out.
+ */
+#define CCP_EXT_RESYNC       (CCP_EXT_MSG_BASE + 1)
+#define CCP_EXT_RESYNC_BATCH (CCP_EXT_MSG_BASE + 2)
+#define CCP_EXT_RESYNC_DONE  (CCP_EXT_MSG_BASE + 3)
+
+struct ccp_resync_flow {
+    u32 sid;
+    u32 program_uid; // 0 if no program is installed
+    // the create message's flow description, with the current cwnd (bytes)
+    u32 cwnd;
+    u32 mss;
+    u32 src_ip;
+    u32 src_port;
+    u32 dst_ip;
+    u32 dst_port;
+    char congAlg[MAX_CONG_ALG_SIZE];
+    struct ccp_primitives prims; // as of the flow's last fold
+} __attribute__((packed));
+
+// Body: header, then num_flows struct ccp_resync_flow
+struct ccp_resync_batch {
+    u32 num_flows;
+    struct ccp_resync_flow flows[];
+} __attribute__((packed));
+
+// Body: the total number of flows sent
+struct ccp_resync_done {
+    u32 num_flows;
+} __attribute__((packed));
+
+/* Bulk program switch: send one CHANGE_PROG message to every flow that
+ * runs program from_uid and/or belongs to congAlg (0 and "" match
+ * anything). The body is followed by a complete CHANGE_PROG message, whose
+ * SocketId is ignored. The switch happens asynchronously; one may be
+ * pending per datapath at a time.
+ */
+#define CCP_EXT_BULK_CHANGE_PROG (CCP_EXT_MSG_BASE + 4)
+
+struct ccp_ext_bulk_change_prog {
+    u32 from_uid;
+    char congAlg[MAX_CONG_ALG_SIZE];
+} __attribute__((packed));
+
+/* Batch update: many actuations, on any number of flows, in one message.
+ * The datapath applies the entries in order and answers with
+ * CCP_EXT_BATCH_UPDATE_RESULT, whose bitmap has bit i set if entry i
+ * failed (unknown flow, field or register, or a cwnd or rate above
+ * U32_MAX). Batches with more entries than their result can carry in one
+ * message of the active transport (CCP_BATCH_MAX_ENTRIES, or
+ * CCP_BATCH_MAX_ENTRIES_CHARDEV) are rejected as a whole.
+ */
+#define CCP_EXT_BATCH_UPDATE        (CCP_EXT_MSG_BASE + 5)
+#define CCP_EXT_BATCH_UPDATE_RESULT (CCP_EXT_MSG_BASE + 6)
+
+#define CCP_BATCH_FIELD_CWND 0 // bytes
+#define CCP_BATCH_FIELD_RATE 1 // bytes per second
+#define CCP_BATCH_FIELD_REG  2 // control register number reg
+
+#define CCP_BATCH_MAX_ENTRIES 4000 // keeps the message within a 16-bit Len
+
+struct ccp_batch_entry {
+    u32 sid;
+    u16 field;
+    u16 reg;
+    u64 value;
+} __attribute__((packed));
+
+// Body: header, then num_entries entries
+struct ccp_ext_batch_update {
+    u32 batch_id; // echoed in the result
+    u32 num_entries;
+    struct ccp_batch_entry entries[];
+} __attribute__((packed));
+
+// Body: header, then a bitmap of (num_entries + 63) / 64 words
+struct ccp_ext_batch_result {
+    u32 batch_id;
+    u32 num_entries;
+    u32 num_failed;
+    u64 failed[];
+} __attribute__((packed));
+
+// as many entries as a result bitmap in one ccpkp message has bits for
+#define CCP_BATCH_MAX_ENTRIES_CHARDEV \
+    ((MAX_MSG_LEN - sizeof(struct CcpMsgHeader) - sizeof(struct ccp_ext_batch_result)) / sizeof(u64) * 64)
+
+/* Start (enable != 0) or stop recording a flow's inputs, see ccp_trace.h.
+ * Body: struct ccp_ext_trace
+ */
+#define CCP_EXT_SET_TRACE (CCP_EXT_MSG_BASE + 7)
+
+struct ccp_ext_trace {
+    u32 enable;
+} __attribute__((packed));
+
+/* Default program per algorithm: from now on, install the embedded
+ * CHANGE_PROG message (SocketId ignored) on every new flow of congAlg (see
+ * ccp_sk_alg) as it is created, without a round trip to the agent. The body
+ * is followed by the CHANGE_PROG message (at most CCP_DEFAULT_PROG_MAX_LEN
+ * bytes), or by nothing to stop doing so. Up to CCP_MAX_DEFAULT_PROGS
+ * algorithms can have one. Right after a flow's create message, the
+ * datapath tells the agent what it installed with
+ * CCP_EXT_DEFAULT_PROG_APPLIED.
+ */
+#define CCP_EXT_SET_DEFAULT_PROG (CCP_EXT_MSG_BASE + 8)
+
+struct ccp_ext_default_prog {
+    char congAlg[MAX_CONG_ALG_SIZE];
+} __attribute__((packed));
+
+/* Report format, see ccp_compact.h. The agent asks for format
+ * (CCP_REPORT_FULL or CCP_REPORT_COMPACT; SocketId ignored), and the
+ * datapath answers with the same message carrying the format now in
+ * effect, which stays MEASURE if compact reports are not available.
+ */
+#define CCP_EXT_SET_REPORT_FORMAT (CCP_EXT_MSG_BASE + 9)
+
+struct ccp_ext_report_format {
+    u32 format;
+} __attribute__((packed));
+
+/* Make SocketId's next compact report a key frame (no body), e.g. after
+ * the agent saw a gap in its seq.
+ */
+#define CCP_EXT_REPORT_KEYFRAME (CCP_EXT_MSG_BASE + 10)
+
+// Datapath -> agent, body in ccp_compact.h
+#define CCP_EXT_MEASURE_COMPACT (CCP_EXT_MSG_BASE + 11)
+
+/* Datapath -> agent, SocketId 0: the report backpressure level changed
+ * (see struct ccp_backpressure). Sent on the urgent lane.
+ */
+#define CCP_EXT_BACKPRESSURE (CCP_EXT_MSG_BASE + 12)
+
+struct ccp_ext_backpressure {
+    u32 level;
+} __attribute__((packed));
+
+/* Datapath -> agent: SocketId was just created with its algorithm's
+ * default program, which is now running (0 if it could not be installed).
+ */
+#define CCP_EXT_DEFAULT_PROG_APPLIED (CCP_EXT_MSG_BASE + 13)
+
+struct ccp_ext_default_prog_applied {
+    u32 program_uid;
+} __attribute__((packed));
+
+/* The agent decoded SocketId's compact report seq (the low 8 bits): the
+ * flow's later delta frames may use it as their base, see ccp_compact.h.
+ */
+#define CCP_EXT_REPORT_ACK (CCP_EXT_MSG_BASE + 14)
+
+struct ccp_ext_report_ack {
+    u32 seq;
+} __attribute__((packed));
+
+// Wire layout of a measurement message body, as written by libccp
+struct ccp_measure_body {
+    u32 program_uid;
+    u32 num_fields;
+    u64 fields[];
+} __attribute__((packed));
+
+/* Set up the datapath's side of a just created connection: reset its
+ * report encoding and copy congAlg's default program, if it has one, to
+ * prog (CCP_DEFAULT_PROG_MAX_LEN bytes). Returns its length, or 0.
+ * Called with the table lock held.
+ */
+int ccp_ipc_flow_start(struct ccp_datapath *dp, struct ccp_connection *conn, const char *congAlg, char *prog);
+
+/* Install the default program ccp_ipc_flow_start copied to prog on conn
+ * and tell the agent. Called after the table lock was dropped.
+ */
+void ccp_ipc_flow_default_prog(struct ccp_datapath *dp, struct ccp_connection *conn, char *prog, int len);
+
+/* Receive handler for the transports: dispatches every agent message in
+ * buf, which holds one or more messages back to back. Returns 0, or the
+ * first message's error; later messages are still processed.
+ */
+int ccp_ipc_recv(struct ccp_datapath *dp, char *buf, int len);
+
+#endif
@@ -1,43 +1,51 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <net/tcp.h>
 #include "ccp_nl.h"
 
 #define CCP_MULTICAST_GROUP 22
+#define CCP_URGENT_MULTICAST_GROUP 23
+
+// agents have to join the urgent group to see these messages at all
+static bool nl_urgent_group = false;
+module_param(nl_urgent_group, bool, 0644);
+MODULE_PARM_DESC(nl_urgent_group, "Send urgent reports (timeouts, losses, ECN) to netlink multicast group 23 instead of 22");
 
 ccp_nl_recv_handler ccp_msg_reader = NULL;
-struct sock *nl_sk;
-extern struct ccp_datapath *kernel_datapath;
 
 // callback from userspace ccp
-// all messages will be PatternMsg OR InstallFoldMsg
-// lookup ccp socket id, install new pattern
+// an skb may carry several netlink messages, each with one or more
+// concatenated ccp messages; every one of them is handed to the reader
 void nl_recv(struct sk_buff *skb) {
     int ok;
+    int len = skb->len;
     struct nlmsghdr *nlh = nlmsg_hdr(skb);
-    if (ccp_msg_reader == NULL) {
+    struct ccp_net *cn = ccp_net(sock_net(skb->sk));
+    if (ccp_msg_reader == NULL || !smp_load_acquire(&cn->dp_ready)) {
         pr_info("[ccp] [nl] ccp_msg_reader not ready\n");
         return;
     }
-    
-    //printk(KERN_INFO "[ ");
-    //for (i = 0; i < hdr->Len; i++) {
-    //    printk(KERN_INFO "%02x, ", (u32) buf[i]);
-    //}
-    //printk(KERN_INFO "]\n");
-
-    ok = ccp_msg_reader(kernel_datapath, (char*)nlmsg_data(nlh), nlh->nlmsg_len);
-    if (ok < 0) {
-        pr_info("[ccp] [nl] message read failed: %d.\n", ok);
+
+    for (; nlmsg_ok(nlh, len); nlh = nlmsg_next(nlh, &len)) {
+        ok = ccp_msg_reader(cn->dp, (char*)nlmsg_data(nlh), nlmsg_len(nlh));
+        if (ok < 0) {
+            pr_info("[ccp] [nl] message read failed: %d.\n", ok);
+        }
+        // agents that want to know which message failed ask for acks
+        if (nlh->nlmsg_flags & NLM_F_ACK) {
+            netlink_ack(skb, nlh, ok < 0 ? ok : 0, NULL);
+        }
     }
 }
 
-int ccp_nl_sk(ccp_nl_recv_handler msg) {
+int ccp_nl_sk(struct ccp_net *cn, ccp_nl_recv_handler msg) {
     struct netlink_kernel_cfg cfg = {
         .input = nl_recv,
     };
 
     ccp_msg_reader = msg;
-    nl_sk = netlink_kernel_create(&init_net, NETLINK_USERSOCK, &cfg);
-    if (!nl_sk) {
+    cn->nl_sk = netlink_kernel_create(cn->net, NETLINK_USERSOCK, &cfg);
+    if (!cn->nl_sk) {
         printk(KERN_ALERT "[ccp] [nl] Error creating netlink socket.\n");
         return -1;
     }
@@ -45,19 +53,22 @@ int ccp_nl_sk(ccp_nl_recv_handler msg) {
     return 0;
 }
 
-void free_ccp_nl_sk(void) {
-    netlink_kernel_release(nl_sk);
+void free_ccp_nl_sk(struct ccp_net *cn) {
+    netlink_kernel_release(cn->nl_sk);
+    cn->nl_sk = NULL;
 }
 
 // send IPC message to userspace ccp
-int nl_sendmsg(
+static int nl_sendmsg_group(
     struct ccp_datapath *dp,
     char *msg, 
-    int msg_size
+    int msg_size,
+    u32 group
 ) {
     int res;
     struct sk_buff *skb_out;
     struct nlmsghdr *nlh;
+    struct ccp_net *cn = dp->impl;
 
     //pr_info("ccp: sending nl message: (%d) type: %02x len: %02x sid: %04x", msg_size, *msg, *(msg + sizeof(u8)), *(msg + 2*sizeof(u8)));
 
@@ -86,10 +97,10 @@ int nl_sendmsg(
     // reflect this."
     // Use an allocation without __GFP_DIRECT_RECLAIM
     res = nlmsg_multicast(
-        nl_sk,               // @sk: netlink socket to spread messages to
+        cn->nl_sk,           // @sk: netlink socket to spread messages to
         skb_out,             // @skb: netlink message as socket buffer
         0,                   // @portid: own netlink portid to avoid sending to yourself
-        CCP_MULTICAST_GROUP, // @group: multicast group id
+        group,               // @group: multicast group id
         GFP_NOWAIT           // @flags: allocation flags
     );
     if (res < 0) {
@@ -98,3 +109,19 @@ int nl_sendmsg(
 
     return 0;
 }
+
+int nl_sendmsg(
+    struct ccp_datapath *dp,
+    char *msg, 
+    int msg_size
+) {
+    return nl_sendmsg_group(dp, msg, msg_size, CCP_MULTICAST_GROUP);
+}
+
+int nl_sendmsg_urgent(
+    struct ccp_datapath *dp,
+    char *msg, 
+    int msg_size
+) {
+    return nl_sendmsg_group(dp, msg, msg_size, READ_ONCE(nl_urgent_group) ? CCP_URGENT_MULTICAST_GROUP : CCP_MULTICAST_GROUP);
+}
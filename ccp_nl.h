@@ -7,18 +7,19 @@
 #define CCP_NL_H
 
 #include "libccp/ccp.h"
+#include "tcp_ccp.h"
 
 typedef int (*ccp_nl_recv_handler)(struct ccp_datapath *datapath, char *msg, int msg_size);
 
-/* Create a netlink kernel socket
- * A global (struct sock*), ccp_nl_sk, will get set so we can use the socket
+/* Create a netlink kernel socket in cn's namespace
+ * cn->nl_sk will get set so we can use the socket
  * There is *only one* netlink socket active *per datapath*
  */
-int ccp_nl_sk(ccp_nl_recv_handler msg);
+int ccp_nl_sk(struct ccp_net *cn, ccp_nl_recv_handler msg);
 
-/* Wrap netlink_kernel_release of (struct sock *ccp_nl_sk).
+/* Wrap netlink_kernel_release of cn->nl_sk.
  */
-void free_ccp_nl_sk(void);
+void free_ccp_nl_sk(struct ccp_net *cn);
 
 /* Send serialized message to userspace CCP
  */
@@ -28,4 +29,15 @@ int nl_sendmsg(
     int msg_size
 );
 
+/* Send an urgent message: to its own multicast group if nl_urgent_group is
+ * set, so it does not queue behind routine reports on the agent's socket.
+ * Agent messages need no urgent lane here: netlink hands them to the
+ * datapath synchronously, in the agent's sendmsg.
+ */
+int nl_sendmsg_urgent(
+    struct ccp_datapath *dp,
+    char *msg, 
+    int msg_size
+);
+
 #endif
@@ -0,0 +1,303 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/workqueue.h>
+#include <net/tcp.h>
+
+#include "ccp_setup.h"
+#include "ccp_agg.h"
+#include "ccp_ipc.h"
+
+static bool async_start = true;
+module_param(async_start, bool, 0644);
+MODULE_PARM_DESC(async_start, "Register new flows with the agent from a worker rather than in init");
+
+static unsigned int agg_cache = 32;
+module_param(agg_cache, uint, 0444);
+MODULE_PARM_DESC(agg_cache, "Aggregation metadata and aggregates kept preallocated per CPU for joining flows (0 = allocate when joining)");
+
+#define CCP_CACHE_META 0
+#define CCP_CACHE_AGG  1
+#define CCP_CACHES     2
+
+static const size_t ccp_cache_size[CCP_CACHES] = {
+    [CCP_CACHE_META] = sizeof(struct ccp_meta),
+    [CCP_CACHE_AGG] = sizeof(struct ccp_agg),
+};
+
+/* A CPU's cached objects and the sockets waiting for their connection.
+ * Mostly touched from its own CPU, but the worker can run elsewhere when
+ * the CPU goes offline, hence the lock.
+ */
+struct ccp_setup_cpu {
+    spinlock_t lock;
+    u32 npending;
+    u32 cached[CCP_CACHES];
+    bool drawn[CCP_CACHES]; // taken from since last full, so worth refilling
+    void *cache[CCP_CACHES][CCP_SETUP_CACHE_MAX]; // zeroed, on this CPU's node
+    struct sock *pending[CCP_SETUP_PENDING]; // holds a reference while queued
+    struct work_struct work;
+    int cpu;
+};
+
+static struct ccp_setup_cpu __percpu *setups = NULL;
+
+static inline u32 ccp_setup_cache_target(void) {
+    return min_t(u32, agg_cache, CCP_SETUP_CACHE_MAX);
+}
+
+static void ccp_setup_kick(struct ccp_setup_cpu *s) {
+    schedule_work_on(s->cpu, &s->work);
+}
+
+static void *ccp_setup_obj_get(int which, int node) {
+    struct ccp_setup_cpu *s;
+    void *obj = NULL;
+
+    if (setups != NULL) {
+        local_bh_disable();
+        s = this_cpu_ptr(setups);
+        // the cache only holds objects on this CPU's node
+        if (node == cpu_to_node(s->cpu)) {
+            spin_lock(&s->lock);
+            if (s->cached[which] > 0) {
+                obj = s->cache[which][--s->cached[which]];
+            }
+            // refill well before running dry
+            if (s->cached[which] < ccp_setup_cache_target() / 2) {
+                s->drawn[which] = true;
+                ccp_setup_kick(s);
+            }
+            spin_unlock(&s->lock);
+        }
+        local_bh_enable();
+        if (obj != NULL) {
+            return obj;
+        }
+    }
+
+    // joins run in softirq context, or under a socket's spinlock
+    return kzalloc_node(ccp_cache_size[which], GFP_ATOMIC, node);
+}
+
+static void ccp_setup_obj_put(int which, void *obj) {
+    struct ccp_setup_cpu *s;
+
+    if (obj == NULL) {
+        return;
+    }
+    if (setups != NULL) {
+        // zeroed here, off the join path
+        memset(obj, 0, ccp_cache_size[which]);
+        local_bh_disable();
+        s = this_cpu_ptr(setups);
+        if (page_to_nid(virt_to_page(obj)) == cpu_to_node(s->cpu)) {
+            spin_lock(&s->lock);
+            if (s->cached[which] < ccp_setup_cache_target()) {
+                s->cache[which][s->cached[which]++] = obj;
+                obj = NULL;
+            }
+            spin_unlock(&s->lock);
+        }
+        local_bh_enable();
+    }
+
+    kfree(obj);
+}
+
+struct ccp_meta *ccp_setup_meta_get(int node) {
+    return ccp_setup_obj_get(CCP_CACHE_META, node);
+}
+
+void ccp_setup_meta_put(struct ccp_meta *meta) {
+    ccp_setup_obj_put(CCP_CACHE_META, meta);
+}
+
+struct ccp_agg *ccp_setup_agg_get(int node) {
+    return ccp_setup_obj_get(CCP_CACHE_AGG, node);
+}
+
+void ccp_setup_agg_put(struct ccp_agg *agg) {
+    ccp_setup_obj_put(CCP_CACHE_AGG, agg);
+}
+
+bool ccp_setup_defer_start(struct sock *sk, bool always) {
+    struct ccp_setup_cpu *s;
+    bool queued = false;
+
+    if ((!READ_ONCE(async_start) && !always) || setups == NULL) {
+        return false;
+    }
+
+    local_bh_disable();
+    s = this_cpu_ptr(setups);
+    spin_lock(&s->lock);
+    if (s->npending < CCP_SETUP_PENDING) {
+        sock_hold(sk);
+        s->pending[s->npending++] = sk;
+        queued = true;
+        if (s->npending == 1) {
+            ccp_setup_kick(s);
+        }
+    }
+    spin_unlock(&s->lock);
+    local_bh_enable();
+
+    return queued;
+}
+
+/* Top the CPU's caches back up to agg_cache, but only those that joins
+ * drew from since they were last full: hosts that never aggregate never
+ * allocate any.
+ */
+static void ccp_setup_refill(struct ccp_setup_cpu *s) {
+    u32 target = ccp_setup_cache_target();
+    int which;
+    void *obj;
+
+    for (which = 0; which < CCP_CACHES; which++) {
+        for (;;) {
+            spin_lock_bh(&s->lock);
+            if (!s->drawn[which] || s->cached[which] >= target) {
+                s->drawn[which] = false;
+                spin_unlock_bh(&s->lock);
+                break;
+            }
+            spin_unlock_bh(&s->lock);
+
+            obj = kzalloc_node(ccp_cache_size[which], GFP_KERNEL, cpu_to_node(s->cpu));
+            if (!obj) {
+                break;
+            }
+
+            spin_lock_bh(&s->lock);
+            if (s->cached[which] < target) {
+                s->cache[which][s->cached[which]++] = obj;
+                obj = NULL;
+            }
+            spin_unlock_bh(&s->lock);
+            kfree(obj);
+        }
+    }
+}
+
+/* Start every queued connection. Sockets that are not owned by a user
+ * context are started in one softirq-like pass, so that their create
+ * messages go out batched; the others are locked (and waited for) one by
+ * one afterwards.
+ */
+static void ccp_setup_start_pending(struct ccp_setup_cpu *s) {
+    struct sock *batch[64], *owned[64];
+    u32 n, nowned, i;
+
+    for (;;) {
+        spin_lock_bh(&s->lock);
+        n = min_t(u32, s->npending, ARRAY_SIZE(batch));
+        s->npending -= n;
+        memcpy(batch, &s->pending[s->npending], n * sizeof(struct sock *));
+        spin_unlock_bh(&s->lock);
+
+        if (n == 0) {
+            return;
+        }
+
+        // a namespace's first flow brings its datapath; without one, the
+        // flow keeps running Reno
+        for (i = 0; i < n; i++) {
+            if (ccp_net_dp_create(sock_net(batch[i])) < 0) {
+                sock_put(batch[i]);
+                batch[i] = NULL;
+            }
+        }
+
+        nowned = 0;
+        local_bh_disable();
+        ccp_ipc_batch_begin();
+        for (i = 0; i < n; i++) {
+            struct sock *sk = batch[i];
+
+            if (sk == NULL) {
+                continue;
+            }
+            bh_lock_sock(sk);
+            if (sock_owned_by_user(sk)) {
+                bh_unlock_sock(sk);
+                owned[nowned++] = sk;
+                continue;
+            }
+            ccp_start_queued(sk);
+            bh_unlock_sock(sk);
+            sock_put(sk);
+        }
+        ccp_ipc_batch_flush();
+        local_bh_enable();
+
+        for (i = 0; i < nowned; i++) {
+            lock_sock(owned[i]);
+            ccp_start_queued(owned[i]);
+            release_sock(owned[i]);
+            sock_put(owned[i]);
+        }
+
+        cond_resched();
+    }
+}
+
+static void ccp_setup_work(struct work_struct *work) {
+    struct ccp_setup_cpu *s = container_of(work, struct ccp_setup_cpu, work);
+
+    ccp_setup_start_pending(s);
+    ccp_setup_refill(s);
+}
+
+int ccp_setup_init(void) {
+    int cpu;
+
+    setups = alloc_percpu(struct ccp_setup_cpu);
+    if (setups == NULL) {
+        pr_info("[ccp] could not allocate flow setup queues and caches\n");
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu) {
+        struct ccp_setup_cpu *s = per_cpu_ptr(setups, cpu);
+        spin_lock_init(&s->lock);
+        memset(s->cached, 0, sizeof(s->cached));
+        memset(s->drawn, 0, sizeof(s->drawn));
+        s->npending = 0;
+        s->cpu = cpu;
+        INIT_WORK(&s->work, ccp_setup_work);
+    }
+
+    return 0;
+}
+
+// Only called once no socket uses the module any more.
+void ccp_setup_exit(void) {
+    int cpu, which;
+    u32 i;
+
+    if (setups == NULL) {
+        return;
+    }
+
+    for_each_possible_cpu(cpu) {
+        struct ccp_setup_cpu *s = per_cpu_ptr(setups, cpu);
+        cancel_work_sync(&s->work);
+        for (i = 0; i < s->npending; i++) {
+            sock_put(s->pending[i]);
+        }
+        for (which = 0; which < CCP_CACHES; which++) {
+            for (i = 0; i < s->cached[which]; i++) {
+                kfree(s->cache[which][i]);
+            }
+            s->cached[which] = 0;
+        }
+        s->npending = 0;
+    }
+
+    free_percpu(setups);
+    setups = NULL;
+}
@@ -0,0 +1,52 @@
+/*
+ * CCP Flow Setup
+ *
+ * Keeps tcp_ccp_init cheap under accept storms, where it runs in softirq
+ * context once per passive open:
+ *
+ *   - with async_start (the default), init does not register the flow
+ *     with the agent itself. It queues the socket on its CPU, and a worker
+ *     starts every queued connection in one pass, with their create
+ *     messages batched into as few transport messages as they fit in.
+ *     Until then the flow runs Reno in the kernel, like a lazily
+ *     registered one. Flows of a namespace without a datapath yet always
+ *     take this path, since creating it may sleep.
+ *   - flows joining an aggregate take their struct ccp_meta, and the
+ *     struct ccp_agg they may create, from per-CPU caches of zeroed
+ *     objects (agg_cache of each per CPU), refilled from the same worker;
+ *     a join only allocates when its CPU's cache ran dry.
+ */
+#ifndef CCP_SETUP_H
+#define CCP_SETUP_H
+
+#include <net/tcp.h>
+#include "tcp_ccp.h"
+
+// sockets each CPU can have waiting for their connection; more start in init
+#define CCP_SETUP_PENDING 256
+#define CCP_SETUP_CACHE_MAX 256
+
+struct ccp_agg;
+
+int ccp_setup_init(void);
+void ccp_setup_exit(void);
+
+/* Zeroed objects for a joining flow, allocated on node (NUMA), or NULL.
+ * Never sleep.
+ */
+struct ccp_meta *ccp_setup_meta_get(int node);
+struct ccp_agg *ccp_setup_agg_get(int node);
+
+/* Give a leaving flow's objects back.
+ */
+void ccp_setup_meta_put(struct ccp_meta *meta);
+void ccp_setup_agg_put(struct ccp_agg *agg);
+
+/* Queue sk's connection start for this CPU's setup worker, which creates
+ * its namespace's datapath if needed and calls ccp_start_queued on it.
+ * Only queues with async_start, or always. Returns false if it should be
+ * started now.
+ */
+bool ccp_setup_defer_start(struct sock *sk, bool always);
+
+#endif
@@ -0,0 +1,306 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <net/tcp.h>
+
+#include "ccp_stats.h"
+
+static bool latency_stats = true;
+module_param(latency_stats, bool, 0644);
+MODULE_PARM_DESC(latency_stats, "Measure report-to-action latency of the control loop");
+
+static bool latency_per_flow = false;
+module_param(latency_per_flow, bool, 0444);
+MODULE_PARM_DESC(latency_per_flow, "Also keep a latency histogram per connection (debugfs ccp/flows-<netns>)");
+
+struct ccp_hist {
+    u64 buckets[CCP_HIST_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct ccp_hist, latency_hist);
+static DEFINE_PER_CPU(struct ccp_hist, acks_hist);
+
+static struct dentry *ccp_debugfs;
+static atomic_t fallbacks = ATOMIC_INIT(0);
+
+static inline unsigned int ccp_hist_bucket(u64 v) {
+    unsigned int msb;
+
+    if (v < (1 << CCP_HIST_SUB_BITS)) {
+        return v;
+    }
+
+    msb = fls64(v) - 1;
+    return ((msb - CCP_HIST_SUB_BITS + 1) << CCP_HIST_SUB_BITS) |
+        ((v >> (msb - CCP_HIST_SUB_BITS)) & ((1 << CCP_HIST_SUB_BITS) - 1));
+}
+
+// Smallest value that lands in bucket b
+static inline u64 ccp_hist_lower(unsigned int b) {
+    unsigned int msb, sub;
+
+    if (b < (1 << CCP_HIST_SUB_BITS)) {
+        return b;
+    }
+
+    msb = (b >> CCP_HIST_SUB_BITS) + CCP_HIST_SUB_BITS - 1;
+    sub = b & ((1 << CCP_HIST_SUB_BITS) - 1);
+    return (1ULL << msb) | ((u64) sub << (msb - CCP_HIST_SUB_BITS));
+}
+
+static u64 ccp_hist_percentile(const u64 *buckets, u64 total, unsigned int permille) {
+    u64 rank = div_u64(total * permille + 999, 1000), seen = 0;
+    unsigned int b;
+
+    for (b = 0; b < CCP_HIST_BUCKETS; b++) {
+        seen += buckets[b];
+        if (seen >= rank && seen > 0) {
+            return ccp_hist_lower(b);
+        }
+    }
+
+    return 0;
+}
+
+static void ccp_hist_show(struct seq_file *m, const u64 *buckets) {
+    u64 total = 0;
+    unsigned int b;
+
+    for (b = 0; b < CCP_HIST_BUCKETS; b++) {
+        total += buckets[b];
+    }
+
+    seq_printf(m, "count %llu p50 %llu p90 %llu p99 %llu p999 %llu\n", total,
+        ccp_hist_percentile(buckets, total, 500),
+        ccp_hist_percentile(buckets, total, 900),
+        ccp_hist_percentile(buckets, total, 990),
+        ccp_hist_percentile(buckets, total, 999));
+    for (b = 0; b < CCP_HIST_BUCKETS; b++) {
+        if (buckets[b] != 0) {
+            seq_printf(m, "%llu %llu\n", ccp_hist_lower(b), buckets[b]);
+        }
+    }
+}
+
+static int ccp_percpu_hist_show(struct seq_file *m, void *v) {
+    struct ccp_hist __percpu *hist = m->private;
+    u64 *sum;
+    int cpu, b;
+
+    sum = kcalloc(CCP_HIST_BUCKETS, sizeof(u64), GFP_KERNEL);
+    if (!sum) {
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu) {
+        struct ccp_hist *h = per_cpu_ptr(hist, cpu);
+        for (b = 0; b < CCP_HIST_BUCKETS; b++) {
+            sum[b] += READ_ONCE(h->buckets[b]);
+        }
+    }
+
+    ccp_hist_show(m, sum);
+    kfree(sum);
+    return 0;
+}
+
+static int ccp_percpu_hist_open(struct inode *inode, struct file *file) {
+    return single_open(file, ccp_percpu_hist_show, inode->i_private);
+}
+
+static const struct file_operations ccp_percpu_hist_fops = {
+    .owner = THIS_MODULE,
+    .open = ccp_percpu_hist_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// One line per live connection: sid, then its latency percentiles
+static int ccp_flow_hist_show(struct seq_file *m, void *v) {
+    struct ccp_net *cn = m->private;
+    struct ccp_datapath *dp = cn->dp;
+    u64 *sum;
+    u32 i, b;
+
+    sum = kcalloc(CCP_HIST_BUCKETS, sizeof(u64), GFP_KERNEL);
+    if (!sum) {
+        return -ENOMEM;
+    }
+
+    seq_puts(m, "sid count p50 p90 p99\n");
+    for (i = 0; i < dp->max_connections; i++) {
+        u32 *h = &cn->flow_hist[i * CCP_HIST_BUCKETS];
+        u64 total = 0;
+
+        if (READ_ONCE(dp->ccp_active_connections[i].index) == 0) {
+            continue;
+        }
+        for (b = 0; b < CCP_HIST_BUCKETS; b++) {
+            sum[b] = READ_ONCE(h[b]);
+            total += sum[b];
+        }
+        if (total == 0) {
+            continue;
+        }
+        seq_printf(m, "%u %llu %llu %llu %llu\n", i + 1, total,
+            ccp_hist_percentile(sum, total, 500),
+            ccp_hist_percentile(sum, total, 900),
+            ccp_hist_percentile(sum, total, 990));
+        cond_resched();
+    }
+
+    kfree(sum);
+    return 0;
+}
+
+static int ccp_flow_hist_open(struct inode *inode, struct file *file) {
+    return single_open(file, ccp_flow_hist_show, inode->i_private);
+}
+
+static const struct file_operations ccp_flow_hist_fops = {
+    .owner = THIS_MODULE,
+    .open = ccp_flow_hist_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+int ccp_stats_init(void) {
+    ccp_debugfs = debugfs_create_dir("ccp", NULL);
+    if (IS_ERR(ccp_debugfs)) {
+        // statistics are best effort, the datapath works without them
+        pr_info("[ccp] could not create debugfs directory\n");
+        ccp_debugfs = NULL;
+        return 0;
+    }
+
+    debugfs_create_file("report_latency_ns", 0444, ccp_debugfs, &latency_hist, &ccp_percpu_hist_fops);
+    debugfs_create_file("report_acks", 0444, ccp_debugfs, &acks_hist, &ccp_percpu_hist_fops);
+    debugfs_create_atomic_t("fallbacks", 0444, ccp_debugfs, &fallbacks);
+    return 0;
+}
+
+void ccp_stats_fallback(void) {
+    atomic_inc(&fallbacks);
+}
+
+struct dentry *ccp_stats_debugfs(void) {
+    return ccp_debugfs;
+}
+
+void ccp_stats_exit(void) {
+    debugfs_remove_recursive(ccp_debugfs);
+    ccp_debugfs = NULL;
+}
+
+int ccp_stats_net_init(struct ccp_net *cn) {
+    char name[32];
+
+    cn->flow_stats = kvcalloc(cn->dp->max_connections, sizeof(struct ccp_flow_stats), GFP_KERNEL);
+    if (!cn->flow_stats) {
+        return -ENOMEM;
+    }
+
+    if (latency_per_flow) {
+        cn->flow_hist = kvcalloc((size_t) cn->dp->max_connections * CCP_HIST_BUCKETS, sizeof(u32), GFP_KERNEL);
+        if (cn->flow_hist && ccp_debugfs) {
+            snprintf(name, sizeof(name), "flows-%u", cn->net->ns.inum);
+            cn->flow_debugfs = debugfs_create_file(name, 0444, ccp_debugfs, cn, &ccp_flow_hist_fops);
+        }
+    }
+
+    return 0;
+}
+
+void ccp_stats_net_exit(struct ccp_net *cn) {
+    debugfs_remove(cn->flow_debugfs);
+    cn->flow_debugfs = NULL;
+    kvfree(cn->flow_hist);
+    cn->flow_hist = NULL;
+    kvfree(cn->flow_stats);
+    cn->flow_stats = NULL;
+}
+
+static inline struct ccp_flow_stats *ccp_flow_stats(struct ccp_datapath *dp, u32 sid) {
+    struct ccp_net *cn = dp->impl;
+
+    if (cn->flow_stats == NULL || sid == 0 || sid > dp->max_connections) {
+        return NULL;
+    }
+
+    return &cn->flow_stats[sid - 1];
+}
+
+void ccp_stats_flow_start(struct ccp_datapath *dp, u16 sid) {
+    struct ccp_net *cn = dp->impl;
+    struct ccp_flow_stats *st = ccp_flow_stats(dp, sid);
+
+    if (st == NULL) {
+        return;
+    }
+
+    WRITE_ONCE(st->report_ns, 0);
+    if (cn->flow_hist != NULL) {
+        memset(&cn->flow_hist[(sid - 1) * CCP_HIST_BUCKETS], 0, CCP_HIST_BUCKETS * sizeof(u32));
+    }
+}
+
+void ccp_stats_report_sent(struct ccp_datapath *dp, u32 sid) {
+    struct ccp_flow_stats *st;
+    struct ccp_connection *conn;
+    struct sock *sk;
+
+    if (!READ_ONCE(latency_stats)) {
+        return;
+    }
+
+    st = ccp_flow_stats(dp, sid);
+    conn = ccp_connection_lookup(dp, sid);
+    if (st == NULL || conn == NULL) {
+        return;
+    }
+
+    sk = ccp_get_impl(conn);
+    // an earlier report the agent has not answered yet keeps the timestamp
+    if (cmpxchg(&st->report_ns, 0, ktime_get_ns()) == 0) {
+        st->report_sk = sk;
+        st->report_acks = ((struct ccp *) inet_csk_ca(sk))->acks;
+    }
+}
+
+void ccp_stats_agent_action(struct ccp_datapath *dp, u32 sid) {
+    struct ccp_net *cn = dp->impl;
+    struct ccp_flow_stats *st = ccp_flow_stats(dp, sid);
+    struct ccp_connection *conn;
+    struct sock *sk;
+    u64 sent, latency;
+
+    if (st == NULL) {
+        return;
+    }
+
+    sent = xchg(&st->report_ns, 0);
+    if (sent == 0) {
+        return;
+    }
+
+    latency = ktime_get_ns() - sent;
+    this_cpu_inc(latency_hist.buckets[ccp_hist_bucket(latency)]);
+    if (cn->flow_hist != NULL) {
+        cn->flow_hist[(sid - 1) * CCP_HIST_BUCKETS + ccp_hist_bucket(latency)]++;
+    }
+
+    // ACK counts are per socket, so only comparable if the same one reported
+    conn = ccp_connection_lookup(dp, sid);
+    if (conn != NULL) {
+        sk = ccp_get_impl(conn);
+        if (sk == st->report_sk) {
+            u32 acks = ((struct ccp *) inet_csk_ca(sk))->acks - st->report_acks;
+            this_cpu_inc(acks_hist.buckets[ccp_hist_bucket(acks)]);
+        }
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * CCP Control Loop Statistics
+ *
+ * Measures how stale the agent's decisions are when they land: each
+ * measurement report sent for a flow is timestamped, and the first update
+ * or program change the agent sends back for that flow closes the loop.
+ * Report-to-action latency (ns) and the number of ACKs the flow processed
+ * in between go into per-CPU log-linear histograms, exported in debugfs
+ * under ccp/.
+ */
+#ifndef CCP_STATS_H
+#define CCP_STATS_H
+
+#include "libccp/ccp.h"
+#include "tcp_ccp.h"
+
+/* Log-linear buckets: values below 2^SUB_BITS get their own bucket, and
+ * every power of two above is split into 2^SUB_BITS linear sub-buckets,
+ * which bounds the relative error to 1/2^SUB_BITS.
+ */
+#define CCP_HIST_SUB_BITS 2
+#define CCP_HIST_BUCKETS (64 << CCP_HIST_SUB_BITS)
+
+// Per-connection loop state, indexed by connection index - 1
+struct ccp_flow_stats {
+    u64 report_ns; // when the last report went out, 0 once answered
+    u32 report_acks; // the reporting socket's ACK count at that time
+    struct sock *report_sk; // only compared, never dereferenced
+};
+
+/* Module-wide setup: per-CPU histograms and the debugfs directory.
+ */
+int ccp_stats_init(void);
+void ccp_stats_exit(void);
+
+/* The module's debugfs directory, or NULL if there is none.
+ */
+struct dentry *ccp_stats_debugfs(void);
+
+/* Per-namespace setup: loop state for each of the datapath's connections.
+ */
+int ccp_stats_net_init(struct ccp_net *cn);
+void ccp_stats_net_exit(struct ccp_net *cn);
+
+/* A connection index was (re)used for a new flow.
+ */
+void ccp_stats_flow_start(struct ccp_datapath *dp, u16 sid);
+
+/* A measurement report for sid went out.
+ */
+void ccp_stats_report_sent(struct ccp_datapath *dp, u32 sid);
+
+/* The agent acted on sid (updated fields or changed its program).
+ */
+void ccp_stats_agent_action(struct ccp_datapath *dp, u32 sid);
+
+/* A flow's program stopped hearing from the agent and libccp fell back
+ * (counted in debugfs ccp/fallbacks).
+ */
+void ccp_stats_fallback(void);
+
+#endif
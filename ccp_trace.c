@@ -0,0 +1,298 @@
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <net/tcp.h>
+
+#include "tcp_ccp.h"
+#include "ccp_trace.h"
+#include "ccp_stats.h"
+#include "ccpkp/lfq/lfq.h"
+#include "libccp/serialize.h"
+#include "libccp/ccp_priv.h"
+#include "libccp/machine.h"
+
+static unsigned short trace_port = 0;
+module_param(trace_port, ushort, 0644);
+MODULE_PARM_DESC(trace_port, "Trace new flows with this local or remote port (0 = none)");
+
+static struct lfq trace_q;
+static bool trace_ready = false;
+static atomic_t trace_flows = ATOMIC_INIT(0); // flows currently traced
+static atomic_t trace_dropped = ATOMIC_INIT(0); // records lost to a full ring
+
+// Laid out like libccp's UpdateField and ChangeProgMsg/UpdateFieldsMsg
+struct ccp_trace_update {
+    u8 reg_type;
+    u32 reg_index;
+    u64 new_value;
+} __attribute__((packed));
+
+struct ccp_trace_change_prog {
+    struct CcpMsgHeader hdr;
+    u32 program_uid;
+    u32 num_updates;
+    struct ccp_trace_update updates[MAX_CONTROL_REG];
+} __attribute__((packed));
+
+struct ccp_trace_update_fields {
+    struct CcpMsgHeader hdr;
+    u32 num_updates;
+    struct ccp_trace_update updates[1];
+} __attribute__((packed));
+
+static ssize_t ccp_trace_read(struct file *file, char __user *buf, size_t count, loff_t *ppos) {
+    ssize_t ret;
+
+    if (count < CCP_TRACE_MAX_RECORD) {
+        return -EINVAL;
+    }
+
+    ret = lfq_read_batch(&trace_q, (char __force *) buf, count, USERSPACE, !(file->f_flags & O_NONBLOCK), NULL);
+    if (ret == 0 && (file->f_flags & O_NONBLOCK)) {
+        return -EAGAIN;
+    }
+
+    return ret;
+}
+
+static const struct file_operations ccp_trace_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .read = ccp_trace_read,
+    .llseek = noop_llseek,
+};
+
+int ccp_trace_init(void) {
+    struct dentry *dir = ccp_stats_debugfs();
+
+    if (init_lfq(&trace_q, true) < 0) {
+        pr_info("[ccp] could not allocate trace ring\n");
+        return -ENOMEM;
+    }
+    trace_ready = true;
+
+    if (dir != NULL) {
+        debugfs_create_file("trace", 0400, dir, NULL, &ccp_trace_fops);
+        debugfs_create_atomic_t("trace_dropped", 0444, dir, &trace_dropped);
+    }
+
+    return 0;
+}
+
+void ccp_trace_exit(void) {
+    if (trace_ready) {
+        trace_ready = false;
+        free_lfq(&trace_q);
+    }
+}
+
+static void ccp_trace_emit(struct ccp_datapath *dp, u16 type, u32 sid, const void *a, u16 a_len, const void *b, u16 b_len) {
+    char rec[CCP_TRACE_MAX_RECORD];
+    struct ccp_trace_hdr *hdr = (struct ccp_trace_hdr *) rec;
+    u16 len = sizeof(struct ccp_trace_hdr) + a_len + b_len;
+
+    if (!trace_ready || len > CCP_TRACE_MAX_RECORD) {
+        return;
+    }
+
+    hdr->type = type;
+    hdr->len = len;
+    hdr->sid = sid;
+    hdr->netns = ((struct ccp_net *) dp->impl)->net->ns.inum;
+    hdr->reserved = 0;
+    hdr->now_ns = tcp_ccp_now();
+    memcpy(rec + sizeof(struct ccp_trace_hdr), a, a_len);
+    memcpy(rec + sizeof(struct ccp_trace_hdr) + a_len, b, b_len);
+
+    if (lfq_write(&trace_q, rec, len, 0, KERNELSPACE) < 0) {
+        atomic_inc(&trace_dropped);
+    }
+}
+
+static inline void ccp_trace_flow(struct sock *sk, u16 type, const void *body, u16 len) {
+    struct ccp *ca = inet_csk_ca(sk);
+    ccp_trace_emit(ccp_sk_datapath(sk), type, ca->conn->index, body, len, NULL, 0);
+}
+
+bool ccp_trace_wanted(struct sock *sk) {
+    const struct inet_sock *inet = inet_sk(sk);
+    unsigned short port = READ_ONCE(trace_port);
+
+    return port != 0 && (ntohs(inet->inet_sport) == port || ntohs(inet->inet_dport) == port);
+}
+
+void ccp_trace_set(struct sock *sk, bool enable) {
+    struct ccp *ca = inet_csk_ca(sk);
+
+    if (ca->conn == NULL || enable == ca->traced) {
+        return;
+    }
+
+    if (enable) {
+        ca->traced = true;
+        atomic_inc(&trace_flows);
+        ccp_trace_start(sk);
+    } else {
+        ccp_trace_end(sk);
+        ca->traced = false;
+        atomic_dec(&trace_flows);
+    }
+}
+
+// Record msg for sid, split into as many records as it takes
+static void ccp_trace_msg(struct ccp_datapath *dp, u32 sid, const char *msg, int len) {
+    u16 max_frag = CCP_TRACE_MAX_RECORD - sizeof(struct ccp_trace_hdr) - sizeof(struct ccp_trace_agent);
+    struct ccp_trace_agent frag;
+
+    frag.msg_len = len;
+    for (frag.offset = 0; frag.offset < len; frag.offset += max_frag) {
+        u16 n = min_t(int, len - frag.offset, max_frag);
+        ccp_trace_emit(dp, CCP_TRACE_AGENT, sid, &frag, sizeof(frag), msg + frag.offset, n);
+    }
+}
+
+/* Record what the flow runs when tracing starts, as the messages that
+ * would set it up: the install of its program (datapath-wide), then a
+ * switch to it carrying the current control registers.
+ */
+static void ccp_trace_program(struct sock *sk) {
+    struct ccp *ca = inet_csk_ca(sk);
+    struct ccp_datapath *dp = ccp_sk_datapath(sk);
+    struct ccp_net *cn = dp->impl;
+    struct ccp_priv_state *state = get_ccp_priv_state(ca->conn);
+    struct ccp_trace_change_prog change;
+    struct DatapathProgram *prog;
+    const char *install;
+    u16 index;
+    u32 i;
+
+    if (state == NULL || state->program_index == 0) {
+        return;
+    }
+    index = state->program_index;
+    prog = datapath_program_lookup(dp, index);
+    if (prog == NULL) {
+        return;
+    }
+
+    spin_lock_bh(&cn->conn_lock);
+    install = cn->prog_msgs != NULL ? cn->prog_msgs[index] : NULL;
+    if (install != NULL) {
+        ccp_trace_msg(dp, 0, install, ((const struct CcpMsgHeader *) install)->Len);
+    }
+    spin_unlock_bh(&cn->conn_lock);
+
+    change.hdr.Type = CHANGE_PROG;
+    change.hdr.Len = sizeof(change);
+    change.hdr.SocketId = ca->conn->index;
+    change.program_uid = prog->program_uid;
+    change.num_updates = MAX_CONTROL_REG;
+    for (i = 0; i < MAX_CONTROL_REG; i++) {
+        change.updates[i].reg_type = CONTROL_REG;
+        change.updates[i].reg_index = i;
+        change.updates[i].new_value = state->registers.control_registers[i];
+    }
+    ccp_trace_msg(dp, ca->conn->index, (const char *) &change, sizeof(change));
+}
+
+void ccp_trace_start(struct sock *sk) {
+    struct ccp *ca = inet_csk_ca(sk);
+    struct ccp_datapath_info info;
+    struct ccp_trace_start start;
+
+    ccp_flow_info(sk, &info);
+    start.init_cwnd = info.init_cwnd;
+    start.mss = info.mss;
+    start.src_ip = info.src_ip;
+    start.src_port = info.src_port;
+    start.dst_ip = info.dst_ip;
+    start.dst_port = info.dst_port;
+    memcpy(start.congAlg, info.congAlg, MAX_CONG_ALG_SIZE);
+    start.last_bytes_acked = ca->last_bytes_acked;
+    start.last_sacked_out = ca->last_sacked_out;
+    ccp_trace_flow(sk, CCP_TRACE_START, &start, sizeof(start));
+    ccp_trace_program(sk);
+}
+
+void ccp_trace_control_reg(struct sock *sk, u32 reg, u64 value) {
+    struct ccp *ca = inet_csk_ca(sk);
+    struct ccp_trace_update_fields update;
+
+    update.hdr.Type = UPDATE_FIELDS;
+    update.hdr.Len = sizeof(update);
+    update.hdr.SocketId = ca->conn->index;
+    update.num_updates = 1;
+    update.updates[0].reg_type = CONTROL_REG;
+    update.updates[0].reg_index = reg;
+    update.updates[0].new_value = value;
+    ccp_trace_msg(ccp_sk_datapath(sk), ca->conn->index, (const char *) &update, sizeof(update));
+}
+
+void ccp_trace_fold(struct sock *sk, const struct ccp_fold_input *in) {
+    ccp_trace_flow(sk, CCP_TRACE_FOLD, in, sizeof(*in));
+}
+
+void ccp_trace_state(struct sock *sk, u8 new_state) {
+    struct ccp_trace_state st = { .new_state = new_state };
+    ccp_trace_flow(sk, CCP_TRACE_STATE, &st, sizeof(st));
+}
+
+void ccp_trace_end(struct sock *sk) {
+    ccp_trace_flow(sk, CCP_TRACE_END, NULL, 0);
+}
+
+void ccp_trace_agent_msg(struct ccp_datapath *dp, const char *msg, int len) {
+    const struct CcpMsgHeader *hdr = (const struct CcpMsgHeader *) msg;
+    struct ccp_connection *conn;
+
+    if (atomic_read(&trace_flows) == 0) {
+        return;
+    }
+
+    if (hdr->SocketId != 0) {
+        conn = ccp_connection_lookup(dp, hdr->SocketId);
+        if (conn == NULL || !((struct ccp *) inet_csk_ca((struct sock *) ccp_get_impl(conn)))->traced) {
+            return;
+        }
+    }
+
+    // transports may hand over more than the message itself
+    ccp_trace_msg(dp, hdr->SocketId, msg, min_t(int, len, hdr->Len));
+}
+
+void ccp_trace_install(struct ccp_datapath *dp, u16 index, const char *msg, int len) {
+    struct ccp_net *cn = dp->impl;
+    char *copy, *old;
+
+    if (cn->prog_msgs == NULL || index == 0 || index > dp->max_programs) {
+        return;
+    }
+
+    // installs are rare, and may arrive on the ACK path (ccpkp_try_read)
+    copy = kmemdup(msg, len, GFP_ATOMIC);
+    spin_lock_bh(&cn->conn_lock);
+    old = cn->prog_msgs[index];
+    cn->prog_msgs[index] = copy;
+    spin_unlock_bh(&cn->conn_lock);
+    kfree(old);
+}
+
+int ccp_trace_net_init(struct ccp_net *cn) {
+    cn->prog_msgs = kcalloc(cn->dp->max_programs + 1, sizeof(char *), GFP_KERNEL);
+    return cn->prog_msgs != NULL ? 0 : -ENOMEM;
+}
+
+void ccp_trace_net_exit(struct ccp_net *cn) {
+    u32 i;
+
+    if (cn->prog_msgs == NULL) {
+        return;
+    }
+    for (i = 0; i <= cn->dp->max_programs; i++) {
+        kfree(cn->prog_msgs[i]);
+    }
+    kfree(cn->prog_msgs);
+    cn->prog_msgs = NULL;
+}
@@ -0,0 +1,107 @@
+/*
+ * CCP Measurement Traces
+ *
+ * For selected flows, the datapath records everything that drives their
+ * programs: the inputs of every fold, congestion state changes, and the
+ * agent messages addressed to them (plus datapath-wide ones, such as
+ * program installs), extension messages included. Program changes that do
+ * not arrive as libccp messages are recorded as the libccp message with
+ * the same effect: when tracing starts, the install of the flow's current
+ * program and a CHANGE_PROG to it with its control registers; batch
+ * updates of a control register, an UPDATE_FIELDS. Records are streamed
+ * through a ring to debugfs ccp/trace, and can be fed to tools/ccp_replay
+ * to rerun the same programs offline, deterministically.
+ *
+ * The record format below is shared with userspace.
+ */
+#ifndef CCP_TRACE_H
+#define CCP_TRACE_H
+
+#include "ccp_fold.h"
+
+#define CCP_TRACE_START 1 // body: struct ccp_trace_start
+#define CCP_TRACE_FOLD  2 // body: struct ccp_fold_input
+#define CCP_TRACE_STATE 3 // body: struct ccp_trace_state
+#define CCP_TRACE_AGENT 4 // body: struct ccp_trace_agent, then a message fragment
+#define CCP_TRACE_END   5 // no body
+
+struct ccp_trace_hdr {
+    uint16_t type;
+    uint16_t len; // of the whole record
+    uint32_t sid; // 0 for datapath-wide agent messages
+    uint32_t netns; // which datapath, by network namespace inode
+    uint32_t reserved;
+    uint64_t now_ns; // the datapath's clock (libccp's now())
+} __attribute__((packed));
+
+struct ccp_trace_start {
+    uint32_t init_cwnd;
+    uint32_t mss;
+    uint32_t src_ip;
+    uint32_t src_port;
+    uint32_t dst_ip;
+    uint32_t dst_port;
+    char congAlg[MAX_CONG_ALG_SIZE];
+    // struct ccp_fold_state when tracing started
+    uint32_t last_bytes_acked;
+    uint32_t last_sacked_out;
+} __attribute__((packed));
+
+struct ccp_trace_state {
+    uint32_t new_state; // TCP_CA_*
+} __attribute__((packed));
+
+// Agent messages larger than one record are split into fragments.
+struct ccp_trace_agent {
+    uint16_t msg_len;
+    uint16_t offset;
+} __attribute__((packed));
+
+#define CCP_TRACE_MAX_RECORD 512
+
+#ifdef __KERNEL__
+
+struct ccp_net;
+
+/* Module-wide setup: the ring and its debugfs files.
+ */
+int ccp_trace_init(void);
+void ccp_trace_exit(void);
+
+/* Whether a new flow should be traced from the start (trace_port).
+ */
+bool ccp_trace_wanted(struct sock *sk);
+
+/* Start or stop tracing an existing flow.
+ */
+void ccp_trace_set(struct sock *sk, bool enable);
+
+/* Records. The caller checks that the flow is traced.
+ */
+void ccp_trace_start(struct sock *sk);
+void ccp_trace_fold(struct sock *sk, const struct ccp_fold_input *in);
+void ccp_trace_state(struct sock *sk, u8 new_state);
+void ccp_trace_end(struct sock *sk);
+
+/* A write of control register reg of sk's program that bypassed libccp.
+ * The caller checks that the flow is traced.
+ */
+void ccp_trace_control_reg(struct sock *sk, u32 reg, u64 value);
+
+/* An agent message for dp: recorded if it concerns a traced flow.
+ */
+void ccp_trace_agent_msg(struct ccp_datapath *dp, const char *msg, int len);
+
+/* Per-namespace copies of the INSTALL_EXPR message of each installed
+ * program, so that tracing a flow can record the program it already runs.
+ */
+int ccp_trace_net_init(struct ccp_net *cn);
+void ccp_trace_net_exit(struct ccp_net *cn);
+
+/* The agent installed msg, which landed at program index.
+ */
+void ccp_trace_install(struct ccp_datapath *dp, u16 index, const char *msg, int len);
+
+#endif
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * CCP Varints
+ *
+ * The integer encoding of compact reports (ccp_compact.h): zigzag to fold
+ * signed deltas into small unsigned values, then LEB128, 7 bits per byte,
+ * least significant first, high bit set on all but the last byte.
+ * ccp_put_deltas / ccp_get_deltas carry a report's fields as differences
+ * from a base. Kept free of kernel types so the agent side and the
+ * userspace tests (tests/compact-test) decode with the exact same code.
+ */
+#ifndef CCP_VARINT_H
+#define CCP_VARINT_H
+
+#ifndef __KERNEL__
+#include <stdint.h>
+#endif
+
+#define CCP_VARINT_MAX_LEN 10 // a u64 takes at most 10 bytes
+
+static inline char *ccp_put_varint(char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t) v | 0x80;
+        v >>= 7;
+    }
+    *p++ = (uint8_t) v;
+    return p;
+}
+
+/* Decode one varint from [p, end) into *v. Returns the byte after it, or
+ * NULL if it is truncated or longer than CCP_VARINT_MAX_LEN.
+ */
+static inline const char *ccp_get_varint(const char *p, const char *end, uint64_t *v) {
+    uint64_t out = 0;
+    int shift;
+
+    for (shift = 0; shift < 7 * CCP_VARINT_MAX_LEN && p < end; shift += 7) {
+        uint8_t b = *p++;
+        out |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            *v = out;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static inline uint64_t ccp_zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t ccp_unzigzag(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+/* For each of the n fields that differs from base (all zero if base is
+ * NULL), set its bit in changed, LSB first, and append the varint of the
+ * zigzagged difference at p. changed takes (n + 7) / 8 bytes. Returns the
+ * byte after the last varint.
+ */
+static inline char *ccp_put_deltas(char *p, uint8_t *changed, const uint64_t *fields, const uint64_t *base, int n) {
+    int i;
+
+    for (i = 0; i < (n + 7) / 8; i++) {
+        changed[i] = 0;
+    }
+    for (i = 0; i < n; i++) {
+        uint64_t prev = base ? base[i] : 0;
+        if (fields[i] == prev) {
+            continue;
+        }
+        changed[i / 8] |= 1 << (i % 8);
+        p = ccp_put_varint(p, ccp_zigzag((int64_t) (fields[i] - prev)));
+    }
+    return p;
+}
+
+/* The reverse of ccp_put_deltas: rebuild the n fields from base and the
+ * varints in [p, end). Returns the byte after the last varint, or NULL if
+ * they are truncated.
+ */
+static inline const char *ccp_get_deltas(const char *p, const char *end, const uint8_t *changed,
+                                         uint64_t *fields, const uint64_t *base, int n) {
+    uint64_t z;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        fields[i] = base ? base[i] : 0;
+        if (!(changed[i / 8] & (1 << (i % 8)))) {
+            continue;
+        }
+        p = ccp_get_varint(p, end, &z);
+        if (p == NULL) {
+            return NULL;
+        }
+        fields[i] += (uint64_t) ccp_unzigzag(z);
+    }
+    return p;
+}
+
+#endif
@@ -20,11 +20,17 @@
 #include <linux/cdev.h>
 #include <linux/mutex.h>
 #include <linux/atomic.h>
+#include <linux/sched/clock.h>
+#include <linux/sched/signal.h>
 
 #include <asm/uaccess.h>
 
 #include "ccpkp.h"
 
+#ifdef CCPKP_HAVE_URING
+#include <linux/io_uring/cmd.h>
+#endif
+
 #define DEV_NAME "ccpkp"
 
 struct ccpkp_dev *ccpkp_dev;
@@ -35,6 +41,29 @@ int ccpkp_major;
 //       will need a way to differentiate between them
 int curr_ccp_id; 
 
+// With numa_bind, each opened pipe is bound to the NUMA node of the opening
+// thread: its rings live on that node, and datapath messages produced on that
+// node go to it. The agent should then open one pipe per node, from a thread
+// pinned to that node.
+static bool numa_bind = false;
+module_param(numa_bind, bool, 0444);
+MODULE_PARM_DESC(numa_bind, "Bind each ccpkp pipe to the NUMA node of the process that opens it");
+
+// Blocking readers of pipes opened from now on are woken once this many
+// reports are queued, or wake_usecs after the first one, instead of right
+// away; urgent reports always wake them.
+static unsigned int wake_batch = 1;
+module_param(wake_batch, uint, 0644);
+MODULE_PARM_DESC(wake_batch, "Wake a blocked agent read once this many messages are queued (1 = on the first)");
+
+static unsigned int wake_usecs = 0;
+module_param(wake_usecs, uint, 0644);
+MODULE_PARM_DESC(wake_usecs, "Longest a queued message waits for wake_batch others before the agent is woken anyway");
+
+static unsigned int busy_poll_us = 0;
+module_param(busy_poll_us, uint, 0644);
+MODULE_PARM_DESC(busy_poll_us, "Spin this long on an empty pipe in a blocking read before sleeping (0 = never spin)");
+
 ccp_recv_handler libccp_read_msg;
 #define RECVBUF_LEN 4096
 char recvbuf[RECVBUF_LEN];
@@ -45,11 +74,14 @@ static struct file_operations ccpkp_fops =
     .open     = ccpkp_user_open,
     .read     = ccpkp_user_read,
     .write    = ccpkp_user_write,
+#ifdef CCPKP_HAVE_URING
+    .uring_cmd = ccpkp_uring_cmd,
+#endif
     .release  = ccpkp_user_release
 };
 
 int ccpkp_init(ccp_recv_handler handler) {
-    int result, err;
+    int result, err, i;
     int devno;
     dev_t dev = 0;
 
@@ -68,6 +100,15 @@ int ccpkp_init(ccp_recv_handler handler) {
         goto fail;
     }
     memset(ccpkp_dev, 0, 1 * sizeof(struct ccpkp_dev));
+
+    ccpkp_dev->node_pipe = kmalloc_array(nr_node_ids, sizeof(int), GFP_KERNEL);
+    if (!ccpkp_dev->node_pipe) {
+        result = -ENOMEM;
+        goto fail;
+    }
+    for (i = 0; i < nr_node_ids; i++) {
+        ccpkp_dev->node_pipe[i] = -1;
+    }
     
     mutex_init(&(ccpkp_dev->mux));
     devno = MKDEV(ccpkp_major, 0);
@@ -95,6 +136,7 @@ void ccpkp_cleanup(void) {
     if (ccpkp_dev) {
         // TODO free all queue buffers
         cdev_del(&ccpkp_dev->cdev);
+        kfree(ccpkp_dev->node_pipe);
         kfree(ccpkp_dev);
     }
     unregister_chrdev_region(devno, 1);
@@ -105,27 +147,37 @@ void ccpkp_cleanup(void) {
 
 int ccpkp_user_open(struct inode *inp, struct file *fp) {
     // Create new pipe for this CCP
-    struct kpipe *pipe = kmalloc(sizeof(struct kpipe), GFP_KERNEL);
+    int node = numa_bind ? numa_node_id() : NUMA_NO_NODE;
+    struct kpipe *pipe = kmalloc_node(sizeof(struct kpipe), GFP_KERNEL, node);
     int i, ccp_id; 
 #ifndef ONE_PIPE
     bool user_read_nonblock = fp->f_flags & O_NONBLOCK;
 #endif
 
-    memset(pipe, 0, sizeof(struct kpipe));
     if (!pipe) {
         return -ENOMEM;
     }
+    memset(pipe, 0, sizeof(struct kpipe));
+    pipe->node = node;
+    spin_lock_init(&pipe->uring_lock);
+    INIT_LIST_HEAD(&pipe->uring_recvs);
 
     PDEBUG("init lfq");
-    if (init_lfq(&pipe->ccp_write_queue, false) < 0) {
+    if (init_lfq_node(&pipe->ccp_write_queue, false, node) < 0) {
         return -ENOMEM;
     }
 #ifndef ONE_PIPE
     PDEBUG("init lfq");
-    if (init_lfq(&pipe->dp_write_queue, !user_read_nonblock) < 0) {
+    if (init_lfq_node(&pipe->dp_write_queue, !user_read_nonblock, node) < 0) {
         return -ENOMEM;
     }
+    lfq_set_wake(&pipe->dp_write_queue, READ_ONCE(wake_batch), READ_ONCE(wake_usecs));
 #endif
+    // readers wait on the routine queues, which urgent writes also wake
+    if (init_lfq_node(&pipe->ccp_urgent_queue, false, node) < 0 ||
+        init_lfq_node(&pipe->dp_urgent_queue, false, node) < 0) {
+        return -ENOMEM;
+    }
     
     // Store pointer to pipe in struct file
     fp->private_data = pipe;
@@ -153,6 +205,9 @@ int ccpkp_user_open(struct inode *inp, struct file *fp) {
     }
     ccpkp_dev->pipes[ccp_id] = pipe;
     pipe->ccp_id = ccp_id;
+    if (node != NUMA_NO_NODE && ccpkp_dev->node_pipe[node] < 0) {
+        WRITE_ONCE(ccpkp_dev->node_pipe[node], ccp_id);
+    }
     ccpkp_dev->num_ccps++;
     mutex_unlock(&ccpkp_dev->mux);
     PDEBUG("init done");
@@ -165,6 +220,8 @@ void kpipe_cleanup(struct kpipe *pipe) {
     #ifndef ONE_PIPE
     free_lfq(&pipe->dp_write_queue);
     #endif
+    free_lfq(&pipe->ccp_urgent_queue);
+    free_lfq(&pipe->dp_urgent_queue);
     kfree(pipe);
 }
 
@@ -176,6 +233,17 @@ int ccpkp_user_release(struct inode *inp, struct file *fp) {
         return -ERESTARTSYS;
     }
     ccpkp_dev->pipes[pipe->ccp_id] = NULL;
+    if (pipe->node != NUMA_NO_NODE && ccpkp_dev->node_pipe[pipe->node] == ccp_id) {
+        // hand the node over to another pipe bound to it, if there is one
+        int i, next = -1;
+        for (i = 0; i < MAX_CCPS; i++) {
+            if (ccpkp_dev->pipes[i] != NULL && ccpkp_dev->pipes[i]->node == pipe->node) {
+                next = i;
+                break;
+            }
+        }
+        WRITE_ONCE(ccpkp_dev->node_pipe[pipe->node], next);
+    }
     ccpkp_dev->num_ccps--;
     mutex_unlock(&ccpkp_dev->mux);
     
@@ -186,15 +254,270 @@ int ccpkp_user_release(struct inode *inp, struct file *fp) {
     return 0;
 }
 
-ssize_t ccpkp_user_read(struct file *fp, char *buf, size_t bytes_to_read, loff_t *offset) {
-    struct kpipe *pipe = fp->private_data;
+static inline struct lfq *kpipe_user_read_queue(struct kpipe *pipe) {
 #ifdef ONE_PIPE
-    struct lfq *q = &(pipe->ccp_write_queue);
+    return &(pipe->ccp_write_queue);
 #else
-    struct lfq *q = &(pipe->dp_write_queue);
+    return &(pipe->dp_write_queue);
+#endif
+}
+
+static inline bool kpipe_user_readable(struct kpipe *pipe) {
+    return ready_for_reading(&pipe->dp_urgent_queue) || ready_for_reading(kpipe_user_read_queue(pipe));
+}
+
+/* Copy out as many whole messages as fit, urgent ones first. Never waits.
+ * Returns the number of bytes (or a negative errno if nothing was copied).
+ */
+static ssize_t kpipe_user_read_lanes(struct kpipe *pipe, char *buf, size_t bytes_to_read, int *nmsgs) {
+    ssize_t urgent, routine;
+    int n_urgent = 0, n_routine = 0;
+
+    urgent = lfq_read_batch(&pipe->dp_urgent_queue, buf, bytes_to_read, USERSPACE, false, &n_urgent);
+    if (urgent < 0) {
+        return urgent;
+    }
+
+    routine = lfq_read_batch(kpipe_user_read_queue(pipe), buf + urgent, bytes_to_read - urgent, USERSPACE, false, &n_routine);
+    if (routine < 0) {
+        routine = 0;
+        if (urgent == 0) {
+            return -EFAULT;
+        }
+    }
+
+    if (nmsgs) {
+        *nmsgs = n_urgent + n_routine;
+    }
+    return urgent + routine;
+}
+
+#ifdef CCPKP_HAVE_URING
+/*
+ * io_uring passthrough.
+ *
+ * Receives that find the queue empty are parked on the pipe; the next kernel
+ * write hands one of them to task work, which copies out everything queued
+ * and posts a single completion for the whole batch. Since the datapath
+ * writes from softirq context, the copy to userspace always happens in the
+ * submitter's task.
+ */
+struct ccpkp_uring_pdu {
+    struct list_head node;
+    u64 addr;
+    u32 len;
+};
+
+static inline struct ccpkp_uring_pdu *ccpkp_uring_pdu(struct io_uring_cmd *cmd) {
+    BUILD_BUG_ON(sizeof(struct ccpkp_uring_pdu) > sizeof(cmd->pdu));
+    return (struct ccpkp_uring_pdu *) cmd->pdu;
+}
+
+static inline struct io_uring_cmd *ccpkp_uring_pdu_cmd(struct ccpkp_uring_pdu *pdu) {
+    return (struct io_uring_cmd *) ((u8 *) pdu - offsetof(struct io_uring_cmd, pdu));
+}
+
+// Returns false if there was nothing to read, in which case cmd is untouched.
+static bool ccpkp_uring_try_recv(struct kpipe *pipe, struct io_uring_cmd *cmd, unsigned int issue_flags) {
+    struct ccpkp_uring_pdu *pdu = ccpkp_uring_pdu(cmd);
+    ssize_t bytes_read;
+    int nmsgs;
+
+    bytes_read = kpipe_user_read_lanes(
+        pipe,
+        (char __force *) u64_to_user_ptr(pdu->addr),
+        pdu->len,
+        &nmsgs
+    );
+    if (bytes_read == 0) {
+        return false;
+    }
+
+    if (bytes_read < 0) {
+        io_uring_cmd_done(cmd, bytes_read, 0, issue_flags);
+    } else {
+        io_uring_cmd_done(cmd, nmsgs, bytes_read, issue_flags);
+    }
+
+    return true;
+}
+
+static void ccpkp_uring_park(struct kpipe *pipe, struct io_uring_cmd *cmd) {
+    spin_lock_bh(&pipe->uring_lock);
+    list_add_tail(&ccpkp_uring_pdu(cmd)->node, &pipe->uring_recvs);
+    spin_unlock_bh(&pipe->uring_lock);
+}
+
+static void ccpkp_uring_recv_tw(struct io_uring_cmd *cmd, unsigned int issue_flags) {
+    struct kpipe *pipe = cmd->file->private_data;
+    if (!ccpkp_uring_try_recv(pipe, cmd, issue_flags)) {
+        // another receiver drained the queue first, wait for the next write
+        ccpkp_uring_park(pipe, cmd);
+        ccpkp_uring_kick(pipe);
+    }
+}
+
+// Called after every kernel->user write: complete one parked receive, if any.
+void ccpkp_uring_kick(struct kpipe *pipe) {
+    struct ccpkp_uring_pdu *pdu;
+
+    if (list_empty_careful(&pipe->uring_recvs) || !kpipe_user_readable(pipe)) {
+        return;
+    }
+
+    spin_lock_bh(&pipe->uring_lock);
+    pdu = list_first_entry_or_null(&pipe->uring_recvs, struct ccpkp_uring_pdu, node);
+    if (pdu) {
+        list_del_init(&pdu->node);
+    }
+    spin_unlock_bh(&pipe->uring_lock);
+
+    if (pdu) {
+        io_uring_cmd_complete_in_task(ccpkp_uring_pdu_cmd(pdu), ccpkp_uring_recv_tw);
+    }
+}
+
+static int ccpkp_uring_recv(struct kpipe *pipe, struct io_uring_cmd *cmd, const struct ccpkp_uring_cmd *ucmd, unsigned int issue_flags) {
+    struct ccpkp_uring_pdu *pdu = ccpkp_uring_pdu(cmd);
+
+    pdu->addr = READ_ONCE(ucmd->addr);
+    pdu->len  = READ_ONCE(ucmd->len);
+    INIT_LIST_HEAD(&pdu->node);
+
+    // must always be able to make progress on a non-empty queue
+    if (pdu->len < MAX_MSG_LEN) {
+        return -EINVAL;
+    }
+
+    if (ccpkp_uring_try_recv(pipe, cmd, issue_flags)) {
+        return -EIOCBQUEUED;
+    }
+
+    io_uring_cmd_mark_cancelable(cmd, issue_flags);
+    ccpkp_uring_park(pipe, cmd);
+    // a message may have arrived between the read attempt and parking
+    ccpkp_uring_kick(pipe);
+    return -EIOCBQUEUED;
+}
+
+static int ccpkp_uring_send(struct kpipe *pipe, struct io_uring_cmd *cmd, const struct ccpkp_uring_cmd *ucmd, unsigned int issue_flags) {
+    char __user *buf = u64_to_user_ptr(READ_ONCE(ucmd->addr));
+    u32 len = READ_ONCE(ucmd->len);
+    struct lfq *q = (READ_ONCE(ucmd->flags) & CCPKP_URING_F_URGENT) ? &pipe->ccp_urgent_queue : &pipe->ccp_write_queue;
+    u32 off = 0;
+    u16 msg_len;
+    int nmsgs = 0;
+    int err = 0;
+
+    // each message starts with {u16 type; u16 len; ...}
+    while (off + 2 * sizeof(u16) <= len) {
+        if (get_user(msg_len, (u16 __user *) (buf + off + sizeof(u16)))) {
+            err = -EFAULT;
+            break;
+        }
+        if (msg_len < 2 * sizeof(u16) || msg_len > MAX_MSG_LEN || msg_len > len - off) {
+            err = -EINVAL;
+            break;
+        }
+        if (lfq_write(q, (const char __force *) (buf + off), msg_len, 0, USERSPACE) <= 0) {
+            err = -ENOBUFS;
+            break;
+        }
+        off += msg_len;
+        nmsgs++;
+    }
+
+    if (nmsgs == 0 && err) {
+        return err;
+    }
+
+    io_uring_cmd_done(cmd, nmsgs, off, issue_flags);
+    return -EIOCBQUEUED;
+}
+
+static int ccpkp_uring_cancel(struct kpipe *pipe, struct io_uring_cmd *cmd, unsigned int issue_flags) {
+    struct ccpkp_uring_pdu *pdu = ccpkp_uring_pdu(cmd);
+    bool parked;
+
+    spin_lock_bh(&pipe->uring_lock);
+    parked = !list_empty(&pdu->node);
+    if (parked) {
+        list_del_init(&pdu->node);
+    }
+    spin_unlock_bh(&pipe->uring_lock);
+
+    // if it is not parked, task work is about to complete it
+    if (parked) {
+        io_uring_cmd_done(cmd, -ECANCELED, 0, issue_flags);
+    }
+    return 0;
+}
+
+int ccpkp_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags) {
+    struct kpipe *pipe = cmd->file->private_data;
+    const struct ccpkp_uring_cmd *ucmd = io_uring_sqe_cmd(cmd->sqe);
+
+    if (issue_flags & IO_URING_F_CANCEL) {
+        return ccpkp_uring_cancel(pipe, cmd, issue_flags);
+    }
+
+    if (READ_ONCE(ucmd->flags) & ~CCPKP_URING_F_URGENT) {
+        return -EINVAL;
+    }
+
+    switch (cmd->cmd_op) {
+    case CCPKP_URING_RECV:
+        return ccpkp_uring_recv(pipe, cmd, ucmd, issue_flags);
+    case CCPKP_URING_SEND:
+        return ccpkp_uring_send(pipe, cmd, ucmd, issue_flags);
+    default:
+        return -ENOTTY;
+    }
+}
 #endif
+
+/* Busy-poll mode: spend up to busy_poll_us on the CPU waiting for a
+ * message rather than going to sleep, so a report reaches the agent within
+ * microseconds instead of a wakeup later. Gives up early if the CPU is
+ * wanted for something else.
+ */
+static void kpipe_busy_poll(struct kpipe *pipe) {
+    unsigned int usecs = READ_ONCE(busy_poll_us);
+    u64 end;
+
+    if (usecs == 0) {
+        return;
+    }
+
+    end = local_clock() + (u64) usecs * NSEC_PER_USEC;
+    while (!kpipe_user_readable(pipe) && local_clock() < end) {
+        if (need_resched() || signal_pending(current)) {
+            return;
+        }
+        cpu_relax();
+    }
+}
+
+ssize_t ccpkp_user_read(struct file *fp, char *buf, size_t bytes_to_read, loff_t *offset) {
+    struct kpipe *pipe = fp->private_data;
+    struct lfq *q = kpipe_user_read_queue(pipe);
+    ssize_t bytes_read;
     PDEBUG("user wants to read %lu bytes", bytes_to_read);
-    return lfq_read(q, buf, bytes_to_read, USERSPACE);
+
+    for (;;) {
+        if (q->blocking && !kpipe_user_readable(pipe)) {
+            kpipe_busy_poll(pipe);
+            // urgent writes wake readers of the routine queue too
+            if (lfq_wait(q, &pipe->dp_urgent_queue) < 0) {
+                return -ERESTARTSYS;
+            }
+        }
+        bytes_read = kpipe_user_read_lanes(pipe, buf, bytes_to_read, NULL);
+        // with blocking reads, someone else may have taken what woke us up
+        if (bytes_read != 0 || !q->blocking || bytes_to_read < MAX_MSG_LEN) {
+            return bytes_read;
+        }
+    }
 }
 
 // module stores pointer to corresponding ccp kpipe for each socket
@@ -210,7 +533,8 @@ ssize_t ccpkp_kernel_read(struct kpipe *pipe, char *buf, size_t bytes_to_read) {
 
 ssize_t ccpkp_user_write(struct file *fp, const char *buf, size_t bytes_to_write, loff_t *offset) {
     struct kpipe *pipe = fp->private_data;
-    struct lfq *q = &(pipe->ccp_write_queue);
+    // pwrite() at CCPKP_URGENT_OFFSET uses the urgent lane
+    struct lfq *q = *offset == CCPKP_URGENT_OFFSET ? &pipe->ccp_urgent_queue : &pipe->ccp_write_queue;
     PDEBUG("user wants to write %lu bytes", bytes_to_write);
     return lfq_write(q, buf, bytes_to_write, 0, USERSPACE);
 }
@@ -223,29 +547,108 @@ ssize_t ccpkp_kernel_write(struct kpipe *pipe, const char *buf, size_t bytes_to_
     return 0;
 #endif
     struct lfq *q = &(pipe->dp_write_queue);
+    ssize_t ok;
     PDEBUG("kernel wants to write %lu bytes", bytes_to_write);
-    return lfq_write(q, buf, bytes_to_write, id, KERNELSPACE);
+    ok = lfq_write(q, buf, bytes_to_write, id, KERNELSPACE);
+#ifdef CCPKP_HAVE_URING
+    if (ok > 0) {
+        ccpkp_uring_kick(pipe);
+    }
+#endif
+    return ok;
 }
 
 
 
-void ccpkp_try_read(void) {
+// The pipe bound to the current CPU's NUMA node, or the default pipe.
+static inline struct kpipe *ccpkp_local_pipe(void) {
+    int id;
+    if (numa_bind) {
+        id = READ_ONCE(ccpkp_dev->node_pipe[numa_node_id()]);
+        if (id >= 0) {
+            return ccpkp_dev->pipes[id];
+        }
+    }
+
+    return ccpkp_dev->pipes[curr_ccp_id];
+}
+
+static void ccpkp_try_read_pipe(struct ccp_datapath *dp, struct kpipe *pipe) {
     ssize_t bytes_read;
-    bytes_read = ccpkp_kernel_read(ccpkp_dev->pipes[curr_ccp_id], recvbuf, RECVBUF_LEN);
+    if (pipe == NULL) {
+        return;
+    }
+
+    // urgent agent messages first
+    bytes_read = lfq_read(&pipe->ccp_urgent_queue, recvbuf, RECVBUF_LEN, KERNELSPACE);
+    if (bytes_read > 0) {
+        libccp_read_msg(dp, recvbuf, bytes_read);
+    }
+
+    bytes_read = ccpkp_kernel_read(pipe, recvbuf, RECVBUF_LEN);
     if (bytes_read > 0) {
         PDEBUG("kernel read %ld bytes", bytes_read);
-        libccp_read_msg(recvbuf, bytes_read);
+        libccp_read_msg(dp, recvbuf, bytes_read);
+    }
+}
+
+void ccpkp_try_read(struct ccp_datapath *dp) {
+    struct kpipe *local = ccpkp_local_pipe();
+    struct kpipe *dflt = ccpkp_dev->pipes[curr_ccp_id];
+
+    ccpkp_try_read_pipe(dp, local);
+    if (dflt != local) {
+        ccpkp_try_read_pipe(dp, dflt);
     }
 }
 
 int ccpkp_sendmsg(
-        struct ccp_connection *conn,
+        struct ccp_datapath *dp,
         char *buf,
         int bytes_to_write
 ) {
-    if (bytes_to_write < 0) {
+    // reports are written on the node of the CPU processing the ACK, so
+    // this also wakes up the agent thread reading on that node
+    struct kpipe *pipe = ccpkp_local_pipe();
+    if (bytes_to_write < 0 || pipe == NULL) {
         return -1;
     }
     PDEBUG("kernel->user trying to write %d bytes", bytes_to_write);
-    return ccpkp_kernel_write(ccpkp_dev->pipes[curr_ccp_id], buf, (size_t) bytes_to_write, (int) conn->index+1);
+    return ccpkp_kernel_write(pipe, buf, (size_t) bytes_to_write, 0);
+}
+
+/* Like ccpkp_sendmsg, on the urgent lane: the message overtakes every
+ * routine one still queued, and cannot be crowded out by them.
+ */
+int ccpkp_sendmsg_urgent(
+        struct ccp_datapath *dp,
+        char *buf,
+        int bytes_to_write
+) {
+    struct kpipe *pipe = ccpkp_local_pipe();
+    struct lfq *q;
+    ssize_t ok;
+    if (bytes_to_write < 0 || pipe == NULL) {
+        return -1;
+    }
+
+    ok = lfq_write(&pipe->dp_urgent_queue, buf, (size_t) bytes_to_write, 0, KERNELSPACE);
+    if (ok > 0) {
+        // readers sleep on the routine queue, and must not wait for a batch
+        q = kpipe_user_read_queue(pipe);
+        lfq_wake(q, true);
+#ifdef CCPKP_HAVE_URING
+        ccpkp_uring_kick(pipe);
+#endif
+    }
+    return ok;
+}
+
+// How full (in percent) the queue the next ccpkp_sendmsg would use is.
+int ccpkp_occupancy(void) {
+    struct kpipe *pipe = ccpkp_local_pipe();
+    if (pipe == NULL) {
+        return 0;
+    }
+    return (int) (lfq_len(&pipe->dp_write_queue) * 100 / BACKLOG);
 }
@@ -3,24 +3,40 @@
 
 #include <linux/slab.h>
 #include <linux/cdev.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/version.h>
 #include "lfq/lfq.h"
+#include "ccpkp_uapi.h"
 #include "../libccp/ccp.h"
 
 #ifndef MAX_CCPS
 #define MAX_CCPS 32
 #endif
 
-typedef int (*ccp_recv_handler)(char *msg, int msg_size);
+// io_uring passthrough needs <linux/io_uring/cmd.h>, cancelable commands
+// and the 4-argument io_uring_cmd_done, all of which arrived in 6.7
+#if defined(CONFIG_IO_URING) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+#define CCPKP_HAVE_URING
+#endif
+
+typedef int (*ccp_recv_handler)(struct ccp_datapath *datapath, char *msg, int msg_size);
 
 struct kpipe {
     int    ccp_id;              /* Index of this pipe in pipes */
+    int    node;                /* NUMA node this pipe is bound to, or NUMA_NO_NODE */
     struct lfq ccp_write_queue; /* Queue from user to kernel  */
     struct lfq dp_write_queue;  /* Queue from kernel to user  */
+    struct lfq ccp_urgent_queue; /* Urgent lane, user to kernel, drained first */
+    struct lfq dp_urgent_queue;  /* Urgent lane, kernel to user, read first */
+    spinlock_t uring_lock;      /* Protects uring_recvs       */
+    struct list_head uring_recvs; /* Parked CCPKP_URING_RECV commands */
 };
 
 struct ccpkp_dev {
     int    num_ccps;
     struct kpipe *pipes[MAX_CCPS];
+    int    *node_pipe;          /* Per NUMA node: index of a pipe bound to it, or -1 */
     struct cdev cdev;
     struct mutex mux;
 };
@@ -28,12 +44,19 @@ struct ccpkp_dev {
 int         ccpkp_init(ccp_recv_handler handler);
 int         ccpkp_user_open(struct inode *, struct file *);
 ssize_t     ccpkp_user_read(struct file *fp, char *buf, size_t bytes_to_read, loff_t *offset);
-void        ccpkp_try_read(void);
+void        ccpkp_try_read(struct ccp_datapath *dp);
 ssize_t     ccpkp_kernel_read(struct kpipe *pipe, char *buf, size_t bytes_to_read);
 ssize_t     ccpkp_user_write(struct file *fp, const char *buf, size_t bytes_to_write, loff_t *offset);
-int         ccpkp_sendmsg(struct ccp_connection *conn, char *buf, int bytes_to_write);
+int         ccpkp_sendmsg(struct ccp_datapath *dp, char *buf, int bytes_to_write);
+int         ccpkp_sendmsg_urgent(struct ccp_datapath *dp, char *buf, int bytes_to_write);
+int         ccpkp_occupancy(void);
 ssize_t     ccpkp_kernel_write(struct kpipe *pipe, const char *buf, size_t bytes_to_read, int id);
 int         ccpkp_user_release(struct inode *, struct file *);
+#ifdef CCPKP_HAVE_URING
+struct io_uring_cmd;
+int         ccpkp_uring_cmd(struct io_uring_cmd *cmd, unsigned int issue_flags);
+void        ccpkp_uring_kick(struct kpipe *pipe);
+#endif
 void        ccpkp_cleanup(void);
 
 
@@ -0,0 +1,58 @@
+/*
+ * Userspace-visible definitions for the ccpkp character device.
+ *
+ * Safe to include from both the kernel module and the userspace agent.
+ */
+#ifndef _CCPKP_UAPI_H_
+#define _CCPKP_UAPI_H_
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdint.h>
+typedef uint32_t __u32;
+typedef uint64_t __u64;
+#endif
+
+/* io_uring passthrough (IORING_OP_URING_CMD) operations, on kernels 6.7
+ * and later built with CONFIG_IO_URING.
+ *
+ * CCPKP_URING_RECV: fill the buffer with as many whole datapath messages as
+ *   fit; it must hold at least one maximum-size message (512 bytes). If
+ *   none are queued, the command stays in flight and completes as soon as
+ *   the datapath produces a message, so the agent can keep several receives
+ *   armed and never block in read().
+ * CCPKP_URING_SEND: the buffer holds one or more back-to-back agent
+ *   messages, each framed by its own ccp header. With CCPKP_URING_F_URGENT
+ *   in flags they go to the urgent lane (see below).
+ *
+ * On completion, cqe->res is the number of messages transferred (or a
+ * negative errno) and, on rings created with IORING_SETUP_CQE32, big_cqe[0]
+ * is the number of bytes. Since every message carries its own length, the
+ * message count alone is enough to walk a receive buffer.
+ */
+#define CCPKP_URING_RECV 1
+#define CCPKP_URING_SEND 2
+
+/* Placed in sqe->cmd */
+struct ccpkp_uring_cmd {
+    __u64 addr; /* userspace buffer */
+    __u32 len;  /* buffer length in bytes */
+    __u32 flags; /* CCPKP_URING_F_*, or zero */
+};
+
+/* Urgent lane.
+ *
+ * Each pipe has a second pair of rings for urgent traffic, so it never
+ * queues behind routine messages. In the datapath -> agent direction,
+ * reports about timeouts, losses and ECN go there; every read (and
+ * CCPKP_URING_RECV) returns all queued urgent messages first, followed by
+ * routine ones, so agents need no changes to benefit. In the agent ->
+ * datapath direction, the agent opts in per write: with
+ * CCPKP_URING_F_URGENT on CCPKP_URING_SEND, or with pwrite() at offset
+ * CCPKP_URGENT_OFFSET. The datapath drains urgent agent messages first.
+ */
+#define CCPKP_URING_F_URGENT 1
+#define CCPKP_URGENT_OFFSET 1
+
+#endif
@@ -0,0 +1,109 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "lfq.h"
+
+/*
+ * Throughput benchmark: N writers push fixed-size messages (a typical report
+ * is ~100 bytes) into one queue, one reader drains it in batches.
+ *
+ * usage: ./lfq/bench [msgs_per_writer] [msg_len]
+ */
+
+#define READ_BUF_LEN 8192
+
+struct bench {
+	struct lfq q;
+	int num_writers;
+	long msgs_per_writer;
+	size_t msg_len;
+	long full_retries;
+};
+
+static double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *writer(void *args) {
+	struct bench *b = (struct bench *)args;
+	char buf[MAX_MSG_LEN];
+	long retries = 0;
+
+	memset(buf, 0xab, sizeof(buf));
+	*(((uint16_t *)buf)+1) = b->msg_len;
+	for (long i = 0; i < b->msgs_per_writer; i++) {
+		while (lfq_write(&b->q, buf, b->msg_len, 0, KERNELSPACE) <= 0) {
+			retries++;
+			sched_yield();
+		}
+	}
+	__sync_fetch_and_add(&b->full_retries, retries);
+	return NULL;
+}
+
+void *reader(void *args) {
+	struct bench *b = (struct bench *)args;
+	char buf[READ_BUF_LEN];
+	long remaining = b->num_writers * b->msgs_per_writer;
+	int n;
+
+	while (remaining > 0) {
+		lfq_read_batch(&b->q, buf, READ_BUF_LEN, KERNELSPACE, false, &n);
+		remaining -= n;
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	long msgs = argc > 1 ? atol(argv[1]) : 1000000;
+	size_t len = argc > 2 ? (size_t) atol(argv[2]) : 104;
+	int writer_counts[] = {1, 2, 4, 8, 16};
+
+	if (len < 4 || len > MAX_MSG_LEN) {
+		fprintf(stderr, "msg_len must be in [4, %d]\n", MAX_MSG_LEN);
+		return 1;
+	}
+
+	printf("%8s %14s %12s %12s\n", "writers", "msgs/sec", "ns/msg", "full/msg");
+	for (unsigned w = 0; w < sizeof(writer_counts) / sizeof(writer_counts[0]); w++) {
+		struct bench b;
+		pthread_t r, writers[16];
+		double start, elapsed;
+		long total;
+
+		memset(&b, 0, sizeof(b));
+		init_lfq(&b.q, false);
+		b.num_writers = writer_counts[w];
+		b.msgs_per_writer = msgs / b.num_writers;
+		b.msg_len = len;
+		total = b.num_writers * b.msgs_per_writer;
+
+		start = now_sec();
+		pthread_create(&r, NULL, reader, &b);
+		for (int i = 0; i < b.num_writers; i++) {
+			pthread_create(&writers[i], NULL, writer, &b);
+		}
+		for (int i = 0; i < b.num_writers; i++) {
+			pthread_join(writers[i], NULL);
+		}
+		pthread_join(r, NULL);
+		elapsed = now_sec() - start;
+
+		printf("%8d %14.0f %12.1f %12.3f\n",
+			b.num_writers,
+			total / elapsed,
+			elapsed * 1e9 / total,
+			(double) b.full_retries / total);
+		free_lfq(&b.q);
+	}
+
+	return 0;
+}
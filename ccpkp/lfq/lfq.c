@@ -1,9 +1,10 @@
 #include "lfq.h"
 
+#if defined(__KERNEL__) && defined(__DEBUG__)
 void debug_buf(const char *buf) {
 	char out[256];
 	char *tmp = out;
-        int wrote = sprintf(tmp, "buf=%p\n", buf); 
+        int wrote = sprintf(tmp, "buf=%p\n", buf);
         tmp += wrote;
 	for(int i=0; i<64; i++) {
 		sprintf(tmp, "|%2d", i);
@@ -19,35 +20,38 @@ void debug_buf(const char *buf) {
 	sprintf(tmp, "|\n");
 	printk( KERN_DEBUG "%s", out);
 }
+#endif
 
 int init_lfq(struct lfq *q, bool blocking) {
-    q->buf       = __MALLOC__(BUF_LEN);
+    return init_lfq_node(q, blocking, -1);
+}
+
+// Allocate the queue's memory on the given NUMA node (-1 for no preference),
+// which should be the node of the CPUs that write into it.
+int init_lfq_node(struct lfq *q, bool blocking, int node) {
+    q->buf   = __MALLOC_NODE__(BUF_LEN, node);
     if (!q->buf) {
         return -1;
     }
-    q->msg_list  = __MALLOC__(BACKLOG * sizeof(char *));
-    if (!q->msg_list) {
-        ___FREE___(q->buf);
-        return -1;
-    }
-    q->free_list = __MALLOC__(BACKLOG * sizeof(char *));
-    if (!q->free_list) {
+    q->slots = __MALLOC_NODE__(BACKLOG * sizeof(struct lfq_slot), node);
+    if (!q->slots) {
         ___FREE___(q->buf);
-        ___FREE___(q->msg_list);
         return -1;
     }
 
-    for (int i=0; i<BACKLOG; i++) {
-        q->free_list[i] = &(q->buf[i * MAX_MSG_LEN]);
-        q->msg_list[i] = NULL;
+    for (lfq_idx_t i=0; i<BACKLOG; i++) {
+        q->slots[i].seq = i;
+        q->slots[i].len = 0;
     }
 
-    q->read_head  = 
-    q->write_head = 
-    q->free_head  = 0;
-    q->free_tail  = BACKLOG-1;
+    q->read_head  =
+    q->write_head = 0;
 
     q->blocking = blocking;
+    q->wake_batch = 1;
+    q->wake_usecs = 0;
+    q->wakeups = 0;
+    q->armed = LFQ_ARMED_NONE;
     if (blocking) {
 #ifdef __KERNEL__
         init_waitqueue_head(&q->nonempty);
@@ -62,8 +66,7 @@ int init_lfq(struct lfq *q, bool blocking) {
 
 void free_lfq(struct lfq *q) {
     ___FREE___(q->buf);
-    ___FREE___(q->msg_list);
-    ___FREE___(q->free_list);
+    ___FREE___(q->slots);
 }
 
 void init_pipe(struct pipe *p, bool blocking) {
@@ -77,182 +80,272 @@ void free_pipe(struct pipe *p) {
     ___FREE___(p);
 }
 
-char* _lfq_acquire_free_block(struct lfq *q) {
-    idx_t head, new_head;
-    for (;;) {
-        head = q->free_head;
-        new_head = (head+1) % BACKLOG;
-        if (new_head == q->free_tail) {
-            return NULL; // Free list is (technically, almost) empty
-        }
-        if (CAS(&(q->free_head), head, new_head)) {
-            break;
-        }
-    }
-
-    if(new_head == 0) {
-        new_head = BACKLOG;
-    }
-
-    return q->free_list[new_head-1];
+// Wake a blocked reader once batch messages are queued, or at the latest
+// usecs after the first one arrived.
+void lfq_set_wake(struct lfq *q, unsigned int batch, unsigned int usecs) {
+    q->wake_batch = batch;
+    q->wake_usecs = usecs;
 }
 
-void _lfq_return_block(struct lfq *q, char *block) {
-    idx_t tail, new_tail;
-    for (;;) {
-        tail = q->free_tail;
-        new_tail = (tail+1) % BACKLOG;
-        //ASSERT(new_tail <= q->free_head);
-        if (CAS(&(q->free_tail), tail, new_tail)) {
-            break;
-        }
-    }
-
-    if(new_tail == 0) {
-        new_tail = BACKLOG;
-    }
-
-    PDEBUG("[reader  ] returned block to %d\n", new_tail);
+static inline char *lfq_block(struct lfq *q, lfq_idx_t pos) {
+    return &(q->buf[(pos % BACKLOG) * MAX_MSG_LEN]);
+}
 
-    q->free_list[new_tail - 1] = block;
+static inline struct lfq_slot *lfq_slot(struct lfq *q, lfq_idx_t pos) {
+    return &(q->slots[pos % BACKLOG]);
 }
 
 uint16_t read_portus_msg_size(char *buf) {
     return *(((uint16_t *)buf)+1);
 }
 
-inline bool ready_for_reading(struct lfq *q) {
-    return (q->read_head != q->write_head) && (q->msg_list[q->read_head] != NULL);
+bool ready_for_reading(struct lfq *q) {
+    lfq_idx_t pos = LOAD_RELAXED(&q->read_head);
+    return LOAD_ACQUIRE(&lfq_slot(q, pos)->seq) == pos + 1;
 }
 
-ssize_t lfq_read(struct lfq *q, char *buf, size_t bytes_to_read, int reader_t) {
+// Number of claimed slots not yet drained (approximate under concurrency).
+lfq_idx_t lfq_len(struct lfq *q) {
+    lfq_idx_t r = LOAD_RELAXED(&q->read_head);
+    lfq_idx_t w = LOAD_RELAXED(&q->write_head);
+    return w > r ? w - r : 0;
+}
 
-    if (q->blocking) {
-wait_until_nonempty:
-#ifndef __KERNEL__
-        pthread_mutex_lock(&q->wait_lock);
-#endif
-        while (!ready_for_reading(q)) {
+static inline bool lfq_batching(struct lfq *q) {
+    return q->wake_batch > 1 && q->wake_usecs > 0;
+}
+
+// Reader side: announce what we wait for, then check whether we still need
+// to. Pairs with the barrier in lfq_wake, so either the reader sees the
+// message or the writer sees the reader.
+static bool lfq_arm(struct lfq *q, int want, struct lfq *also) {
+    STORE_RELAXED(&q->armed, want);
+    SMP_MB();
+    if (also && ready_for_reading(also)) {
+        return true;
+    }
+    return want == LFQ_ARMED_ANY ? ready_for_reading(q) : lfq_len(q) >= q->wake_batch;
+}
+
+/* Sleep until q has a message (or also does, if given), then, with wake
+ * thresholds set, until wake_batch are queued or wake_usecs went by.
+ * Returns 0, or -ERESTARTSYS if interrupted before anything arrived.
+ */
+int lfq_wait(struct lfq *q, struct lfq *also) {
 #ifdef __KERNEL__
-            if (wait_event_interruptible(q->nonempty, ready_for_reading(q))) {
-                return -ERESTARTSYS;
-            }
+    if (wait_event_interruptible(q->nonempty, lfq_arm(q, LFQ_ARMED_ANY, also))) {
+        return -ERESTARTSYS;
+    }
+    if (lfq_batching(q)) {
+        // with something to read already, a signal just ends the wait early
+        wait_event_interruptible_hrtimeout(q->nonempty, lfq_arm(q, LFQ_ARMED_BATCH, also),
+            ns_to_ktime((u64) q->wake_usecs * NSEC_PER_USEC));
+    }
 #else
-            pthread_cond_wait(&q->nonempty, &q->wait_lock);
-#endif
+    struct timespec deadline;
+
+    pthread_mutex_lock(&q->wait_lock);
+    while (!lfq_arm(q, LFQ_ARMED_ANY, also)) {
+        pthread_cond_wait(&q->nonempty, &q->wait_lock);
+    }
+    if (lfq_batching(q)) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long) q->wake_usecs * 1000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (!lfq_arm(q, LFQ_ARMED_BATCH, also)) {
+            if (pthread_cond_timedwait(&q->nonempty, &q->wait_lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
         }
-#ifndef __KERNEL__
-        pthread_mutex_unlock(&q->wait_lock);
+    }
+    pthread_mutex_unlock(&q->wait_lock);
 #endif
-    } else {
-        if (!ready_for_reading(q)) {
-            return 0;
-        }
+    return 0;
+}
+
+/* Writer side, after publishing: wake the reader if it is waiting for what
+ * is now queued. force wakes it whatever it waits for (urgent messages).
+ */
+void lfq_wake(struct lfq *q, bool force) {
+    int armed;
+
+    if (!q->blocking) {
+        return;
     }
 
-    int bytes_read = 0;
+    SMP_MB();
+    armed = LOAD_RELAXED(&q->armed);
+    if (armed == LFQ_ARMED_NONE ||
+        (!force && armed == LFQ_ARMED_BATCH && lfq_len(q) < q->wake_batch)) {
+        return;
+    }
+    // only one of the writers that got here issues the wakeup
+    if (!CAS(&q->armed, armed, LFQ_ARMED_NONE)) {
+        return;
+    }
+
+    STORE_RELAXED(&q->wakeups, LOAD_RELAXED(&q->wakeups) + 1);
+#ifdef __KERNEL__
+    wake_up_interruptible(&q->nonempty);
+#else
+    pthread_mutex_lock(&q->wait_lock);
+    pthread_cond_broadcast(&q->nonempty);
+    pthread_mutex_unlock(&q->wait_lock);
+#endif
+}
+
+ssize_t lfq_read(struct lfq *q, char *buf, size_t bytes_to_read, int reader_t) {
+    return lfq_read_batch(q, buf, bytes_to_read, reader_t, q->blocking, NULL);
+}
 
-    PDEBUG("[reader  ] read=%d write=%d\n", q->read_head, q->write_head);
+#define LFQ_NONE (-1) // lfq_take: nothing queued that fits
 
-    idx_t old_r, new_r;
-    int count = 1;
+// Copy the message at the read head into dst if it exists and fits in `room`
+// bytes, then claim it. Copying first means a message that cannot be copied
+// out stays queued. A copy that then loses the claim to another reader may
+// be torn by the next lap's writer, but it is discarded (and overwritten by
+// the next attempt) anyway.
+// Returns the message's length (0 for an empty one), LFQ_NONE, or -EFAULT.
+static long lfq_take(struct lfq *q, char *dst, size_t room, int reader_t) {
+    lfq_idx_t pos = LOAD_RELAXED(&q->read_head);
     for (;;) {
-        old_r = new_r = q->read_head;
-        int bytes_can_read = bytes_to_read;
-        uint16_t bytes_in_block;
-        while (bytes_can_read > 0) {
-            if (q->msg_list[new_r] == NULL) {
-                break;
-            }
-            bytes_in_block = read_portus_msg_size(q->msg_list[new_r]);
-            bytes_can_read -= bytes_in_block;
-            new_r = (new_r + 1) % BACKLOG;
-            if (new_r == q->write_head) {
-                 break;
-            }
+        struct lfq_slot *slot = lfq_slot(q, pos);
+        lfq_idx_t seq = LOAD_ACQUIRE(&slot->seq);
+        long diff = (long) (seq - (pos + 1));
+        uint32_t len;
+
+        if (diff < 0) {
+            return LFQ_NONE; // empty
+        } else if (diff > 0) {
+            // another reader got here first
+            pos = LOAD_RELAXED(&q->read_head);
+            continue;
         }
-        //PDEBUG("[reader  ] trying to move read from %d to %d\n", old_r, new_r);
-        if (CAS(&(q->read_head), old_r, new_r)) {
-            //PDEBUG("[reader  ] moved\n");
-            break;
+
+        // may race with the next lap's writer if we are stale, in which
+        // case the CAS below fails anyway
+        len = LOAD_RELAXED(&slot->len);
+        if (len > room) {
+            return LFQ_NONE;
         }
-        count++;
-    }
-    if (new_r < old_r) { // wrapped
-        new_r += BACKLOG;
-    }
-    PDEBUG("reading from %d to %d\n", old_r, new_r);
-    for (int i=old_r; i < new_r; i++) {
-        int r = i % BACKLOG;
-        char *block = q->msg_list[r];
-        uint16_t bytes_in_block = read_portus_msg_size(block);
-        PDEBUG("[reader  ] read #%d (@%ld) : %d bytes\n", r, block-q->buf, bytes_in_block);
         if (reader_t == USERSPACE) {
-            COPY_TO_USER(buf, block, bytes_in_block);
+            if (COPY_TO_USER(dst, lfq_block(q, pos), len)) {
+                return -EFAULT;
+            }
         } else { // reader_t == KERNELSPACE
-            memcpy(buf, block, bytes_in_block);
+            memcpy(dst, lfq_block(q, pos), len);
         }
-        bytes_read += bytes_in_block;
-        _lfq_return_block(q, block);
-        q->msg_list[r] = NULL;
-        buf += bytes_in_block;
+
+        if (CAS(&(q->read_head), pos, pos + 1)) {
+            PDEBUG("[reader  ] read #%lu : %u bytes\n", pos, len);
+            // hand the slot to the writer of the next lap
+            STORE_RELEASE(&slot->seq, pos + BACKLOG);
+            return len;
+        }
+        pos = LOAD_RELAXED(&q->read_head);
     }
-    
-    if (bytes_read == 0) {
-        goto wait_until_nonempty;
+}
+
+// Like lfq_read, but the caller decides whether to wait for data (e.g. the
+// io_uring path must never sleep) and optionally learns how many messages
+// were copied out. Only whole messages are returned.
+ssize_t lfq_read_batch(struct lfq *q, char *buf, size_t bytes_to_read, int reader_t, bool wait, int *nmsgs) {
+    size_t bytes_read;
+    int count;
+    long len;
+    int err;
+
+    if (nmsgs) {
+        *nmsgs = 0;
     }
 
-    return bytes_read;
-}
+    for (;;) {
+        if (wait) {
+            err = lfq_wait(q, NULL);
+            if (err < 0) {
+                return err;
+            }
+        }
 
+        PDEBUG("[reader  ] read=%lu write=%lu\n", q->read_head, q->write_head);
 
-ssize_t lfq_write(struct lfq *q, const char *buf, size_t bytes_to_write, int id, int writer_t) {
-    // Get free block
-    char *block = _lfq_acquire_free_block(q);
-    if (block == NULL) {
-        PDEBUG("[writer %d] no free blocks available\n", id);
-        return -1;
+        bytes_read = 0;
+        count = 0;
+        while ((len = lfq_take(q, buf + bytes_read, bytes_to_read - bytes_read, reader_t)) >= 0) {
+            // left by a writer whose copy from userspace failed
+            if (len == 0) {
+                continue;
+            }
+            bytes_read += len;
+            count++;
+        }
+
+        if (nmsgs) {
+            *nmsgs = count;
+        }
+
+        if (len == -EFAULT && bytes_read == 0) {
+            return -EFAULT;
+        }
+
+        // With wait, someone else may have taken what woke us up: try again.
+        if (bytes_read == 0 && wait && bytes_to_read >= MAX_MSG_LEN) {
+            continue;
+        }
+
+        return bytes_read;
     }
-    PDEBUG("[writer %d] acquired free block at %ld (head=%d, tail=%d)\n", id, block - q->buf, q->free_head, q->free_tail);
+}
 
-    // Copy data into block
-    if (writer_t == USERSPACE) {
-        COPY_FROM_USER(block, buf, bytes_to_write);
-    } else { // writer_t == KERNELSPACE
-        memcpy(block, buf, bytes_to_write);
+ssize_t lfq_write(struct lfq *q, const char *buf, size_t bytes_to_write, int id, int writer_t) {
+    struct lfq_slot *slot;
+    lfq_idx_t pos, seq;
+    long diff;
+
+    if (bytes_to_write > MAX_MSG_LEN) {
+        return -EMSGSIZE;
     }
 
-    // Get next position in queue
-    idx_t old_i, new_i;
-    int count = 1;
+    // Claim the next position
+    pos = LOAD_RELAXED(&q->write_head);
     for (;;) {
-        old_i = q->write_head;
-        new_i = (old_i + 1) % BACKLOG;
-        if (new_i == q->read_head) {
-            return 0; // TODO what do we want to do if there's no room?
-        }
-        if (CAS(&(q->write_head), old_i, new_i)) {
-            break;
+        slot = lfq_slot(q, pos);
+        seq = LOAD_ACQUIRE(&slot->seq);
+        diff = (long) (seq - pos);
+        if (diff == 0) {
+            if (CAS(&(q->write_head), pos, pos + 1)) {
+                break;
+            }
+            pos = LOAD_RELAXED(&q->write_head);
+        } else if (diff < 0) {
+            PDEBUG("[writer %d] queue full\n", id);
+            return -1; // the reader is a full lap behind
+        } else {
+            pos = LOAD_RELAXED(&q->write_head);
         }
-        count++;
     }
 
-    if (new_i == 0) {
-        new_i = BACKLOG;
+    PDEBUG("[writer %d] secured queue #%lu : %lu bytes\n", id, pos, bytes_to_write);
+
+    // Copy data into the slot's block
+    if (writer_t == USERSPACE) {
+        if (COPY_FROM_USER(lfq_block(q, pos), buf, bytes_to_write)) {
+            // the position is already ours: publish an empty message
+            bytes_to_write = 0;
+        }
+    } else { // writer_t == KERNELSPACE
+        memcpy(lfq_block(q, pos), buf, bytes_to_write);
     }
-    PDEBUG("[writer %d] secured queue #%d : %ld bytes\n", id, (new_i-1), bytes_to_write);
+    STORE_RELAXED(&slot->len, bytes_to_write);
 
-    // Assign block to acquired position
-    q->msg_list[new_i-1] = block;
+    // Publish
+    STORE_RELEASE(&slot->seq, pos + 1);
 
-    if (q->blocking) {
-#ifdef __KERNEL__
-        wake_up_interruptible(&q->nonempty);
-#else
-        pthread_mutex_lock(&q->wait_lock);
-        pthread_cond_signal(&q->nonempty);
-        pthread_mutex_unlock(&q->wait_lock);
-#endif
+    lfq_wake(q, false);
+
+    if (bytes_to_write == 0) {
+        return -EFAULT;
     }
 
     return bytes_to_write;
@@ -5,15 +5,27 @@
     #include <linux/slab.h>
     #include <linux/sched.h>
     #include <linux/wait.h>
+    #include <linux/ktime.h>
     #include <linux/uaccess.h>
+    #include <linux/cache.h>
+    #include <asm/barrier.h>
 
     #ifndef __MALLOC__
             #define __MALLOC__(size) kmalloc(size, GFP_KERNEL)
     #endif
+    #ifndef __MALLOC_NODE__
+            #define __MALLOC_NODE__(size, node) kmalloc_node(size, GFP_KERNEL, node)
+    #endif
     #ifndef ___FREE___
             #define ___FREE___(p)      kfree(p)
     #endif
     #define CAS(a,o,n)       cmpxchg(a,o,n) == o
+    #define LOAD_RELAXED(p)     READ_ONCE(*(p))
+    #define STORE_RELAXED(p, v) WRITE_ONCE(*(p), v)
+    #define LOAD_ACQUIRE(p)     smp_load_acquire(p)
+    #define STORE_RELEASE(p, v) smp_store_release(p, v)
+    #define SMP_MB()            smp_mb()
+    #define CACHELINE_ALIGNED   ____cacheline_aligned_in_smp
     #define ASSERT(cond)
     #ifndef COPY_TO_USER
             #define COPY_TO_USER(dst, src, n) copy_to_user(dst, src, n)
@@ -30,20 +42,31 @@
     #include <errno.h>
     #include <assert.h>
     #include <pthread.h>
+    #include <time.h>
+    #include <sys/types.h>
 
     #ifndef __MALLOC__
         #define __MALLOC__(size) malloc(size)
     #endif
+    #ifndef __MALLOC_NODE__
+        #define __MALLOC_NODE__(size, node) malloc(size)
+    #endif
     #ifndef ___FREE___
         #define ___FREE___(p)      free(p)
     #endif
     #define CAS(a,o,n)       __sync_bool_compare_and_swap(a,o,n)
+    #define LOAD_RELAXED(p)     __atomic_load_n(p, __ATOMIC_RELAXED)
+    #define STORE_RELAXED(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+    #define LOAD_ACQUIRE(p)     __atomic_load_n(p, __ATOMIC_ACQUIRE)
+    #define STORE_RELEASE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+    #define SMP_MB()            __atomic_thread_fence(__ATOMIC_SEQ_CST)
+    #define CACHELINE_ALIGNED   __attribute__((aligned(64)))
     #define ASSERT(cond) assert(cond)
     #ifndef COPY_TO_USER
-            #define COPY_TO_USER(dst, src, n) memcpy(dst, src, n)
+            #define COPY_TO_USER(dst, src, n) (memcpy(dst, src, n), 0)
     #endif
     #ifndef COPY_FROM_USER
-            #define COPY_FROM_USER(dst, src, n) memcpy(dst, src, n)
+            #define COPY_FROM_USER(dst, src, n) (memcpy(dst, src, n), 0)
     #endif
 #endif
 
@@ -58,7 +81,7 @@
     #endif
 #else
     /* Debugging off */
-    #define PDEBUG(fmt, args...) 
+    #define PDEBUG(fmt, args...)
 #endif
 
 #ifndef max
@@ -72,31 +95,69 @@
      _a < _b ? _a : _b; })
 #endif
 
-#define idx_t uint16_t 
+/* Positions only ever increase; slot = position % BACKLOG.
+ * They are as wide as a pointer so they cannot wrap around (and be confused
+ * with an older position) during the lifetime of a queue.
+ */
+typedef unsigned long lfq_idx_t;
 #define KERNELSPACE 0
 #define USERSPACE 1
 
-// Must be a divisor of max val of id_t
+// Must be a power of two
 #define BACKLOG 1024
 #define MAX_MSG_LEN 512
 #define BUF_LEN (BACKLOG*MAX_MSG_LEN)
 
-struct lfq {
-    char *buf;
-    char **msg_list;
-    char **free_list;
+/* Each slot's sequence number says whose turn it is:
+ *   seq == pos            -> empty, the writer claiming position pos may fill it
+ *   seq == pos + 1        -> full, the reader claiming position pos may drain it
+ *   seq == pos + BACKLOG  -> drained, free for the writer of the next lap
+ * Writers and readers claim positions with a CAS on write_head/read_head, and
+ * hand a slot over by publishing its next sequence number with release
+ * semantics, so a message is never visible before its contents are.
+ * Readers copy a message out before claiming it, so one that cannot be
+ * copied to userspace stays queued. A writer whose copy from userspace
+ * fails publishes an empty message, which readers drop.
+ */
+struct lfq_slot {
+    lfq_idx_t seq;
+    uint32_t len;
+};
 
-    idx_t read_head, write_head;
-    idx_t free_head, free_tail;
+/* Wakeup coalescing for blocking queues.
+ * A reader announces what it waits for in armed before it sleeps, and
+ * writers only wake it when that happens, so a burst of writes from many
+ * CPUs costs one wakeup rather than one each:
+ *   LFQ_ARMED_NONE   -> nobody is waiting (or a wakeup is already on its way)
+ *   LFQ_ARMED_ANY    -> the queue was empty, wake on the first message
+ *   LFQ_ARMED_BATCH  -> wake once wake_batch messages are queued; the reader
+ *                       gives up waiting for them after wake_usecs
+ * With wake_batch <= 1 or wake_usecs == 0 readers only ever wait for ANY.
+ */
+#define LFQ_ARMED_NONE  0
+#define LFQ_ARMED_ANY   1
+#define LFQ_ARMED_BATCH 2
 
+struct lfq {
+    char *buf;              /* BACKLOG blocks of MAX_MSG_LEN bytes */
+    struct lfq_slot *slots;
     bool blocking;
+    unsigned int wake_batch;
+    unsigned int wake_usecs;
+    unsigned long wakeups;  /* issued by writers, for tests and benchmarks */
 #ifdef __KERNEL__
     wait_queue_head_t nonempty;
 #else
     pthread_cond_t nonempty;
     pthread_mutex_t wait_lock;
 #endif
-};
+
+    int armed CACHELINE_ALIGNED; /* LFQ_ARMED_*, written by readers, read by every writer */
+
+    /* Writers and readers each get their own cache line */
+    lfq_idx_t write_head CACHELINE_ALIGNED;
+    lfq_idx_t read_head CACHELINE_ALIGNED;
+} CACHELINE_ALIGNED;
 
 struct pipe {
     struct lfq ccp_write_queue;
@@ -104,15 +165,21 @@ struct pipe {
 };
 
 int init_lfq(struct lfq *q, bool blocking);
+int init_lfq_node(struct lfq *q, bool blocking, int node);
 void free_lfq(struct lfq *q);
 void init_pipe(struct pipe *p, bool blocking);
 void free_pipe(struct pipe *p);
 
-char* _lfq_acquire_free_block(struct lfq *q);
-void _lfq_return_block(struct lfq *q, char *block);
 uint16_t read_portus_msg_size(char *buf);
+bool ready_for_reading(struct lfq *q);
+lfq_idx_t lfq_len(struct lfq *q);
+
+void lfq_set_wake(struct lfq *q, unsigned int batch, unsigned int usecs);
+int lfq_wait(struct lfq *q, struct lfq *also);
+void lfq_wake(struct lfq *q, bool force);
 
 ssize_t lfq_read(struct lfq *q, char *buf, size_t bytes_to_read, int reader_t);
+ssize_t lfq_read_batch(struct lfq *q, char *buf, size_t bytes_to_read, int reader_t, bool wait, int *nmsgs);
 ssize_t lfq_write(struct lfq *q, const char *buf, size_t bytes_to_write, int id, int writer_t);
 ssize_t ccp_write(struct pipe *p, const char *buf, size_t bytes_to_write, int id);
 ssize_t ccp_read(struct pipe *p, char *buf, size_t bytes_to_read);
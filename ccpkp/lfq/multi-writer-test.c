@@ -4,162 +4,212 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
-#include <time.h> 
+#include <time.h>
 
 #include "lfq.h"
 
-void set_size(char *buf, uint16_t size) {
-	*(((uint16_t *)buf)+1) = size;
+/*
+ * Stress test: many writers hammer one queue while readers drain it.
+ *
+ * Every message carries (writer, seq) and a payload derived from them, so the
+ * readers can check that nothing is lost, duplicated, corrupted, or (with a
+ * single reader) delivered out of order relative to its writer.
+ */
+
+#define NUM_WRITERS 8
+#define MSGS_PER_WRITER 50000
+#define READ_BUF_LEN 4096
+
+struct test_msg {
+	uint16_t type;
+	uint16_t len;
+	uint32_t writer;
+	uint32_t seq;
+	uint8_t payload[];
+};
+
+struct test {
+	struct pipe *p;
+	int num_readers;
+	uint32_t next_seq[NUM_WRITERS]; // single reader: per-writer order
+	uint8_t *seen;                  // multiple readers: exactly-once
+	long total_recvd;
+	bool failed;
+};
+
+struct writer_args {
+	struct test *t;
+	uint32_t id;
+};
+
+static void fail(struct test *t, const char *why, uint32_t writer, uint32_t seq) {
+	fprintf(stderr, "\nFAIL: %s (writer=%u seq=%u)\n", why, writer, seq);
+	t->failed = true;
 }
 
-void examine_buf(const char *buf, uint16_t size) {
-	int base = 0;
-	printf("|");
-	for (int i = 0; i < size; i++) {
-		printf("%c |", buf[i]);
-	}
-	printf("\n|");
-	for (int i = 0; i < size; i++) {
-		printf("%02X|", buf[i]);
-	}
-	printf("\n");
+static uint16_t msg_len(uint32_t writer, uint32_t seq) {
+	// vary sizes so batches straddle message boundaries differently
+	return sizeof(struct test_msg) + ((writer * 31 + seq * 7) % 200);
 }
 
-void print_buf(char *buf) {
-	buf += 4;
-	printf("%s\n", buf);
-}
+static void check_msg(struct test *t, const struct test_msg *m) {
+	uint16_t payload_len = m->len - sizeof(struct test_msg);
+	if (m->writer >= NUM_WRITERS || m->seq >= MSGS_PER_WRITER) {
+		fail(t, "bad header", m->writer, m->seq);
+		return;
+	}
+	if (m->len != msg_len(m->writer, m->seq)) {
+		fail(t, "bad length", m->writer, m->seq);
+		return;
+	}
+	for (int i = 0; i < payload_len; i++) {
+		if (m->payload[i] != (uint8_t) (m->writer + m->seq + i)) {
+			fail(t, "corrupt payload", m->writer, m->seq);
+			return;
+		}
+	}
 
-char *create_buf(const char *str, size_t *buf_len) {
-	size_t len = strlen(str)+1;
-	char *buf = malloc(len + 4);
-	memcpy(buf+4, str, len);
-	set_size(buf, len+4);
-	*buf_len = (len+4);
-	return buf;
+	if (t->num_readers == 1) {
+		if (m->seq != t->next_seq[m->writer]) {
+			fail(t, m->seq < t->next_seq[m->writer] ? "reordered or duplicated" : "lost", m->writer, m->seq);
+		}
+		t->next_seq[m->writer] = m->seq + 1;
+	} else {
+		uint8_t prev = __sync_fetch_and_add(&t->seen[m->writer * MSGS_PER_WRITER + m->seq], 1);
+		if (prev != 0) {
+			fail(t, "duplicated", m->writer, m->seq);
+		}
+	}
 }
 
-
 void *reader(void *args) {
-	struct pipe *p = (struct pipe *)args;
-	char recv[2048];
-	int num_recvd = 0;
-    usleep(1000);
-	while (num_recvd < 10000) {
-		int read = dp_read(p, recv, 2048);
-		if (read > 0) {
-			char *p = recv;
-			while (read > 0) {
-				int sz = read_portus_msg_size(p);
-				p+= sz;
-				read -= sz;
-				num_recvd++;
-			}
+	struct test *t = (struct test *)args;
+	char recv[READ_BUF_LEN];
+	long total = (long) NUM_WRITERS * MSGS_PER_WRITER;
+
+	while (__sync_fetch_and_add(&t->total_recvd, 0) < total && !t->failed) {
+		ssize_t read = dp_read(t->p, recv, READ_BUF_LEN);
+		if (read < 0) {
+			fail(t, "read error", 0, 0);
+			break;
+		}
+		char *cur = recv;
+		while (read > 0) {
+			const struct test_msg *m = (const struct test_msg *) cur;
+			check_msg(t, m);
+			cur += m->len;
+			read -= m->len;
+			__sync_fetch_and_add(&t->total_recvd, 1);
+		}
+		if (read != 0) {
+			fail(t, "partial message", 0, 0);
+		}
+		if (!t->p->ccp_write_queue.blocking) {
+			sched_yield();
 		}
-		usleep(rand() % 250);
 	}
 	return NULL;
 }
 
-void *writer1(void *args) {
-	struct pipe *p = (struct pipe *)args;
-	size_t buf_len;
-
-	for (int i=0; i<2500; i++) {
-		int wrote = 0;
-		while (wrote <= 0) {
-			usleep(100);
-			char a[25];
-			sprintf(a, "i'm writer 1, msg=%2d", i);
-			const char *buf = create_buf((const char *)a, &buf_len);
-			wrote = ccp_write(p, buf, buf_len, 1);
-			free((void*)buf);
+void *writer(void *args) {
+	struct writer_args *w = (struct writer_args *)args;
+	char buf[MAX_MSG_LEN];
+	struct test_msg *m = (struct test_msg *) buf;
+
+	for (uint32_t seq = 0; seq < MSGS_PER_WRITER && !w->t->failed; seq++) {
+		m->type = 1;
+		m->len = msg_len(w->id, seq);
+		m->writer = w->id;
+		m->seq = seq;
+		for (int i = 0; i < m->len - (int) sizeof(struct test_msg); i++) {
+			m->payload[i] = (uint8_t) (w->id + seq + i);
 		}
-	}
-	usleep(rand() % 10);
-    PDEBUG("[writer 1] done writing\n");
-	return NULL;
-}
-void *writer2(void *args) {
-	struct pipe *p = (struct pipe *)args;
-	size_t buf_len;
-	for (int i=0; i<5000; i++) {
-		int wrote = 0;
-		while (wrote <= 0) {
-			usleep(100);
-			char a[25];
-			sprintf(a, "i'm writer 2, msg=%2d", i);
-			const char *buf = create_buf((const char *)a, &buf_len);
-			wrote = ccp_write(p, buf, buf_len, 2);
-			free((void*)buf);
+		while (ccp_write(w->t->p, buf, m->len, w->id) <= 0) {
+			sched_yield(); // full, wait for the reader
 		}
-		usleep(rand() % 10);
 	}
-    PDEBUG("[writer 2] done writing\n");
+	PDEBUG("[writer %u] done writing\n", w->id);
 	return NULL;
 }
-void *writer3(void *args) {
-	struct pipe *p = (struct pipe *)args;
-	size_t buf_len;
-	for (int i=0; i<2500; i++) {
-		int wrote = 0;
-		while (wrote <= 0) {
-			usleep(100);
-			char a[25];
-			sprintf(a, "i'm writer 3, msg=%2d", i);
-			const char *buf = create_buf((const char *)a, &buf_len);
-			wrote = ccp_write(p, buf, buf_len, 3);
-			free((void*)buf);
+
+static int run(const char *name, bool blocking, int num_readers, unsigned int wake_batch, unsigned int wake_usecs) {
+	struct test t;
+	pthread_t readers[4], writers[NUM_WRITERS];
+	struct writer_args wargs[NUM_WRITERS];
+	long total = (long) NUM_WRITERS * MSGS_PER_WRITER;
+
+	printf("%s......", name);
+	fflush(stdout);
+
+	memset(&t, 0, sizeof(t));
+	t.p = (struct pipe *) malloc(sizeof(struct pipe));
+	init_pipe(t.p, blocking);
+	lfq_set_wake(&t.p->ccp_write_queue, wake_batch, wake_usecs);
+	t.num_readers = num_readers;
+	t.seen = calloc(total, 1);
+
+	for (int i = 0; i < num_readers; i++) {
+		pthread_create(&readers[i], NULL, reader, (void *)&t);
+	}
+	for (int i = 0; i < NUM_WRITERS; i++) {
+		wargs[i].t = &t;
+		wargs[i].id = i;
+		pthread_create(&writers[i], NULL, writer, (void *)&wargs[i]);
+	}
+	for (int i = 0; i < NUM_WRITERS; i++) {
+		pthread_join(writers[i], NULL);
+	}
+	for (int i = 0; i < num_readers; i++) {
+		pthread_join(readers[i], NULL);
+	}
+
+	if (!t.failed && t.total_recvd != total) {
+		fprintf(stderr, "\nFAIL: received %ld of %ld messages\n", t.total_recvd, total);
+		t.failed = true;
+	}
+	if (!t.failed && num_readers > 1) {
+		for (long i = 0; i < total; i++) {
+			if (t.seen[i] != 1) {
+				fail(&t, "lost", i / MSGS_PER_WRITER, i % MSGS_PER_WRITER);
+				break;
+			}
 		}
-		usleep(rand() % 10);
 	}
-    PDEBUG("[writer 3] done writing\n");
-	return NULL;
+
+	// the queue was empty at most once per message, so every wakeup
+	// beyond that is one the coalescing should have saved
+	if (!t.failed && t.p->ccp_write_queue.wakeups > total) {
+		fprintf(stderr, "\nFAIL: %lu wakeups for %ld messages\n", t.p->ccp_write_queue.wakeups, total);
+		t.failed = true;
+	}
+
+	unsigned long wakeups = t.p->ccp_write_queue.wakeups;
+	free(t.seen);
+	free_pipe(t.p);
+	if (t.failed) {
+		return 1;
+	}
+
+	if (blocking) {
+		printf("passed (%lu wakeups)\n", wakeups);
+	} else {
+		printf("passed\n");
+	}
+	return 0;
 }
 
 int main() {
-	srand(time(NULL));
-
-        printf("LFQ multiple writers test\n");
-
-        printf("blocking......");
-
-        {
-            struct pipe *p = (struct pipe *) malloc(sizeof(struct pipe));
-            init_pipe(p, true);
-            pthread_t t1, t2, t3, t4;
-            pthread_create(&t1, NULL, reader, (void *)p);
-            pthread_create(&t2, NULL, writer1, (void *)p);
-            pthread_create(&t3, NULL, writer2, (void *)p);
-            pthread_create(&t4, NULL, writer3, (void *)p);
-            pthread_join(t1, NULL);
-            pthread_join(t2, NULL);
-            pthread_join(t3, NULL);
-            pthread_join(t4, NULL);
-            free_pipe(p);
-        }
-
-        printf("passed\n");
-
-        printf("nonblocking...");
-
-        {
-            struct pipe *p = (struct pipe *) malloc(sizeof(struct pipe));
-            init_pipe(p, false);
-            pthread_t t1, t2, t3, t4;
-            pthread_create(&t1, NULL, reader, (void *)p);
-            pthread_create(&t2, NULL, writer1, (void *)p);
-            pthread_create(&t3, NULL, writer2, (void *)p);
-            pthread_create(&t4, NULL, writer3, (void *)p);
-            pthread_join(t1, NULL);
-            pthread_join(t2, NULL);
-            pthread_join(t3, NULL);
-            pthread_join(t4, NULL);
-            free_pipe(p);
-        }
-
-        printf("passed\n");
+	int failed = 0;
 
-	return 0;
+	printf("LFQ multiple writers test (%d writers x %d messages)\n", NUM_WRITERS, MSGS_PER_WRITER);
+
+	// blocking readers sleep on the queue, so only one of them may run
+	failed |= run("blocking, 1 reader", true, 1, 1, 0);
+	failed |= run("blocking, 1 reader, wake every 64 or 50us", true, 1, 64, 50);
+	failed |= run("nonblocking, 1 reader", false, 1, 1, 0);
+	failed |= run("nonblocking, 4 readers", false, 4, 1, 0);
+
+	return failed;
 }
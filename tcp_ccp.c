@@ -1,17 +1,24 @@
 #include "tcp_ccp.h"
+#include "ccp_ipc.h"
+#include "ccp_agg.h"
+#include "ccp_stats.h"
+#include "ccp_trace.h"
+#include "ccp_batch.h"
+#include "ccp_diag.h"
+#include "ccp_fault.h"
+#include "ccp_setup.h"
 #include "libccp/ccp.h"
 #include "libccp/ccp_error.h"
+#include "libccp/ccp_priv.h"
 
-#define IPC_NETLINK 0
-#define IPC_CHARDEV 1
-
-#if __IPC__ == IPC_NETLINK
 #include "ccp_nl.h"
-#elif __IPC__ == IPC_CHARDEV
 #include "ccpkp/ccpkp.h"
-#endif
 
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/inet_diag.h>
+#include <linux/jump_label.h>
+#include <linux/prefetch.h>
 #include <linux/time64.h>
 #include <linux/timekeeping.h>
 #include <net/tcp.h>
@@ -19,22 +26,74 @@
 #define CCP_FRAC_DENOM 10
 #define CCP_EWMA_RECENCY 6
 
-// Global internal state -- allocated during ccp_init and freed in ccp_free.
-struct ccp_datapath *kernel_datapath;
+// Per-netns internal state -- allocated in ccp_net_init and freed in ccp_net_exit.
+unsigned int ccp_net_id __read_mostly;
 
-void ccp_set_pacing_rate(struct sock *sk, uint32_t rate) {
-    sk->sk_pacing_rate = rate;
+static int ipc = IPC_NETLINK;
+module_param(ipc, int, 0444);
+MODULE_PARM_DESC(ipc, "Transport to the agent: 0 = netlink, 1 = character device (/dev/ccpkp)");
+
+DEFINE_STATIC_KEY_FALSE(ccp_ipc_chardev);
+
+static unsigned int max_flows = MAX_ACTIVE_FLOWS;
+module_param(max_flows, uint, 0444);
+MODULE_PARM_DESC(max_flows, "Size of the connection table in the initial network namespace");
+
+static unsigned int netns_max_flows = MAX_NETNS_ACTIVE_FLOWS;
+module_param(netns_max_flows, uint, 0444);
+MODULE_PARM_DESC(netns_max_flows, "Size of the connection table in every other network namespace");
+
+/* Besides "ccp", register the module once more per name in this list, as
+ * "ccp_<name>". Applications pick one with setsockopt(TCP_CONGESTION), and
+ * the name is the congAlg the agent sees for the flow (plain "ccp" flows
+ * are "reno").
+ */
+static char *algs = "";
+module_param(algs, charp, 0444);
+MODULE_PARM_DESC(algs, "Comma-separated algorithms to register as ccp_<name>, e.g. bbr,copa");
+
+#define CCP_ALG_PREFIX "ccp_"
+
+static struct tcp_congestion_ops *alg_ops = NULL;
+static int num_alg_ops = 0;
+
+static unsigned int max_programs = MAX_DATAPATH_PROGRAMS;
+module_param(max_programs, uint, 0444);
+MODULE_PARM_DESC(max_programs, "Number of datapath programs each namespace's agent may install");
+
+/* Lazy registration: when any of these is non-zero, a new flow runs Reno in
+ * the kernel and is only announced to the agent once it crosses one of the
+ * thresholds. Flows that finish before that never cause any IPC.
+ */
+static unsigned int lazy_bytes = 0;
+module_param(lazy_bytes, uint, 0644);
+MODULE_PARM_DESC(lazy_bytes, "Register a flow with the agent once it has sent this many bytes (0 = no threshold)");
+
+static unsigned int lazy_usecs = 0;
+module_param(lazy_usecs, uint, 0644);
+MODULE_PARM_DESC(lazy_usecs, "Register a flow with the agent once it has lived this many microseconds (0 = no threshold)");
+
+static unsigned int lazy_rtts = 0;
+module_param(lazy_rtts, uint, 0644);
+MODULE_PARM_DESC(lazy_rtts, "Register a flow with the agent once it has lived this many smoothed RTTs (0 = no threshold)");
+
+/* ACK decimation (see ccp_set_decimation) trades control latency for CPU,
+ * so the administrator bounds how much of it an agent may ask for.
+ */
+static unsigned int decimate_max_usecs = 1000;
+module_param(decimate_max_usecs, uint, 0644);
+MODULE_PARM_DESC(decimate_max_usecs, "Longest a decimated flow may go without running its program, in microseconds (0 = never decimate)");
+
+static bool lazy_prims = true;
+module_param(lazy_prims, bool, 0644);
+MODULE_PARM_DESC(lazy_prims, "Only compute the primitives a flow's program reads (others keep stale values)");
+
+static inline bool ccp_lazy_enabled(void) {
+    return READ_ONCE(lazy_bytes) || READ_ONCE(lazy_usecs) || READ_ONCE(lazy_rtts);
 }
 
-static int rate_sample_valid(const struct rate_sample *rs) {
-  int ret = 0;
-  if (rs->delivered <= 0)
-    ret |= 1;
-  if (rs->interval_us <= 0)
-    ret |= 1 << 1;
-  if (rs->rtt_us <= 0)
-    ret |= 1 << 2;
-  return ret;
+void ccp_set_pacing_rate(struct sock *sk, uint32_t rate) {
+    sk->sk_pacing_rate = rate;
 }
 
 static inline void get_sock_from_ccp(
@@ -44,7 +103,7 @@ static inline void get_sock_from_ccp(
     *sk = (struct sock*) ccp_get_impl(conn);
 }
 
-static void do_set_cwnd(
+void tcp_ccp_set_cwnd(
     struct ccp_connection *conn, 
     uint32_t cwnd
 ) {
@@ -53,22 +112,29 @@ static void do_set_cwnd(
     get_sock_from_ccp(&sk, conn);
     tp = tcp_sk(sk);
 
+    if (ccp_agg_set_cwnd(sk, cwnd)) {
+        return;
+    }
+
     // translate cwnd value back into packets
     cwnd /= tp->mss_cache;
     tp->snd_cwnd = cwnd;
 }
 
-static void do_set_rate_abs(
+void tcp_ccp_set_rate_abs(
     struct ccp_connection *conn, 
     uint32_t rate
 ) {
     struct sock *sk;
     get_sock_from_ccp(&sk, conn);
+    if (ccp_agg_set_rate(sk, rate)) {
+        return;
+    }
     ccp_set_pacing_rate(sk, rate);
 }
 
 struct timespec64 tzero;
-static u64 ccp_now(void) {
+u64 tcp_ccp_now(void) {
     struct timespec64 now, diff;
     ktime_get_real_ts64(&now);
     diff = timespec64_sub(now, tzero);
@@ -97,121 +163,419 @@ void tcp_ccp_in_ack_event(struct sock *sk, u32 flags) {
     // according to tcp_input, in_ack_event is called before cong_control, so mmt.ack has old ack value
     const struct tcp_sock *tp = tcp_sk(sk);
     struct ccp *ca = inet_csk_ca(sk);
-    struct ccp_primitives *mmt;
     u32 acked_bytes;
 
     if (ca->conn == NULL) {
-        pr_info("[ccp] ccp_connection not initialized");
+        if (!ca->lazy_pending) {
+            pr_info("[ccp] ccp_connection not initialized");
+        }
         return;
     }
 
-    mmt = &ca->conn->prims;
+    // The rest of ACK processing runs before cong_control: start pulling in
+    // the connection's primitives now so that miss overlaps with it instead
+    // of stalling load_primitives. (Not conn->state: reading the pointer
+    // would stall right here.)
+    prefetchw(&ca->conn->prims);
+
     acked_bytes = tp->snd_una - ca->last_snd_una;
     ca->last_snd_una = tp->snd_una;
-    if (acked_bytes) {
-        if (flags & CA_ACK_ECE) {
-            mmt->ecn_bytes = (u64)acked_bytes;
-            mmt->ecn_packets = (u64)acked_bytes / tp->mss_cache;
-        } else {
-            mmt->ecn_bytes = 0;
-            mmt->ecn_packets = 0;
-        }
+    // accumulated, since a decimated flow folds several ACKs at once
+    if (acked_bytes && (flags & CA_ACK_ECE)) {
+        ca->ecn_bytes += acked_bytes;
+        ca->ecn_packets += acked_bytes / tp->mss_cache;
     }
 }
 EXPORT_SYMBOL_GPL(tcp_ccp_in_ack_event);
 
+/* The primitive groups (CCP_PRIM_*) sk's program reads. The program state
+ * is about to be read by ccp_invoke anyway, so this costs no extra miss.
+ */
+static inline unsigned int ccp_prim_mask(struct sock *sk, struct ccp_connection *conn) {
+    struct ccp_datapath *dp;
+    struct ccp_net *cn;
+    struct ccp_priv_state *state;
+    u16 index;
+
+    if (!READ_ONCE(lazy_prims)) {
+        return CCP_PRIM_ALL;
+    }
+
+    dp = ccp_sk_datapath(sk);
+    cn = dp->impl;
+    state = get_ccp_priv_state(conn);
+    if (cn->prim_masks == NULL || state == NULL) {
+        return CCP_PRIM_ALL;
+    }
+
+    // 0 until the agent picks a program
+    index = state->program_index;
+    if (index == 0 || index > dp->max_programs) {
+        return CCP_PRIM_ALL;
+    }
+    return READ_ONCE(cn->prim_masks[index]);
+}
+
+static inline void ccp_fold_input_load(struct sock *sk, const struct rate_sample *rs, struct ccp_fold_input *in, unsigned int mask) {
+    const struct tcp_sock *tp = tcp_sk(sk);
+    const struct ccp *ca = inet_csk_ca(sk);
+
+    in->interval_us = rs->interval_us;
+    in->rtt_us = rs->rtt_us;
+    in->delivered = rs->delivered;
+    in->rcv_interval_us = rs->rcv_interval_us;
+    in->snd_interval_us = rs->snd_interval_us;
+    in->acked_sacked = ca->acked_sacked;
+    in->losses = ca->losses;
+    in->bytes_acked = tp->bytes_acked;
+    in->sacked_out = tp->sacked_out;
+    in->packets_in_flight = (mask & CCP_PRIM_IN_FLIGHT) ? tcp_packets_in_flight(tp) : 0;
+    in->snd_cwnd = tp->snd_cwnd;
+    in->mss_cache = tp->mss_cache;
+    in->snd_una = tp->snd_una;
+    in->write_seq = tp->write_seq;
+    in->ecn_bytes = ca->ecn_bytes;
+    in->ecn_packets = ca->ecn_packets;
+}
+
 /* load the primitive registers of the rate sample - convert all to u64
  * raw values, not averaged
  */
 int load_primitives(struct sock *sk, const struct rate_sample *rs) {
-    struct tcp_sock *tp = tcp_sk(sk);
     struct ccp *ca = inet_csk_ca(sk);
     struct ccp_primitives *mmt = &ca->conn->prims;
+    struct ccp_fold_input in;
+    struct ccp_fold_state st;
+    unsigned int mask;
+    int ok;
+
+    // traces record complete inputs, so replays can fold them either way
+    mask = unlikely(ca->traced) ? CCP_PRIM_ALL : ccp_prim_mask(sk, ca->conn);
+    ccp_fold_input_load(sk, rs, &in, mask);
+    if (unlikely(ca->traced)) {
+        ccp_trace_fold(sk, &in);
+    }
 
-    u64 rin = 0; // send bandwidth in bytes per second
-    u64 rout = 0; // recv bandwidth in bytes per second
-    u64 ack_us = 0;
-    u64 snd_us = 0;
-    int measured_valid_rate = rate_sample_valid(rs);
-    if ( measured_valid_rate != 0 ) {
+    if (ccp_fold_rate_valid(&in) != 0) {
         return -1;
     }
 
-    ack_us = rs->rcv_interval_us;
-    snd_us = rs->snd_interval_us;
+    st.last_bytes_acked = ca->last_bytes_acked;
+    st.last_sacked_out = ca->last_sacked_out;
+    // specialized folds for the common masks, the generic one otherwise
+    switch (mask) {
+    case CCP_PRIM_ALL:
+        ok = ccp_fold_primitives_mask(&in, &st, mmt, CCP_PRIM_ALL);
+        break;
+    case 0:
+        ok = ccp_fold_primitives_mask(&in, &st, mmt, 0);
+        break;
+    default:
+        ok = ccp_fold_primitives_mask(&in, &st, mmt, mask);
+        break;
+    }
+    ca->last_bytes_acked = st.last_bytes_acked;
+    ca->last_sacked_out = st.last_sacked_out;
+
+    ca->ecn_bytes = 0;
+    ca->ecn_packets = 0;
+    ca->acked_sacked = 0;
+    ca->losses = 0;
 
-    if (ack_us != 0 && snd_us != 0) {
-        rin = rout = (u64)rs->delivered * MTU * S_TO_US;
-        do_div(rin, snd_us);
-        do_div(rout, ack_us);
+    if (ok == 0 && ca->agg != NULL) {
+        mmt->snd_cwnd = ccp_agg_snd_cwnd(ca, mmt->snd_cwnd);
     }
 
-    mmt->bytes_acked = tp->bytes_acked - ca->last_bytes_acked;
-    ca->last_bytes_acked = tp->bytes_acked;
+    return ok;
+}
 
-    mmt->packets_misordered = tp->sacked_out - ca->last_sacked_out;
-    if (tp->sacked_out < ca->last_sacked_out) {
-        mmt->packets_misordered = 0;
+void ccp_flow_info(struct sock *sk, struct ccp_datapath_info *info) {
+    struct tcp_sock *tp = tcp_sk(sk);
+
+    memset(info, 0, sizeof(*info));
+    info->init_cwnd = tp->snd_cwnd * tp->mss_cache;
+    info->mss = tp->mss_cache;
+    info->src_ip = tp->inet_conn.icsk_inet.inet_saddr;
+    info->src_port = tp->inet_conn.icsk_inet.inet_sport;
+    info->dst_ip = tp->inet_conn.icsk_inet.inet_daddr;
+    info->dst_port = tp->inet_conn.icsk_inet.inet_dport;
+    strscpy(info->congAlg, ccp_sk_alg(sk), sizeof(info->congAlg));
+}
+
+const char *ccp_sk_alg(const struct sock *sk) {
+    const char *name = READ_ONCE(inet_csk(sk)->icsk_ca_ops)->name;
+
+    if (strncmp(name, CCP_ALG_PREFIX, strlen(CCP_ALG_PREFIX)) != 0) {
+        return "reno";
+    }
+    return name + strlen(CCP_ALG_PREFIX);
+}
+
+static void ccp_start_connection(struct sock *sk) {
+    struct ccp *cpl = inet_csk_ca(sk);
+    struct ccp_datapath *dp = ccp_sk_datapath(sk);
+    struct ccp_net *cn;
+    struct ccp_datapath_info dp_info;
+    char prog[CCP_DEFAULT_PROG_MAX_LEN];
+    int prog_len = 0;
+
+    if (unlikely(dp == NULL)) {
+        // creating the namespace's datapath may sleep: leave it and the start
+        // to a setup worker, and run Reno until then
+        cpl->lazy_pending = true;
+        if (!cpl->start_queued) {
+            cpl->start_queued = ccp_setup_defer_start(sk, true);
+        }
+        return;
+    }
+    cn = dp->impl;
+
+    if (ccp_agg_enabled() && ccp_agg_join(sk) == 0) {
+        return;
+    }
+
+    ccp_flow_info(sk, &dp_info);
+
+    if (unlikely(ccp_fault_conn())) {
+        cpl->conn = NULL;
+    } else {
+        ccp_ipc_table_lock(cn);
+        cpl->conn = ccp_connection_start(dp, (void *) sk, &dp_info);
+        if (cpl->conn != NULL) {
+            prog_len = ccp_ipc_flow_start(dp, cpl->conn, dp_info.congAlg, prog);
+        }
+        ccp_ipc_table_unlock(cn);
+        if (prog_len > 0) {
+            ccp_ipc_flow_default_prog(dp, cpl->conn, prog, prog_len);
+        }
+    }
+    if (cpl->conn == NULL) {
+        pr_info("[ccp] start connection failed\n");
     } else {
-        mmt->packets_misordered = tp->sacked_out - ca->last_sacked_out;
+        pr_info("[ccp] starting connection %d", cpl->conn->index);
+        ccp_stats_flow_start(dp, cpl->conn->index);
+        if (ccp_trace_wanted(sk)) {
+            ccp_trace_set(sk, true);
+        }
     }
+}
 
+static bool ccp_lazy_should_register(struct sock *sk) {
+    const struct tcp_sock *tp = tcp_sk(sk);
+    struct ccp *ca = inet_csk_ca(sk);
+    u32 age_us = (u32) tp->tcp_mstamp - ca->born_us;
+    unsigned int bytes = READ_ONCE(lazy_bytes);
+    unsigned int usecs = READ_ONCE(lazy_usecs);
+    unsigned int rtts = READ_ONCE(lazy_rtts);
+
+    return (bytes && tp->bytes_sent >= bytes) ||
+        (usecs && age_us >= usecs) ||
+        (rtts && tp->srtt_us && age_us >= (u64) rtts * (tp->srtt_us >> 3));
+}
+
+// The flow has proven long-lived enough to be worth an agent.
+static void ccp_lazy_register(struct sock *sk) {
+    const struct tcp_sock *tp = tcp_sk(sk);
+    struct ccp *ca = inet_csk_ca(sk);
+
+    ca->lazy_pending = false;
+    // start the first measurements from here
+    ca->last_snd_una = tp->snd_una;
+    ca->last_bytes_acked = tp->bytes_acked;
     ca->last_sacked_out = tp->sacked_out;
+    ccp_start_connection(sk);
+}
 
-    mmt->packets_acked = rs->acked_sacked - mmt->packets_misordered;
-    mmt->bytes_misordered = mmt->packets_misordered * tp->mss_cache;
-    mmt->lost_pkts_sample = rs->losses;
-    mmt->rtt_sample_us = rs->rtt_us;
-    if ( rin != 0 ) {
-        mmt->rate_outgoing = rin;
+void ccp_start_queued(struct sock *sk) {
+    struct ccp *ca = inet_csk_ca(sk);
+
+    // released (or reinitialized, or registered by the lazy thresholds)
+    // since it was queued
+    if (!ccp_sk_is_ccp(sk) || !ca->start_queued || !ca->lazy_pending) {
+        return;
     }
+    ca->start_queued = false;
+    ccp_lazy_register(sk);
+}
 
-    if ( rout != 0 ) {
-        mmt->rate_incoming = rout;
+void ccp_set_decimation(struct sock *sk, u32 acks, u32 usecs) {
+    struct ccp *ca = inet_csk_ca(sk);
+    unsigned int max_usecs = READ_ONCE(decimate_max_usecs);
+
+    if (max_usecs == 0) {
+        acks = usecs = 0;
     }
 
-    mmt->bytes_in_flight = tcp_packets_in_flight(tp) * tp->mss_cache;
-    mmt->packets_in_flight = tcp_packets_in_flight(tp);
-    if (tp->snd_cwnd <= 0) {
-        return -1;
+    WRITE_ONCE(ca->decimate_acks, min_t(u32, acks, U16_MAX));
+    WRITE_ONCE(ca->decimate_usecs, min_t(u32, usecs, max_usecs));
+}
+EXPORT_SYMBOL_GPL(ccp_set_decimation);
+
+/* Whether this ACK should run the program. Decimated ACKs, and ACKs
+ * deferred under backpressure, only accumulate their counters, which the
+ * next fold picks up. Neither may hold a flow's program back for longer
+ * than decimate_max_usecs.
+ */
+static bool ccp_invoke_due(struct sock *sk) {
+    const struct tcp_sock *tp = tcp_sk(sk);
+    struct ccp *ca = inet_csk_ca(sk);
+    u32 every = READ_ONCE(ca->decimate_acks);
+    u32 usecs = READ_ONCE(ca->decimate_usecs);
+    u32 max_usecs = READ_ONCE(decimate_max_usecs);
+    u32 now_us = (u32) tp->tcp_mstamp;
+    int level = ccp_ipc_bp_level(ccp_sk_datapath(sk));
+    bool decimated = (every != 0 || usecs != 0) && max_usecs != 0;
+    u32 bp_usecs = max_usecs ? max_usecs : CCP_BP_MAX_USECS;
+    bool due;
+
+    if (!decimated && level == 0) {
+        return true;
+    }
+
+    if (!decimated) {
+        every = 1;
+    }
+
+    ca->acks_pending++;
+    due = ca->losses || ca->ecn_packets ||
+        (every && ca->acks_pending >= every << level) ||
+        (decimated && now_us - ca->last_invoke_us >= (usecs ? min(usecs, max_usecs) : max_usecs)) ||
+        (level > 0 && now_us - ca->last_invoke_us >= bp_usecs);
+    if (!due) {
+        if (level > 0 && every && ca->acks_pending >= every) {
+            ca->reports_thinned++;
+        }
+        return false;
+    }
+
+    ca->acks_pending = 0;
+    ca->last_invoke_us = now_us;
+    return true;
+}
+
+void ccp_fold_and_invoke(struct sock *sk, const struct rate_sample *rs) {
+    struct ccp *ca = inet_csk_ca(sk);
+    int ok;
+
+    ccp_agg_begin(sk);
+    // load primitive registers
+    ok = load_primitives(sk, rs);
+    if (ok < 0) {
+        ccp_agg_end(sk);
+        return;
+    }
+
+    ok = ccp_invoke(ca->conn);
+    if (ok == LIBCCP_FALLBACK_TIMED_OUT) {
+      if (!ca->fallback) {
+          pr_info("[ccp] libccp fallback timed out");
+          ccp_stats_fallback();
+      }
+      // TODO default to cubic?
     }
+    ca->fallback = ok == LIBCCP_FALLBACK_TIMED_OUT;
 
-    mmt->snd_cwnd = tp->snd_cwnd * tp->mss_cache;
+    ca->conn->prims.was_timeout = false;
+    ccp_agg_end(sk);
+}
 
-    if (unlikely(tp->snd_una > tp->write_seq)) {
-        mmt->bytes_pending = ((u32) ~0U) - (tp->snd_una - tp->write_seq);
+/* ACK flags cong_control gets, as defined in net/ipv4/tcp_input.c, which
+ * does not export them.
+ */
+#define CCP_FLAG_DATA_ACKED        0x04
+#define CCP_FLAG_SYN_ACKED         0x10
+#define CCP_FLAG_DATA_SACKED       0x20
+#define CCP_FLAG_SND_UNA_ADVANCED  0x400
+#define CCP_FLAG_FORWARD_PROGRESS  (CCP_FLAG_DATA_ACKED | CCP_FLAG_SYN_ACKED | CCP_FLAG_DATA_SACKED)
+
+/* Proportional rate reduction during recovery and CWR, like the kernel's
+ * tcp_cwnd_reduction (not exported to modules).
+ */
+static void ccp_cwnd_reduction(struct sock *sk, int newly_acked_sacked, int newly_lost, int flag) {
+    struct tcp_sock *tp = tcp_sk(sk);
+    int sndcnt = 0;
+    int delta = tp->snd_ssthresh - tcp_packets_in_flight(tp);
+
+    if (newly_acked_sacked <= 0 || WARN_ON_ONCE(!tp->prior_cwnd)) {
+        return;
+    }
+
+    tp->prr_delivered += newly_acked_sacked;
+    if (delta < 0) {
+        u64 dividend = (u64) tp->snd_ssthresh * tp->prr_delivered + tp->prior_cwnd - 1;
+        sndcnt = div_u64(dividend, tp->prior_cwnd) - tp->prr_out;
     } else {
-        mmt->bytes_pending = (tp->write_seq - tp->snd_una);
+        sndcnt = max_t(int, tp->prr_delivered - tp->prr_out, newly_acked_sacked);
+        if ((flag & CCP_FLAG_SND_UNA_ADVANCED) && !newly_lost) {
+            sndcnt++;
+        }
+        sndcnt = min(delta, sndcnt);
     }
+    // force a fast retransmit upon entering fast recovery
+    sndcnt = max(sndcnt, (tp->prr_out ? 0 : 1));
+    tp->snd_cwnd = tcp_packets_in_flight(tp) + sndcnt;
+}
 
-    return 0;
+// Like the kernel's tcp_may_raise_cwnd: only grow on (in-order) progress
+static bool ccp_may_raise_cwnd(const struct sock *sk, int flag) {
+    if (tcp_sk(sk)->reordering > READ_ONCE(sock_net(sk)->ipv4.sysctl_tcp_reordering)) {
+        return flag & CCP_FLAG_FORWARD_PROGRESS;
+    }
+    return flag & CCP_FLAG_DATA_ACKED;
+}
+
+/* The kernel's default policy for flows the agent does not control (yet):
+ * what tcp_cong_control does for a congestion control without
+ * cong_control, with Reno.
+ */
+static void ccp_lazy_cong_control(struct sock *sk, u32 ack, int flag, const struct rate_sample *rs) {
+    if (tcp_in_cwnd_reduction(sk)) {
+        ccp_cwnd_reduction(sk, rs->acked_sacked, rs->losses, flag);
+    } else if (ccp_may_raise_cwnd(sk, flag)) {
+        tcp_reno_cong_avoid(sk, ack, rs->acked_sacked);
+    }
 }
 
 void tcp_ccp_cong_control(struct sock *sk, u32 ack, int flag, const struct rate_sample *rs) {
     // aggregate measurement
     // state = fold(state, rs)
-    int ok;
     struct ccp *ca = inet_csk_ca(sk);
     struct ccp_connection *conn = ca->conn;
 
-#if __IPC__ == IPC_CHARDEV
-        ccpkp_try_read();
-#endif
+    if (ccp_ipc_is_chardev()) {
+        ccpkp_try_read(ccp_sk_datapath(sk));
+    }
 
     if (conn != NULL) {
-        // load primitive registers
-        ok = load_primitives(sk, rs);
-        if (ok < 0) {
+        ca->acks++;
+        if (ca->agg != NULL) {
+            ccp_agg_apply(sk);
+        }
+        if (rs->acked_sacked > 0) {
+            ca->acked_sacked += rs->acked_sacked;
+        }
+        if (rs->losses > 0) {
+            ca->losses += rs->losses;
+        }
+        if (!ccp_invoke_due(sk)) {
             return;
         }
 
-        ok = ccp_invoke(conn);
-        if (ok == LIBCCP_FALLBACK_TIMED_OUT) {
-          pr_info("[ccp] libccp fallback timed out");
-          // TODO default to cubic?
+        // congestion signals do not wait for the batch tick
+        if (ca->losses == 0 && ca->ecn_packets == 0 &&
+            ccp_batch_enabled() && ccp_batch_enqueue(sk, rs)) {
+            return;
         }
+        // a queued entry is stale once the flow has run
+        ca->batch_cpu = -1;
 
-        ca->conn->prims.was_timeout = false;
+        ccp_fold_and_invoke(sk, rs);
+    } else if (ca->lazy_pending) {
+        if (ccp_lazy_should_register(sk)) {
+            ccp_lazy_register(sk);
+        }
+        // the agent does not control this flow (yet), run the default policy
+        ccp_lazy_cong_control(sk, ack, flag, rs);
     } else {
         pr_info("[ccp] ccp_connection not initialized");
     }
@@ -242,6 +606,68 @@ void tcp_ccp_pkts_acked(struct sock *sk, const struct ack_sample *sample) {
 }
 EXPORT_SYMBOL_GPL(tcp_ccp_pkts_acked);
 
+/* inet_diag: what the datapath knows about the flow, see ccp_diag.h.
+ * Called without the socket lock, so the connection is only looked at
+ * under the table lock.
+ */
+size_t tcp_ccp_get_info(struct sock *sk, u32 ext, int *attr, union tcp_cc_info *info) {
+    const struct ccp *ca = inet_csk_ca(sk);
+    struct tcp_ccp_info *ci = (struct tcp_ccp_info *) info;
+    struct ccp_datapath *dp = ccp_sk_datapath(sk);
+    struct ccp_net *cn;
+    struct ccp_connection *conn;
+    struct ccp_priv_state *state;
+    struct DatapathProgram *prog;
+
+    BUILD_BUG_ON(sizeof(struct tcp_ccp_info) > sizeof(union tcp_cc_info));
+
+    if (!(ext & (1 << (INET_DIAG_INFO - 1))) && !(ext & (1 << (INET_DIAG_VEGASINFO - 1)))) {
+        return 0;
+    }
+
+    memset(ci, 0, sizeof(*ci));
+    ci->reports = READ_ONCE(ca->report_seq);
+    ci->reports_thinned = min_t(u32, READ_ONCE(ca->reports_thinned), U16_MAX);
+    if (READ_ONCE(ca->lazy_pending)) {
+        ci->flags |= CCP_INFO_LAZY;
+    }
+    if (READ_ONCE(ca->agg) != NULL) {
+        ci->flags |= CCP_INFO_AGGREGATED;
+    }
+    if (READ_ONCE(ca->fallback)) {
+        ci->flags |= CCP_INFO_FALLBACK;
+    }
+    if (READ_ONCE(ca->traced)) {
+        ci->flags |= CCP_INFO_TRACED;
+    }
+
+    // the namespace's first flows come before its datapath
+    if (dp == NULL) {
+        goto out;
+    }
+    cn = dp->impl;
+    spin_lock_bh(&cn->conn_lock);
+    conn = READ_ONCE(ca->conn);
+    if (conn != NULL && conn->index != 0) {
+        ci->sid = conn->index;
+        ci->flags |= CCP_INFO_REGISTERED;
+        ci->rtt_sample_us = min_t(u64, conn->prims.rtt_sample_us, U32_MAX);
+        state = get_ccp_priv_state(conn);
+        if (state != NULL && state->program_index != 0) {
+            prog = datapath_program_lookup(dp, state->program_index);
+            if (prog != NULL) {
+                ci->program_uid = prog->program_uid;
+            }
+        }
+    }
+    spin_unlock_bh(&cn->conn_lock);
+
+out:
+    *attr = INET_DIAG_CCPINFO;
+    return sizeof(*ci);
+}
+EXPORT_SYMBOL_GPL(tcp_ccp_get_info);
+
 /*
  * Detect drops.
  *
@@ -251,12 +677,17 @@ EXPORT_SYMBOL_GPL(tcp_ccp_pkts_acked);
  */
 void tcp_ccp_set_state(struct sock *sk, u8 new_state) {
     struct ccp *cpl = inet_csk_ca(sk);
+    if (unlikely(cpl->traced)) {
+        ccp_trace_state(sk, new_state);
+    }
     switch (new_state) {
         case TCP_CA_Loss:
             if (cpl->conn != NULL) {
+                ccp_agg_begin(sk);
                 cpl->conn->prims.was_timeout = true;
+                ccp_invoke(cpl->conn);
+                ccp_agg_end(sk);
             }
-            ccp_invoke(cpl->conn);
             return;
         case TCP_CA_Recovery:
         case TCP_CA_CWR:
@@ -273,15 +704,6 @@ EXPORT_SYMBOL_GPL(tcp_ccp_set_state);
 void tcp_ccp_init(struct sock *sk) {
     struct ccp *cpl;
     struct tcp_sock *tp = tcp_sk(sk);
-    struct ccp_datapath_info dp_info = {
-        .init_cwnd = tp->snd_cwnd * tp->mss_cache,
-        .mss = tp->mss_cache,
-        .src_ip = tp->inet_conn.icsk_inet.inet_saddr,
-        .src_port = tp->inet_conn.icsk_inet.inet_sport,
-        .dst_ip = tp->inet_conn.icsk_inet.inet_daddr,
-        .dst_port = tp->inet_conn.icsk_inet.inet_dport,
-        .congAlg = "reno",
-    };
 
     pr_info("[ccp] new flow\n");
     
@@ -289,18 +711,37 @@ void tcp_ccp_init(struct sock *sk) {
     cpl->last_snd_una = tp->snd_una;
     cpl->last_bytes_acked = tp->bytes_acked;
     cpl->last_sacked_out = tp->sacked_out;
+    cpl->report_seq = 0;
+    cpl->reports_thinned = 0;
+    cpl->ecn_bytes = 0;
+    cpl->ecn_packets = 0;
+    cpl->acked_sacked = 0;
+    cpl->losses = 0;
+    cpl->acks = 0;
+    cpl->decimate_acks = 0;
+    cpl->decimate_usecs = 0;
+    cpl->acks_pending = 0;
+    cpl->last_invoke_us = (u32) tp->tcp_mstamp;
+    cpl->born_us = (u32) tp->tcp_mstamp;
+    cpl->conn = NULL;
+    cpl->traced = false;
+    cpl->fallback = false;
+    cpl->agg = NULL;
+    cpl->agg_gen = 0;
+    cpl->batch_cpu = -1;
+    cpl->batch_slot = 0;
 
-    cpl->skb_array = (struct skb_info*)kmalloc(MAX_SKB_STORED * sizeof(struct skb_info), GFP_KERNEL);
-    if (!(cpl->skb_array)) {
-        pr_info("[ccp] could not allocate skb array\n");
-    }
-    memset(cpl->skb_array, 0, MAX_SKB_STORED * sizeof(struct skb_info));
+    cpl->start_queued = false;
+    cpl->meta = NULL;
 
-    cpl->conn = ccp_connection_start(kernel_datapath, (void *) sk, &dp_info);
-    if (cpl->conn == NULL) {
-        pr_info("[ccp] start connection failed\n");
-    } else {
-        pr_info("[ccp] starting connection %d", cpl->conn->index);
+    cpl->lazy_pending = ccp_lazy_enabled();
+    if (!cpl->lazy_pending) {
+        // run Reno until the setup worker has registered the flow
+        cpl->lazy_pending = cpl->start_queued = true;
+        if (!ccp_setup_defer_start(sk, ccp_sk_datapath(sk) == NULL)) {
+            cpl->lazy_pending = cpl->start_queued = false;
+            ccp_start_connection(sk);
+        }
     }
 
     // if no ecn support
@@ -314,19 +755,32 @@ EXPORT_SYMBOL_GPL(tcp_ccp_init);
 
 void tcp_ccp_release(struct sock *sk) {
     struct ccp *cpl = inet_csk_ca(sk);
-    if (cpl->conn != NULL) {
+    ccp_trace_set(sk, false);
+    // a setup worker may still hold the socket; it skips it from now on
+    cpl->start_queued = false;
+    // a batch may still hold the socket; its tick skips it from now on
+    cpl->batch_cpu = -1;
+    if (cpl->agg != NULL) {
+        ccp_agg_leave(sk);
+    } else if (cpl->conn != NULL) {
+        struct ccp_datapath *dp = ccp_sk_datapath(sk);
+        struct ccp_net *cn = dp->impl;
+
         pr_info("[ccp] freeing connection %d", cpl->conn->index);
-        ccp_connection_free(kernel_datapath, cpl->conn->index);
-    } else {
+        ccp_ipc_table_lock(cn);
+        ccp_connection_free(dp, cpl->conn->index);
+        ccp_ipc_table_unlock(cn);
+        cpl->conn = NULL;
+    } else if (!cpl->lazy_pending) {
         pr_info("[ccp] already freed");
     }
-    if (cpl->skb_array != NULL) {
-        kfree(cpl->skb_array);
-        cpl->skb_array = NULL;
-    }
 }
 EXPORT_SYMBOL_GPL(tcp_ccp_release);
 
+bool ccp_sk_is_ccp(const struct sock *sk) {
+    return READ_ONCE(inet_csk(sk)->icsk_ca_ops)->cong_control == tcp_ccp_cong_control;
+}
+
 struct tcp_congestion_ops tcp_ccp_congestion_ops = {
     .flags = TCP_CONG_NEEDS_ECN,
     .in_ack_event = tcp_ccp_in_ack_event,
@@ -339,6 +793,7 @@ struct tcp_congestion_ops tcp_ccp_congestion_ops = {
     .cong_control = tcp_ccp_cong_control,
     .undo_cwnd = tcp_ccp_undo_cwnd,
     .set_state = tcp_ccp_set_state,
+    .get_info = tcp_ccp_get_info,
     .pkts_acked = tcp_ccp_pkts_acked
 };
 
@@ -356,79 +811,311 @@ void ccp_log(struct ccp_datapath *dp, enum ccp_log_level level, const char* msg,
     }
 }
 
-static int __init tcp_ccp_register(void) {
-    int ok;
+static void ccp_datapath_free(struct ccp_datapath *dp) {
+    if (dp == NULL) {
+        return;
+    }
 
-    ktime_get_real_ts64(&tzero);
+    kfree(dp->ccp_active_connections);
+    kfree(dp);
+}
 
-    kernel_datapath = kmalloc(sizeof(struct ccp_datapath), GFP_KERNEL);
-    if(!kernel_datapath) {
+static struct ccp_datapath *ccp_datapath_alloc(struct ccp_net *cn, u32 max_conns) {
+    struct ccp_datapath *dp = kzalloc(sizeof(struct ccp_datapath), GFP_KERNEL);
+    if (!dp) {
         pr_info("[ccp] could not allocate ccp_datapath\n");
-        return -4;
+        return NULL;
     }
 
-    kernel_datapath->max_connections = MAX_ACTIVE_FLOWS;
+    dp->max_connections = max_conns;
     // initializes ccp_active_connections to zeros to support the availability check using index == 0 in ccp_connection_start()
-    kernel_datapath->ccp_active_connections =
-        (struct ccp_connection *) kzalloc(sizeof(struct ccp_connection) * MAX_ACTIVE_FLOWS, GFP_KERNEL);
-    if(!kernel_datapath->ccp_active_connections) {
+    dp->ccp_active_connections =
+        (struct ccp_connection *) kzalloc(sizeof(struct ccp_connection) * max_conns, GFP_KERNEL);
+    if (!dp->ccp_active_connections) {
         pr_info("[ccp] could not allocate ccp_active_connections\n");
-        return -5;
-    }
-
-    kernel_datapath->max_programs = MAX_DATAPATH_PROGRAMS;
-    kernel_datapath->set_cwnd = &do_set_cwnd;
-    kernel_datapath->set_rate_abs = &do_set_rate_abs;
-    kernel_datapath->now = &ccp_now;
-    kernel_datapath->since_usecs = &ccp_since;
-    kernel_datapath->after_usecs = &ccp_after;
-    kernel_datapath->log = &ccp_log;
-    kernel_datapath->fto_us = 1000;
-#if __IPC__ == IPC_NETLINK
-    ok = ccp_nl_sk(&ccp_read_msg);
-    if (ok < 0) {
-        return -1;
+        kfree(dp);
+        return NULL;
+    }
+
+    dp->max_programs = max_programs;
+    // only libccp calls these through dp; the module calls them directly
+    dp->set_cwnd = &tcp_ccp_set_cwnd;
+    dp->set_rate_abs = &tcp_ccp_set_rate_abs;
+    dp->now = &tcp_ccp_now;
+    dp->since_usecs = &ccp_since;
+    dp->after_usecs = &ccp_after;
+    dp->log = &ccp_log;
+    dp->fto_us = 1000;
+    dp->impl = cn;
+    dp->send_msg = &ccp_ipc_send;
+
+    return dp;
+}
+
+static void ccp_net_dp_destroy(struct ccp_net *cn) {
+    ccp_ipc_net_exit(cn);
+    if (!ccp_ipc_is_chardev()) {
+        free_ccp_nl_sk(cn);
+    }
+    ccp_free(cn->dp);
+    ccp_stats_net_exit(cn);
+    ccp_datapath_free(cn->dp);
+    cn->dp = NULL;
+}
+
+// Serializes ccp_net_dp_create, which setup workers on any CPU may run
+static DEFINE_MUTEX(ccp_dp_create_lock);
+
+int ccp_net_dp_create(struct net *net) {
+    struct ccp_net *cn = ccp_net(net);
+    bool is_init_net = net_eq(net, &init_net);
+    int ok = 0;
+
+    // a single character device serves every namespace
+    if (ccp_ipc_is_chardev() && !is_init_net) {
+        return 0;
+    }
+    if (smp_load_acquire(&cn->dp_ready)) {
+        return 0;
+    }
+
+    mutex_lock(&ccp_dp_create_lock);
+    if (cn->dp != NULL) {
+        goto out;
     }
 
-    kernel_datapath->send_msg = &nl_sendmsg;
-    pr_info("[ccp] ipc = netlink\n");
-#elif __IPC__ == IPC_CHARDEV
-    ok = ccpkp_init(&ccp_read_msg);
+    cn->dp = ccp_datapath_alloc(cn, is_init_net ? max_flows : netns_max_flows);
+    if (!cn->dp) {
+        ok = -ENOMEM;
+        goto out;
+    }
+    ccp_ipc_net_init(cn);
+
+    ok = ccp_stats_net_init(cn);
     if (ok < 0) {
-        return -2;
+        ccp_ipc_net_exit(cn);
+        ccp_datapath_free(cn->dp);
+        cn->dp = NULL;
+        goto out;
+    }
+
+    if (!ccp_ipc_is_chardev()) {
+        ok = ccp_nl_sk(cn, &ccp_ipc_recv);
+        if (ok < 0) {
+            ccp_stats_net_exit(cn);
+            ccp_ipc_net_exit(cn);
+            ccp_datapath_free(cn->dp);
+            cn->dp = NULL;
+            goto out;
+        }
     }
 
-    kernel_datapath->send_msg = &ccpkp_sendmsg;
-    pr_info("[ccp] ipc = chardev\n");
-#else
-    pr_info("[ccp] ipc =  %s unknown\n", __IPC__);
-    return -3;
-#endif
-	
-    ok = ccp_init(kernel_datapath, 0);
+    // the datapath id tells the agent which namespace it is talking to
+    ok = ccp_init(cn->dp, net->ns.inum);
     if (ok < 0) {
         pr_info("[ccp] ccp_init failed: %d\n", ok);
-#if __IPC__ == IPC_NETLINK
-        free_ccp_nl_sk();
-#elif __IPC__ == IPC_CHARDEV
-        ccpkp_cleanup();
-#endif
-        return -6;
+        if (!ccp_ipc_is_chardev()) {
+            free_ccp_nl_sk(cn);
+        }
+        ccp_stats_net_exit(cn);
+        ccp_ipc_net_exit(cn);
+        ccp_datapath_free(cn->dp);
+        cn->dp = NULL;
+        ok = -EINVAL;
+        goto out;
+    }
+
+    smp_store_release(&cn->dp_ready, true);
+    if (!is_init_net) {
+        pr_info("[ccp] datapath for namespace %u\n", net->ns.inum);
+    }
+out:
+    mutex_unlock(&ccp_dp_create_lock);
+    return ok;
+}
+
+static int __net_init ccp_net_init(struct net *net) {
+    struct ccp_net *cn = ccp_net(net);
+
+    cn->net = net;
+    cn->dp = NULL;
+    cn->dp_ready = false;
+    spin_lock_init(&cn->conn_lock);
+    ccp_agg_net_init(cn);
+
+    // the others wait for their first CCP flow
+    if (net_eq(net, &init_net)) {
+        return ccp_net_dp_create(net);
+    }
+    return 0;
+}
+
+static void __net_exit ccp_net_exit(struct net *net) {
+    struct ccp_net *cn = ccp_net(net);
+
+    // no flow of net is left, so no setup worker can be creating it either
+    if (cn->dp == NULL) {
+        return;
+    }
+
+    WRITE_ONCE(cn->dp_ready, false);
+    ccp_net_dp_destroy(cn);
+}
+
+static struct pernet_operations ccp_net_ops = {
+    .init = ccp_net_init,
+    .exit = ccp_net_exit,
+    .id   = &ccp_net_id,
+    .size = sizeof(struct ccp_net),
+};
+
+static void ccp_algs_unregister(void) {
+    int i;
+
+    for (i = 0; i < num_alg_ops; i++) {
+        tcp_unregister_congestion_control(&alg_ops[i]);
+    }
+    // unregistering waits for readers of the ops, so they can go now
+    kfree(alg_ops);
+    alg_ops = NULL;
+    num_alg_ops = 0;
+}
+
+/* Register a copy of tcp_ccp_congestion_ops per name in algs. The copies
+ * share every callback, so only their names tell flows apart.
+ */
+static int ccp_algs_register(void) {
+    char *list, *cur, *name;
+    int max = 1, ok = 0;
+
+    for (cur = algs; *cur; cur++) {
+        max += *cur == ',';
+    }
+
+    list = kstrdup(algs, GFP_KERNEL);
+    alg_ops = kcalloc(max, sizeof(struct tcp_congestion_ops), GFP_KERNEL);
+    if (!list || !alg_ops) {
+        kfree(list);
+        kfree(alg_ops);
+        alg_ops = NULL;
+        return -ENOMEM;
+    }
+
+    cur = list;
+    while ((name = strsep(&cur, ",")) != NULL) {
+        struct tcp_congestion_ops *ops = &alg_ops[num_alg_ops];
+
+        if (*name == '\0') {
+            continue;
+        }
+        if (strlen(CCP_ALG_PREFIX) + strlen(name) >= TCP_CA_NAME_MAX ||
+            strlen(name) >= MAX_CONG_ALG_SIZE) {
+            pr_info("[ccp] algorithm name %s too long\n", name);
+            ok = -EINVAL;
+            break;
+        }
+
+        *ops = tcp_ccp_congestion_ops;
+        snprintf(ops->name, TCP_CA_NAME_MAX, CCP_ALG_PREFIX "%s", name);
+        ok = tcp_register_congestion_control(ops);
+        if (ok < 0) {
+            pr_info("[ccp] could not register %s: %d\n", ops->name, ok);
+            break;
+        }
+        pr_info("[ccp] registered %s\n", ops->name);
+        num_alg_ops++;
+    }
+
+    kfree(list);
+    if (ok < 0) {
+        ccp_algs_unregister();
+    }
+    return ok;
+}
+
+static int __init tcp_ccp_register(void) {
+    int ok;
+
+    BUILD_BUG_ON(sizeof(struct ccp) > ICSK_CA_PRIV_SIZE);
+
+    ktime_get_real_ts64(&tzero);
+
+    switch (ipc) {
+    case IPC_NETLINK:
+        pr_info("[ccp] ipc = netlink\n");
+        break;
+    case IPC_CHARDEV:
+        ok = ccpkp_init(&ccp_ipc_recv);
+        if (ok < 0) {
+            return -2;
+        }
+        static_branch_enable(&ccp_ipc_chardev);
+        pr_info("[ccp] ipc = chardev\n");
+        break;
+    default:
+        pr_info("[ccp] ipc = %d unknown\n", ipc);
+        return -3;
+    }
+    ccp_ipc_set_transport(ipc);
+
+    ccp_stats_init();
+    ccp_fault_init();
+    ccp_trace_init();
+    ccp_ipc_init();
+    ccp_batch_init();
+    ccp_setup_init();
+
+    ok = register_pernet_subsys(&ccp_net_ops);
+    if (ok < 0) {
+        pr_info("[ccp] could not set up network namespaces: %d\n", ok);
+        ccp_setup_exit();
+        ccp_batch_exit();
+        ccp_ipc_exit();
+        ccp_trace_exit();
+        ccp_stats_exit();
+        if (ccp_ipc_is_chardev()) {
+            ccpkp_cleanup();
+        }
+        return ok;
+    }
+
+    ok = tcp_register_congestion_control(&tcp_ccp_congestion_ops);
+    if (ok == 0) {
+        ok = ccp_algs_register();
+        if (ok < 0) {
+            tcp_unregister_congestion_control(&tcp_ccp_congestion_ops);
+        }
+    }
+    if (ok < 0) {
+        unregister_pernet_subsys(&ccp_net_ops);
+        ccp_setup_exit();
+        ccp_batch_exit();
+        ccp_ipc_exit();
+        ccp_trace_exit();
+        ccp_stats_exit();
+        if (ccp_ipc_is_chardev()) {
+            ccpkp_cleanup();
+        }
+        return ok;
     }
 
     pr_info("[ccp] init\n");
-    return tcp_register_congestion_control(&tcp_ccp_congestion_ops);
+    return 0;
 }
 
 static void __exit tcp_ccp_unregister(void) {
+    ccp_algs_unregister();
     tcp_unregister_congestion_control(&tcp_ccp_congestion_ops);
-#if __IPC__ == IPC_NETLINK
-    free_ccp_nl_sk();
-#elif __IPC__ == IPC_CHARDEV
-    ccpkp_cleanup();
-#endif
-    kfree(kernel_datapath->ccp_active_connections);
-    kfree(kernel_datapath);
+    // the setup workers start connections in the namespaces' datapaths
+    ccp_setup_exit();
+    unregister_pernet_subsys(&ccp_net_ops);
+    ccp_batch_exit();
+    ccp_ipc_exit();
+    ccp_trace_exit();
+    ccp_stats_exit();
+    if (ccp_ipc_is_chardev()) {
+        ccpkp_cleanup();
+    }
     pr_info("[ccp] exit\n");
 }
 
@@ -3,32 +3,223 @@
 
 #include <linux/net.h>
 #include <linux/tcp.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/hashtable.h>
+#include <linux/jump_label.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
 #include "libccp/ccp.h"
-
-#define MAX_SKB_STORED 50
+#include "ccp_fold.h"
 
 #define MAX_ACTIVE_FLOWS 1024
+#define MAX_NETNS_ACTIVE_FLOWS 256
 #define MAX_DATAPATH_PROGRAMS 10
 
-struct skb_info {
-    u64 first_tx_mstamp; // choose the correct skb so the timestamp for first packet
-    u32 interval_us; // interval us as calculated from this SKB
+#define IPC_NETLINK 0
+#define IPC_CHARDEV 1
+
+/* Enabled when the module was loaded with ipc=1 (character device), so the
+ * transport checks on the ACK path are patched-in jumps rather than loads.
+ */
+DECLARE_STATIC_KEY_FALSE(ccp_ipc_chardev);
+
+static inline bool ccp_ipc_is_chardev(void) {
+    return static_branch_unlikely(&ccp_ipc_chardev);
+}
+
+/* Per-flow state that does not fit in struct ccp, used for aggregation.
+ * Only aggregated flows have one, allocated when they join, on the NUMA
+ * node their ACKs are processed on (ccp_sk_node).
+ */
+struct ccp_meta {
+    struct sock *sk;
+    struct hlist_node agg_node; // in the aggregate's member list
 };
 
-struct ccp {
-    // control
-    u32 last_snd_una; // 4 B
-    u32 last_bytes_acked; // 8 B
-    u32 last_sacked_out; // 12 B
-    struct skb_info *skb_array; // array of future skb information
+struct ccp_agg;
+struct ccp_flow_stats;
+struct ccp_report_base;
 
-    // communication
+/* Per-flow state in the socket's congestion control area (inet_csk_ca).
+ * Everything the ACK path touches comes first so that it shares the socket's
+ * cache lines; the connection in libccp's table is only reached through
+ * conn, which in_ack_event prefetches well before cong_control needs it.
+ */
+struct ccp {
+    // hot: read and written on every ACK
     struct ccp_connection *conn;
+    u32 last_snd_una;
+    u32 last_bytes_acked;
+    u32 last_sacked_out;
+    u32 ecn_bytes; // staged by in_ack_event, folded in by load_primitives
+    u32 ecn_packets;
+    u32 acked_sacked; // accumulated from rate samples since the last fold
+    u32 losses;
+    u32 acks; // ACKs processed while registered with the agent
+    struct ccp_agg *agg; // aggregate this flow is a member of, if any
+    u32 agg_gen; // generation of the aggregate's cwnd/rate last applied
+
+    // ACK decimation, set by the agent (0, 0 = run the program on every ACK)
+    u16 decimate_acks;
+    u16 acks_pending;
+    u32 decimate_usecs;
+    u32 last_invoke_us; // low 32 bits of tcp_mstamp
+
+    // warm: once per report
+    u32 report_seq; // reports produced by this flow's program
+    u32 reports_thinned; // program runs deferred under backpressure
+
+    // lazy registration
+    u32 born_us; // low 32 bits of tcp_mstamp at init
+    bool lazy_pending; // not registered with the agent yet
+    bool traced; // inputs are being recorded, see ccp_trace.h
+    bool fallback; // libccp's fallback timer expired on the last invoke
+    bool start_queued; // waiting for the setup worker, see ccp_setup.h
+
+    // batch mode, see ccp_batch.h
+    s16 batch_cpu; // CPU whose batch the flow is queued in, or -1
+    u16 batch_slot; // position in that batch
+
+    // cold
+    struct ccp_meta *meta; // only while in an aggregate
+};
+
+/* IPC backpressure.
+ * When the agent falls behind, flows run their programs on one in 2^level
+ * of the ACKs they otherwise would, so reports come less often while the
+ * counters behind them keep accumulating in the folds. Congestion events
+ * (timeouts, losses, ECN) still run them right away, and a thinned flow
+ * still runs its program once decimate_max_usecs (CCP_BP_MAX_USECS if that
+ * is 0) passed since the last run, however few ACKs it gets. The agent
+ * learns the level from CCP_EXT_BACKPRESSURE.
+ */
+#define CCP_BP_MAX_LEVEL 4
+#define CCP_BP_MAX_USECS 1000
+
+struct ccp_backpressure {
+    atomic_t level;
+    atomic_t sends; // in the current window
+    atomic_t failures; // in the current window
+    unsigned long window_end; // jiffies
+};
+
+/* A program the datapath installs on new flows of one algorithm as soon as
+ * they are created, see CCP_EXT_SET_DEFAULT_PROG.
+ */
+#define CCP_MAX_DEFAULT_PROGS 8
+#define CCP_DEFAULT_PROG_MAX_LEN 128 // copied to the stack when a flow starts
+
+struct ccp_default_prog {
+    char congAlg[MAX_CONG_ALG_SIZE]; // "" if the entry is free
+    u16 len;
+    char msg[CCP_DEFAULT_PROG_MAX_LEN]; // CHANGE_PROG message to apply
+};
+
+/* Per network namespace datapath state.
+ * Each namespace gets its own connection table, libccp datapath and (for
+ * netlink) its own kernel socket, so every tenant can run its own agent.
+ * init_net's are set up with the namespace; other namespaces only get
+ * theirs with their first CCP flow, from a setup worker (ccp_net_dp_create),
+ * so a host with many namespaces only pays for the ones that use CCP.
+ */
+struct ccp_net {
+    struct net *net;
+    struct ccp_datapath *dp;
+    bool dp_ready; // dp is fully set up, published with a release
+    struct sock *nl_sk;
+    struct ccp_backpressure bp;
+    spinlock_t conn_lock; // serializes connection start/free with table walks, see ccp_ipc_table_lock
+    struct work_struct resync_work;
+    struct work_struct bulk_work;
+    char *bulk_req; // pending bulk program switch, owned by bulk_work once set
+    DECLARE_HASHTABLE(aggs, 8); // flow aggregates by key, under conn_lock
+    struct ccp_default_prog default_progs[CCP_MAX_DEFAULT_PROGS]; // under conn_lock
+    struct ccp_flow_stats *flow_stats; // by connection index - 1
+    struct ccp_report_base *report_bases; // by connection index - 1, see ccp_compact.h
+    u32 report_format;
+    u32 report_epoch; // bumped when the format changes
+    u8 *prim_masks; // CCP_PRIM_* each installed program reads, by program index
+    char **prog_msgs; // INSTALL_EXPR of each installed program, by index, under conn_lock
+    u32 *flow_hist; // per-connection latency histograms, if enabled
+    struct dentry *flow_debugfs;
 };
 
-#define MTU 1500
-#define S_TO_US 1000000
+extern unsigned int ccp_net_id;
+
+static inline struct ccp_net *ccp_net(const struct net *net) {
+    return net_generic(net, ccp_net_id);
+}
+
+/* The datapath serving sk's namespace, or NULL if it has none yet.
+ * With the character device there is a single device for the whole host, so
+ * only init_net has a datapath and every namespace shares it.
+ */
+static inline struct ccp_datapath *ccp_sk_datapath(const struct sock *sk) {
+    struct ccp_net *cn = ccp_net(sock_net(sk));
+    if (unlikely(!smp_load_acquire(&cn->dp_ready))) {
+        if (!ccp_ipc_is_chardev()) {
+            return NULL;
+        }
+        cn = ccp_net(&init_net);
+    }
+    return cn->dp;
+}
+
+/* NUMA node of the CPU this socket's ACKs are processed on.
+ * Sockets that have not received anything yet fall back to the current
+ * CPU's node, which for a passive open is where its SYN was handled.
+ */
+static inline int ccp_sk_node(const struct sock *sk) {
+    int cpu = READ_ONCE(sk->sk_incoming_cpu);
+    if (cpu < 0 || cpu >= nr_cpu_ids) {
+        return numa_node_id();
+    }
+    return cpu_to_node(cpu);
+}
+
+/* Set up net's datapath (and netlink socket) if it has none yet. May
+ * sleep. Returns 0 once it is ready.
+ */
+int ccp_net_dp_create(struct net *net);
 
 void ccp_set_pacing_rate(struct sock *sk, uint32_t rate);
 
+/* The datapath's set_cwnd, set_rate_abs and now callbacks, for calling
+ * directly rather than through struct ccp_datapath.
+ */
+void tcp_ccp_set_cwnd(struct ccp_connection *conn, uint32_t cwnd);
+void tcp_ccp_set_rate_abs(struct ccp_connection *conn, uint32_t rate);
+u64 tcp_ccp_now(void);
+
+/* Run sk's datapath program at most once every acks ACKs or usecs
+ * microseconds (whichever comes first) instead of on every ACK. Losses,
+ * ECN and timeouts still run it right away. Both zero restores per-ACK
+ * invocation.
+ */
+void ccp_set_decimation(struct sock *sk, u32 acks, u32 usecs);
+
+/* Fold sk's measurements since the previous fold and run its program.
+ * Called with sk locked, on an ACK or from a batch tick.
+ */
+void ccp_fold_and_invoke(struct sock *sk, const struct rate_sample *rs);
+
+/* Register sk with the agent if it is still waiting for its setup
+ * worker. Called with sk locked.
+ */
+void ccp_start_queued(struct sock *sk);
+
+/* Whether sk's congestion control is (still) this module's.
+ */
+bool ccp_sk_is_ccp(const struct sock *sk);
+
+/* The flow description sent to the agent when sk's connection is created.
+ */
+void ccp_flow_info(struct sock *sk, struct ccp_datapath_info *info);
+
+/* The algorithm sk asked for: the congestion control name it was set to,
+ * without the "ccp_" prefix, or "reno" for plain "ccp" (see algs).
+ */
+const char *ccp_sk_alg(const struct sock *sk);
+
 #endif
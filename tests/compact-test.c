@@ -0,0 +1,277 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "../ccp_varint.h"
+
+/*
+ * Round trip of the compact report encoding (ccp_compact.h).
+ *
+ * Varints: every value survives zigzag + varint and back, takes the
+ * expected number of bytes, and truncated or overlong input is rejected.
+ *
+ * Deltas: a flow's reports are encoded against the last report the agent
+ * acknowledged, with the datapath's bookkeeping from ccp_compact.c (the
+ * reports in flight, taking an ack only while its report is remembered
+ * and newer than the base, a key frame after a failed send or a program
+ * change). Sends fail and acks get lost at random, and the agent must
+ * decode every report it receives to exactly the fields that were sent.
+ */
+
+#define NUM_RANDOM 1000000
+
+#define NUM_REPORTS 1000000
+#define MAX_FIELDS 16 // CCP_COMPACT_MAX_FIELDS
+#define INFLIGHT 4 // CCP_COMPACT_INFLIGHT
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_rand(void) {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static int expected_len(uint64_t v) {
+	int len = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		len++;
+	}
+	return len;
+}
+
+static int check(int64_t v) {
+	char buf[CCP_VARINT_MAX_LEN];
+	uint64_t z = ccp_zigzag(v), out = 0;
+	char *end = ccp_put_varint(buf, z);
+	const char *next;
+
+	if (end - buf != expected_len(z) || end - buf > CCP_VARINT_MAX_LEN) {
+		printf("%lld: encoded to %d bytes\n", (long long) v, (int) (end - buf));
+		return 1;
+	}
+	next = ccp_get_varint(buf, end, &out);
+	if (next != end || ccp_unzigzag(out) != v) {
+		printf("%lld: decoded to %lld\n", (long long) v, (long long) ccp_unzigzag(out));
+		return 1;
+	}
+	if (ccp_get_varint(buf, end - 1, &out) != NULL) {
+		printf("%lld: truncated varint accepted\n", (long long) v);
+		return 1;
+	}
+	return 0;
+}
+
+struct snap {
+	uint64_t fields[MAX_FIELDS];
+	uint32_t program_uid;
+	uint8_t seq;
+	bool valid;
+};
+
+// the datapath's side, as in struct ccp_report_base
+static struct snap acked, sent[INFLIGHT];
+static uint8_t next_seq;
+static bool key_next;
+static int pending_ack = -1; // ccp_report_base.ack
+
+// the agent's side: the reports it acknowledged, by seq, and when
+static struct snap agent[256];
+static int agent_report[256];
+
+// ccp_compact_take_ack
+static void take_ack(uint8_t seq) {
+	struct snap *s = &sent[seq % INFLIGHT];
+
+	if (!s->valid || s->seq != seq) {
+		return;
+	}
+	if (acked.valid && (int8_t) (seq - acked.seq) <= 0) {
+		return;
+	}
+	acked = *s;
+}
+
+// ccp_compact_encode, for one report; returns the end of the body in buf
+static char *encode(char *buf, uint8_t *changed, const uint64_t *fields, int n, uint32_t uid,
+					bool *key, uint8_t *seq, uint8_t *base_seq) {
+	struct snap *s;
+	char *p = buf;
+	int i;
+
+	if (pending_ack >= 0) {
+		take_ack(pending_ack);
+		pending_ack = -1;
+	}
+	if (key_next) {
+		key_next = false;
+		acked.valid = false;
+		for (i = 0; i < INFLIGHT; i++) {
+			sent[i].valid = false;
+		}
+	}
+	if (acked.valid && acked.program_uid != uid) {
+		acked.valid = false;
+	}
+	*key = !acked.valid;
+	*seq = next_seq;
+	*base_seq = *key ? 0 : acked.seq;
+
+	if (*key) {
+		p = ccp_put_varint(p, uid);
+	}
+	s = &sent[next_seq % INFLIGHT];
+	memset(s->fields, 0, sizeof(s->fields));
+	memcpy(s->fields, fields, n * sizeof(uint64_t));
+	p = ccp_put_deltas(p, changed, s->fields, *key ? NULL : acked.fields, n);
+	s->program_uid = uid;
+	s->seq = next_seq++;
+	s->valid = true;
+	return p;
+}
+
+static int check_deltas(void) {
+	uint64_t fields[MAX_FIELDS] = {0}, out[MAX_FIELDS];
+	char buf[CCP_VARINT_MAX_LEN * (MAX_FIELDS + 1)];
+	uint8_t changed[(MAX_FIELDS + 7) / 8];
+	uint32_t uid = 1;
+	int n = 8, i, j, fails = 0, keys = 0, deltas = 0;
+
+	for (i = 0; i < NUM_REPORTS; i++) {
+		uint8_t seq, base_seq;
+		const char *next;
+		const uint64_t *base;
+		uint64_t got_uid = 0;
+		char *end;
+		bool key;
+
+		// now and then a new program, with its own number of fields
+		if (next_rand() % 5000 == 0) {
+			uid++;
+			n = 1 + next_rand() % MAX_FIELDS;
+		}
+		// mostly small moves either way, some unchanged, a few jumps
+		for (j = 0; j < n; j++) {
+			uint64_t r = next_rand();
+			if (r % 4 == 0) {
+				continue;
+			}
+			if (r % 97 == 0) {
+				fields[j] = next_rand();
+			} else {
+				fields[j] += (r >> 8) % 2001 - 1000;
+			}
+		}
+
+		end = encode(buf, changed, fields, n, uid, &key, &seq, &base_seq);
+
+		// a failed send: the next report is a key frame
+		if (next_rand() % 20 == 0) {
+			key_next = true;
+			continue;
+		}
+
+		// the agent's side
+		next = buf;
+		base = NULL;
+		if (key) {
+			next = ccp_get_varint(next, end, &got_uid);
+			if (next == NULL || got_uid != uid) {
+				printf("report %d: key frame has program %llu, not %u\n", i, (unsigned long long) got_uid, uid);
+				fails++;
+				continue;
+			}
+			keys++;
+		} else {
+			if (!agent[base_seq].valid || agent[base_seq].seq != base_seq) {
+				printf("report %d: relative to %u, which the agent never acknowledged\n", i, base_seq);
+				fails++;
+				continue;
+			}
+			base = agent[base_seq].fields;
+			deltas++;
+		}
+		next = ccp_get_deltas(next, end, changed, out, base, n);
+		if (next != end || memcmp(out, fields, n * sizeof(uint64_t)) != 0) {
+			printf("report %d (%s frame, seq %u, base %u): fields differ\n", i, key ? "key" : "delta", seq, base_seq);
+			fails++;
+			continue;
+		}
+
+		// acknowledge most reports; some acks are lost, some arrive
+		// late, after the reports that followed, and the datapath only
+		// takes the latest one with its next report
+		if (next_rand() % 3 != 0) {
+			agent[seq].valid = true;
+			agent[seq].seq = seq;
+			agent_report[seq] = i;
+			memset(agent[seq].fields, 0, sizeof(agent[seq].fields));
+			memcpy(agent[seq].fields, out, n * sizeof(uint64_t));
+			if (next_rand() % 5 != 0) {
+				pending_ack = seq;
+			}
+		}
+		if (next_rand() % 10 == 0) {
+			uint8_t old = seq - next_rand() % (2 * INFLIGHT);
+			// late, but not so late that seq has wrapped since
+			if (agent[old].valid && i - agent_report[old] < 2 * INFLIGHT) {
+				pending_ack = old;
+			}
+		}
+	}
+
+	if (deltas < NUM_REPORTS / 2) {
+		printf("only %d of %d reports were delta frames\n", deltas, keys + deltas);
+		fails++;
+	}
+	return fails;
+}
+
+int main(void) {
+	static const int64_t edges[] = {
+		0, 1, -1, 63, -64, 64, -65, 127, 128, 8191, -8192, 8192,
+		INT32_MAX, INT32_MIN, (int64_t) UINT32_MAX, INT64_MAX, INT64_MIN,
+	};
+	char overlong[CCP_VARINT_MAX_LEN + 1];
+	uint64_t out;
+	int i, fails = 0;
+
+	// small deltas must stay small whatever their sign
+	if (ccp_zigzag(0) != 0 || ccp_zigzag(-1) != 1 || ccp_zigzag(1) != 2 || ccp_zigzag(-2) != 3) {
+		printf("zigzag does not interleave signs\n");
+		fails++;
+	}
+
+	for (i = 0; i < (int) (sizeof(edges) / sizeof(edges[0])); i++) {
+		fails += check(edges[i]);
+	}
+	for (i = 0; i < NUM_RANDOM; i++) {
+		uint64_t r = next_rand();
+		// spread over all lengths, not just the 10-byte ones
+		r >>= r % 64;
+		fails += check((int64_t) r);
+		fails += check((int64_t) (0 - r));
+	}
+
+	for (i = 0; i < (int) sizeof(overlong); i++) {
+		overlong[i] = (char) 0x80;
+	}
+	overlong[CCP_VARINT_MAX_LEN] = 0;
+	if (ccp_get_varint(overlong, overlong + sizeof(overlong), &out) != NULL) {
+		printf("overlong varint accepted\n");
+		fails++;
+	}
+
+	fails += check_deltas();
+
+	if (fails) {
+		printf("FAIL: %d\n", fails);
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
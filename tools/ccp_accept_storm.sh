@@ -0,0 +1,52 @@
+#!/bin/bash
+#
+# Accept-storm benchmark: the highest connection rate the host sustains
+# when both ends of every connection (so every passive open) run a
+# congestion control, with CCP and with cubic as the baseline. Connections
+# carry no data, so flow setup and teardown dominate.
+#
+# Needs the module loaded with the ccp algorithm allowed (ccp_kernel_load)
+# and an agent running. Uses ./ccp_churn (make ccp_churn).
+#
+# usage: ./ccp_accept_storm.sh [seconds per run] [client threads]
+
+secs=${1:-10}
+threads=${2:-16}
+here=$(dirname "$0")
+churn=$here/ccp_churn
+params=/sys/module/ccp_cong/parameters
+
+if [ ! -x $churn ]; then
+    echo "error: $churn not found (make ccp_churn)"
+    exit 1
+fi
+
+if ! grep -qw ccp /proc/sys/net/ipv4/tcp_allowed_congestion_control; then
+    echo "error: ccp is not an allowed congestion control (module not loaded?)"
+    exit 1
+fi
+
+# rate <cong>: sustained conns/s, and how many connections failed
+rate() {
+    $churn -c $1 -s $1 -d $secs -t $threads -b 0 -p 5998 |
+        awk '{ sub("/s", "", $4); printf "%s %d", $4, $6 + $8 + $10 }'
+}
+
+# report <name> <rate and failures, from rate>
+report() {
+    printf "%-22s %12s conns/s   failed %s\n" "$1" "${2% *}" "${2#* }"
+}
+
+echo "$secs s per run, $threads client threads"
+base=$(rate cubic)
+report cubic "$base"
+ccp=$(rate ccp)
+report ccp "$ccp"
+
+if [ -w $params/async_start ]; then
+    echo 0 > $params/async_start
+    report "ccp, start in init" "$(rate ccp)"
+    echo 1 > $params/async_start
+fi
+
+awk -v b="${base% *}" -v c="${ccp% *}" 'BEGIN { if (b + 0 > 0) printf "ccp sustains %.0f%% of cubic'"'"'s rate\n", 100 * c / b }'
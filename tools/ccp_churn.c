@@ -0,0 +1,206 @@
+/*
+ * Connection churn generator: opens, uses and closes loopback TCP
+ * connections running the ccp congestion control as fast as asked, to
+ * exercise connection setup and teardown in the datapath (and in the
+ * agent). Prints the achieved rate and how many connections failed.
+ *
+ * Connections are closed with a reset so that TIME_WAIT does not exhaust
+ * the ephemeral ports at high rates.
+ *
+ * With -s, the listener (and so every accepted connection) runs that
+ * congestion control too, which exercises passive opens: their init runs
+ * in softirq context as the handshake completes.
+ *
+ * usage: ./ccp_churn [-r conns/s] [-d seconds] [-t threads] [-b bytes] [-p port] [-c cong] [-s cong]
+ */
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+struct churn {
+    long rate; // per second, over all threads (0 = as fast as possible)
+    int seconds;
+    int threads;
+    size_t bytes;
+    int port;
+    const char *cong;
+    const char *server_cong; // NULL = the system default
+    int listen_fd;
+    volatile bool done;
+    long conns;
+    long failed_connect;
+    long failed_cong;
+    long failed_io;
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *server(void *args) {
+    struct churn *c = (struct churn *) args;
+    char buf[65536];
+
+    while (!c->done) {
+        int fd = accept(c->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        while (read(fd, buf, sizeof(buf)) > 0) {
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+static bool churn_one(struct churn *c, struct sockaddr_in *addr, char *buf) {
+    struct linger lin = { .l_onoff = 1, .l_linger = 0 };
+    size_t sent = 0;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        __sync_fetch_and_add(&c->failed_connect, 1);
+        return false;
+    }
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, c->cong, strlen(c->cong)) < 0) {
+        __sync_fetch_and_add(&c->failed_cong, 1);
+        close(fd);
+        return false;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+
+    if (connect(fd, (struct sockaddr *) addr, sizeof(*addr)) < 0) {
+        __sync_fetch_and_add(&c->failed_connect, 1);
+        close(fd);
+        return false;
+    }
+
+    while (sent < c->bytes) {
+        size_t n = c->bytes - sent < 65536 ? c->bytes - sent : 65536;
+        ssize_t w = write(fd, buf, n);
+        if (w <= 0) {
+            __sync_fetch_and_add(&c->failed_io, 1);
+            close(fd);
+            return false;
+        }
+        sent += w;
+    }
+
+    close(fd);
+    __sync_fetch_and_add(&c->conns, 1);
+    return true;
+}
+
+static void *client(void *args) {
+    struct churn *c = (struct churn *) args;
+    struct sockaddr_in addr;
+    double start = now_sec(), per_thread = c->rate > 0 ? (double) c->rate / c->threads : 0;
+    long mine = 0;
+    char *buf = calloc(1, 65536);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(c->port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    while (!c->done) {
+        // pace: stay at or below this thread's share of the rate
+        if (per_thread > 0) {
+            double due = start + mine / per_thread;
+            double now = now_sec();
+            if (due > now) {
+                usleep((useconds_t) ((due - now) * 1e6));
+            }
+        }
+        churn_one(c, &addr, buf);
+        mine++;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    struct churn c = { .rate = 0, .seconds = 10, .threads = 8, .bytes = 0, .port = 5999, .cong = "ccp", .server_cong = NULL };
+    struct sockaddr_in addr;
+    pthread_t srv[4], *clients;
+    double start, elapsed;
+    int one = 1, opt;
+
+    while ((opt = getopt(argc, argv, "r:d:t:b:p:c:s:")) != -1) {
+        switch (opt) {
+        case 'r': c.rate = atol(optarg); break;
+        case 'd': c.seconds = atoi(optarg); break;
+        case 't': c.threads = atoi(optarg); break;
+        case 'b': c.bytes = (size_t) atol(optarg); break;
+        case 'p': c.port = atoi(optarg); break;
+        case 'c': c.cong = optarg; break;
+        case 's': c.server_cong = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-r conns/s] [-d seconds] [-t threads] [-b bytes] [-p port] [-c cong] [-s cong]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (c.threads < 1) {
+        c.threads = 1;
+    }
+
+    c.listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(c.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (c.server_cong != NULL &&
+        setsockopt(c.listen_fd, IPPROTO_TCP, TCP_CONGESTION, c.server_cong, strlen(c.server_cong)) < 0) {
+        perror("listener congestion control");
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(c.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(c.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(c.listen_fd, 4096) < 0) {
+        perror("listen");
+        return 1;
+    }
+
+    clients = calloc(c.threads, sizeof(pthread_t));
+    for (int i = 0; i < 4; i++) {
+        pthread_create(&srv[i], NULL, server, &c);
+    }
+
+    start = now_sec();
+    for (int i = 0; i < c.threads; i++) {
+        pthread_create(&clients[i], NULL, client, &c);
+    }
+    sleep(c.seconds);
+    c.done = true;
+    for (int i = 0; i < c.threads; i++) {
+        pthread_join(clients[i], NULL);
+    }
+    elapsed = now_sec() - start;
+
+    // wake the servers up so they notice
+    shutdown(c.listen_fd, SHUT_RDWR);
+    for (int i = 0; i < 4; i++) {
+        pthread_join(srv[i], NULL);
+    }
+    close(c.listen_fd);
+
+    printf("conns %ld rate %.0f/s failed_connect %ld failed_cong %ld failed_io %ld\n",
+        c.conns, c.conns / elapsed, c.failed_connect, c.failed_cong, c.failed_io);
+    free(clients);
+    return 0;
+}
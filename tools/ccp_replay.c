@@ -0,0 +1,306 @@
+/*
+ * Replay a datapath trace (debugfs ccp/trace, see ccp_trace.h) through a
+ * userspace build of the datapath's fold code and libccp.
+ *
+ * Time comes from the trace, and agent messages are replayed in the order
+ * the datapath received them, so a replay makes the same decisions every
+ * time. Prints every cwnd/rate decision (unless -q) and the CPU cost of
+ * folding and running the programs.
+ *
+ * usage: ./ccp_replay [-q] [-n netns] trace
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libccp/ccp.h"
+#include "libccp/serialize.h"
+#include "ccp_fold.h"
+#include "ccp_trace.h"
+
+#define MAX_FLOWS 4096
+#define MAX_AGENT_MSG 65536
+#define TCP_CA_LOSS 4
+// the datapath's own messages (see ccp_ipc.h): recorded, but what they do
+// to a program is recorded as libccp messages too
+#define CCP_EXT_MSG_BASE 0x100
+
+struct flow {
+    uint32_t sid; // in the trace
+    struct ccp_connection *conn;
+    struct ccp_fold_state st;
+    uint64_t folds;
+    uint64_t fold_ns;
+};
+
+static struct flow flows[MAX_FLOWS];
+static int num_flows = 0;
+static uint64_t now_ns = 0;
+static bool quiet = false;
+static uint64_t reports = 0, actions = 0, ext_msgs = 0;
+
+static struct flow *flow_lookup(uint32_t sid) {
+    for (int i = 0; i < num_flows; i++) {
+        if (flows[i].sid == sid && flows[i].conn != NULL) {
+            return &flows[i];
+        }
+    }
+    return NULL;
+}
+
+static void replay_set_cwnd(struct ccp_connection *conn, uint32_t cwnd) {
+    struct flow *f = ccp_get_impl(conn);
+    actions++;
+    if (!quiet) {
+        printf("%lu %u cwnd %u\n", (unsigned long) now_ns, f->sid, cwnd);
+    }
+}
+
+static void replay_set_rate_abs(struct ccp_connection *conn, uint32_t rate) {
+    struct flow *f = ccp_get_impl(conn);
+    actions++;
+    if (!quiet) {
+        printf("%lu %u rate %u\n", (unsigned long) now_ns, f->sid, rate);
+    }
+}
+
+static int replay_send_msg(struct ccp_datapath *dp, char *msg, int msg_size) {
+    reports++;
+    return 0;
+}
+
+static void replay_log(struct ccp_datapath *dp, enum ccp_log_level level, const char *msg, int msg_size) {
+    if (!quiet) {
+        fprintf(stderr, "libccp: %s\n", msg);
+    }
+}
+
+static uint64_t replay_now(void) {
+    return now_ns;
+}
+
+static uint64_t replay_since(uint64_t then) {
+    return (now_ns - then) / 1000;
+}
+
+static uint64_t replay_after(uint64_t us) {
+    return now_ns + us * 1000;
+}
+
+static uint64_t clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void replay_start(struct ccp_datapath *dp, struct ccp_trace_hdr *hdr, struct ccp_trace_start *start) {
+    struct ccp_datapath_info info;
+    struct flow *f;
+
+    if (num_flows == MAX_FLOWS) {
+        fprintf(stderr, "too many flows, ignoring sid %u\n", hdr->sid);
+        return;
+    }
+
+    f = &flows[num_flows++];
+    memset(f, 0, sizeof(*f));
+    f->sid = hdr->sid;
+    f->st.last_bytes_acked = start->last_bytes_acked;
+    f->st.last_sacked_out = start->last_sacked_out;
+
+    memset(&info, 0, sizeof(info));
+    info.init_cwnd = start->init_cwnd;
+    info.mss = start->mss;
+    info.src_ip = start->src_ip;
+    info.src_port = start->src_port;
+    info.dst_ip = start->dst_ip;
+    info.dst_port = start->dst_port;
+    memcpy(info.congAlg, start->congAlg, MAX_CONG_ALG_SIZE);
+
+    f->conn = ccp_connection_start(dp, f, &info);
+    if (f->conn == NULL) {
+        fprintf(stderr, "could not start connection for sid %u\n", hdr->sid);
+    }
+}
+
+static void replay_fold(struct flow *f, struct ccp_fold_input *in) {
+    uint64_t start;
+
+    if (ccp_fold_rate_valid(in) != 0) {
+        return;
+    }
+
+    start = clock_ns();
+    ccp_fold_primitives(in, &f->st, &f->conn->prims);
+    ccp_invoke(f->conn);
+    f->conn->prims.was_timeout = false;
+    f->fold_ns += clock_ns() - start;
+    f->folds++;
+}
+
+static void replay_state(struct flow *f, struct ccp_trace_state *st) {
+    if (st->new_state == TCP_CA_LOSS) {
+        f->conn->prims.was_timeout = true;
+        ccp_invoke(f->conn);
+    } else {
+        f->conn->prims.was_timeout = false;
+    }
+}
+
+// Reassemble agent message fragments, then hand the message to libccp
+static void replay_agent(struct ccp_datapath *dp, struct ccp_trace_hdr *hdr, struct ccp_trace_agent *frag, char *data) {
+    static char msg[MAX_AGENT_MSG];
+    uint16_t n = hdr->len - sizeof(struct ccp_trace_hdr) - sizeof(struct ccp_trace_agent);
+    struct CcpMsgHeader *msg_hdr = (struct CcpMsgHeader *) msg;
+    struct flow *f;
+
+    if (frag->offset + n > sizeof(msg)) {
+        return;
+    }
+    memcpy(msg + frag->offset, data, n);
+    if (frag->offset + n < frag->msg_len) {
+        return;
+    }
+
+    if (msg_hdr->Type >= CCP_EXT_MSG_BASE) {
+        ext_msgs++;
+        return;
+    }
+
+    if (hdr->sid != 0) {
+        f = flow_lookup(hdr->sid);
+        if (f == NULL) {
+            return;
+        }
+        // the replay's connection indices differ from the datapath's
+        msg_hdr->SocketId = f->conn->index;
+    }
+
+    if (ccp_read_msg(dp, msg, frag->msg_len) < 0 && !quiet) {
+        fprintf(stderr, "agent message type %u for sid %u rejected\n", msg_hdr->Type, hdr->sid);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct ccp_datapath dp;
+    char rec[CCP_TRACE_MAX_RECORD];
+    struct ccp_trace_hdr *hdr = (struct ccp_trace_hdr *) rec;
+    char *body = rec + sizeof(struct ccp_trace_hdr);
+    uint64_t records = 0, skipped = 0, folds = 0, fold_ns = 0;
+    int64_t netns = -1;
+    struct flow *f;
+    FILE *trace;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qn:")) != -1) {
+        switch (opt) {
+        case 'q':
+            quiet = true;
+            break;
+        case 'n':
+            netns = atoll(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-q] [-n netns] trace\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-q] [-n netns] trace\n", argv[0]);
+        return 1;
+    }
+
+    trace = fopen(argv[optind], "rb");
+    if (trace == NULL) {
+        perror("fopen");
+        return 1;
+    }
+
+    memset(&dp, 0, sizeof(dp));
+    dp.max_connections = MAX_FLOWS;
+    dp.ccp_active_connections = calloc(MAX_FLOWS, sizeof(struct ccp_connection));
+    dp.max_programs = 256;
+    dp.set_cwnd = &replay_set_cwnd;
+    dp.set_rate_abs = &replay_set_rate_abs;
+    dp.send_msg = &replay_send_msg;
+    dp.now = &replay_now;
+    dp.since_usecs = &replay_since;
+    dp.after_usecs = &replay_after;
+    dp.log = &replay_log;
+    dp.fto_us = 1000;
+    if (ccp_init(&dp, 0) < 0) {
+        fprintf(stderr, "ccp_init failed\n");
+        return 1;
+    }
+
+    while (fread(hdr, sizeof(struct ccp_trace_hdr), 1, trace) == 1) {
+        if (hdr->len < sizeof(struct ccp_trace_hdr) || hdr->len > CCP_TRACE_MAX_RECORD ||
+            fread(body, hdr->len - sizeof(struct ccp_trace_hdr), 1, trace) != 1) {
+            if (hdr->len > sizeof(struct ccp_trace_hdr)) {
+                fprintf(stderr, "truncated or corrupt trace after %lu records\n", (unsigned long) records);
+            }
+            break;
+        }
+        records++;
+
+        // one datapath at a time: the first one seen, unless asked otherwise
+        if (netns < 0) {
+            netns = hdr->netns;
+        }
+        if (hdr->netns != netns) {
+            skipped++;
+            continue;
+        }
+
+        now_ns = hdr->now_ns;
+        switch (hdr->type) {
+        case CCP_TRACE_START:
+            replay_start(&dp, hdr, (struct ccp_trace_start *) body);
+            break;
+        case CCP_TRACE_FOLD:
+            if ((f = flow_lookup(hdr->sid)) != NULL) {
+                replay_fold(f, (struct ccp_fold_input *) body);
+            }
+            break;
+        case CCP_TRACE_STATE:
+            if ((f = flow_lookup(hdr->sid)) != NULL) {
+                replay_state(f, (struct ccp_trace_state *) body);
+            }
+            break;
+        case CCP_TRACE_AGENT:
+            replay_agent(&dp, hdr, (struct ccp_trace_agent *) body, body + sizeof(struct ccp_trace_agent));
+            break;
+        case CCP_TRACE_END:
+            if ((f = flow_lookup(hdr->sid)) != NULL) {
+                ccp_connection_free(&dp, f->conn->index);
+                f->conn = NULL;
+            }
+            break;
+        default:
+            skipped++;
+            break;
+        }
+    }
+
+    for (int i = 0; i < num_flows; i++) {
+        folds += flows[i].folds;
+        fold_ns += flows[i].fold_ns;
+    }
+
+    fprintf(stderr, "netns %ld: %lu records (%lu skipped), %d flows, %lu folds, %lu reports, %lu actions, %lu extension messages\n",
+        (long) netns, (unsigned long) records, (unsigned long) skipped, num_flows,
+        (unsigned long) folds, (unsigned long) reports, (unsigned long) actions, (unsigned long) ext_msgs);
+    if (folds > 0) {
+        fprintf(stderr, "fold + program: %.1f ns per ACK\n", (double) fold_ns / folds);
+    }
+
+    fclose(trace);
+    ccp_free(&dp);
+    free(dp.ccp_active_connections);
+    return 0;
+}
@@ -0,0 +1,133 @@
+#!/bin/bash
+#
+# Datapath stress suite: runs a load under each fault injection point (see
+# ccp_fault.h) and reports throughput, connection churn, injected faults,
+# libccp fallbacks and dropped trace records. A scenario fails if the
+# kernel logged an oops, BUG or WARN while it ran.
+#
+# Needs root, the module loaded, debugfs mounted, a kernel with
+# CONFIG_FAULT_INJECTION_DEBUG_FS, and an agent running. Throughput uses
+# iperf3 if it is installed; churn uses ./ccp_churn (make ccp_churn).
+#
+# usage: sudo ./ccp_stress.sh [seconds per scenario] [churn conns/s]
+
+secs=${1:-10}
+churn_rate=${2:-50000}
+ccp=/sys/kernel/debug/ccp
+fault=$ccp/fault
+here=$(dirname "$0")
+
+if [ "$EUID" -ne 0 ]; then
+    echo "error: must run as root"
+    exit 1
+fi
+
+if [ ! -d $fault ]; then
+    echo "error: $fault not found (module not loaded, or no fault injection support)"
+    exit 1
+fi
+
+# counters are cumulative, so report the difference over a scenario
+injected() {
+    awk '{ s += $2 } END { print s + 0 }' $fault/injected
+}
+
+fallbacks() {
+    cat $ccp/fallbacks
+}
+
+trace_dropped() {
+    cat $ccp/trace_dropped 2>/dev/null || echo 0
+}
+
+reset_faults() {
+    for f in fail_send fail_recv corrupt_recv fail_conn; do
+        echo 0 > $fault/$f/probability
+        echo 1 > $fault/$f/interval
+        echo -1 > $fault/$f/times
+        echo 0 > $fault/$f/verbose
+    done
+    echo 0 > $fault/stall_recv_ms
+}
+
+# fault <point> <percent>
+fault() {
+    echo $2 > $fault/$1/probability
+}
+
+throughput() {
+    if ! command -v iperf3 > /dev/null; then
+        echo "-"
+        return
+    fi
+    iperf3 -s -1 -p 5201 > /dev/null 2>&1 &
+    sleep 0.5
+    iperf3 -c 127.0.0.1 -p 5201 -C ccp -P 8 -t $secs -J 2> /dev/null |
+        awk -F'[:,]' '/"sum_received"/ { s = 1 } s && /"bits_per_second"/ { printf "%.2f", $2 / 1e9; exit }'
+    wait
+}
+
+churn() {
+    if [ ! -x $here/ccp_churn ]; then
+        echo "-"
+        return
+    fi
+    $here/ccp_churn -r $churn_rate -d $secs -b 1000 | awk '{ print $4, "failed", $6 + $8 + $10 }'
+}
+
+kernel_lines() {
+    dmesg | wc -l
+}
+
+# kernel_errors <kernel_lines at start>: oopses and warnings logged since
+kernel_errors() {
+    dmesg | tail -n +$(($1 + 1)) | grep -E 'Oops|BUG:|WARNING:|Call Trace|general protection'
+}
+
+failed=0
+
+# scenario <name> <setup command...>
+scenario() {
+    local name=$1
+    shift
+    reset_faults
+    local klines=$(kernel_lines)
+    "$@"
+
+    local inj=$(injected) fb=$(fallbacks) td=$(trace_dropped)
+    local gbps=$(throughput)
+    local conns=$(churn)
+    # let a stall started by the setup command finish before checking the log
+    wait
+    local errors=$(kernel_errors $klines)
+    local result=pass
+    if [ -n "$errors" ]; then
+        result=FAIL
+        failed=$((failed + 1))
+    fi
+    printf "%-14s %8s Gbit/s   churn %-22s injected %-8d fallbacks %-6d trace_dropped %-6d %s\n" \
+        "$name" "$gbps" "$conns" $(($(injected) - inj)) $(($(fallbacks) - fb)) $(($(trace_dropped) - td)) $result
+    if [ -n "$errors" ]; then
+        echo "$errors" | head -20 | sed 's/^/    /'
+    fi
+}
+
+stall() {
+    # stall from a quarter of the way in to near the end of the scenario
+    (sleep $((secs / 4)); echo $((secs * 700)) > $fault/stall_recv_ms) &
+}
+
+echo "$secs s per scenario, churn at $churn_rate conns/s"
+scenario baseline true
+scenario fail_send fault fail_send 10
+scenario fail_send_all fault fail_send 100
+scenario fail_recv fault fail_recv 10
+scenario corrupt_recv fault corrupt_recv 10
+scenario fail_conn fault fail_conn 10
+scenario agent_stall stall
+reset_faults
+
+if [ $failed -gt 0 ]; then
+    echo "$failed scenario(s) logged kernel errors"
+    exit 1
+fi